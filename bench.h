@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Bench Now
+ *
+ * Returns a monotonic timestamp in nanoseconds
+ */
+long long bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Bench Report
+ *
+ * Prints one result line. The name, number of
+ * operations, nanoseconds per operation and
+ * millions of operations per second
+ */
+void bench_report(const char *name, long long ops, long long elapsed_ns) {
+    double ns_per_op = ops > 0 ? (double)elapsed_ns / ops : 0;
+    double mops = elapsed_ns > 0 ? (double)ops * 1000.0 / elapsed_ns : 0;
+    printf("%-32s %12lld ops %10.1f ns/op %10.2f Mops/s\n", name, ops,
+           ns_per_op, mops);
+}
+
+/* Compare Times
+ *
+ * Orders times in nanoseconds for qsort
+ */
+int compare_times(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* Bench Argument
+ *
+ * Reads a numeric argument, or returns the
+ * default if it was not given
+ */
+long bench_arg(int argc, char **argv, int index, long default_value) {
+    if (argc <= index) {
+        return default_value;
+    }
+    return strtol(argv[index], NULL, 10);
+}
@@ -0,0 +1,224 @@
+// System files
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Local files
+#include "bench.h"
+
+/* Bingo Benchmark
+ *
+ * Times the functions of bingo.h one call at a time, and
+ * counts the allocations they make by sending the ones
+ * in bingo.h through counting wrappers
+ *
+ * Each benchmark is run until a run takes at least
+ * min_ms, once more to warm up, and then runs times.
+ * The median run is reported with the fastest and
+ * slowest so noisy results stand out
+ *
+ * To measure a new version of a function, add it to
+ * the list of benchmarks next to the one it replaces
+ *
+ * ./bench_bingo [min_ms] [runs]
+ */
+uint64_t allocations;
+
+void *counted_malloc(size_t size) {
+    allocations++;
+    return malloc(size);
+}
+
+void *counted_calloc(size_t count, size_t size) {
+    allocations++;
+    return calloc(count, size);
+}
+
+void *counted_realloc(void *ptr, size_t size) {
+    allocations++;
+    return realloc(ptr, size);
+}
+
+#define malloc counted_malloc
+#define calloc counted_calloc
+#define realloc counted_realloc
+#include "bingo.h"
+#undef malloc
+#undef calloc
+#undef realloc
+
+// The most runs that are kept for the median
+#define MAX_RUNS 64
+
+struct bingo_bench {
+    const char *name;
+
+    // Gets ready for the first call of op
+    void (*setup)();
+
+    // Does call i of the benchmark
+    void (*op)(long i);
+
+    // Set for functions that print, which print to /dev/null
+    int quiet;
+};
+
+int **board;
+int pristine[25];
+int winning[25];
+
+// Keeps the compiler from removing calls
+volatile long sink;
+
+/* Setup Board
+ *
+ * Makes a board and keeps a copy of it
+ */
+void setup_board() {
+    reset_used();
+    if (board != NULL) {
+        remove_board(board);
+    }
+    board = generate_board_values();
+    memcpy(pristine, *board, sizeof(pristine));
+
+    // The same board with the first row called
+    memcpy(winning, pristine, sizeof(winning));
+    memset(winning, 0, 5 * sizeof(int));
+}
+
+/* Setup Winner
+ *
+ * Makes a board that has won on its first row
+ */
+void setup_winner() {
+    setup_board();
+    memcpy(*board, winning, sizeof(winning));
+}
+
+// The benchmarks, each op does call i of its benchmark
+
+void op_generate_board_values(long i) {
+    (void)i;
+    int **new_board = generate_board_values();
+    sink = new_board[0][0];
+    remove_board(new_board);
+}
+
+void op_call_ball(long i) {
+    (void)i;
+    int ball = call_ball();
+    if (ball == -1) {
+        // Every ball was called, so start a new game
+        reset_used();
+    }
+    sink = ball;
+}
+
+void op_is_match(long i) {
+    // Call every ball once a game, then start over
+    if (i % 75 == 0) {
+        memcpy(*board, pristine, sizeof(pristine));
+    }
+    sink = is_match(board, i % 75 + 1);
+}
+
+void op_is_winner(long i) {
+    (void)i;
+    sink = is_winner(board);
+}
+
+void op_print_board(long i) {
+    (void)i;
+    print_board(board);
+}
+
+struct bingo_bench benches[] = {
+    {"generate_board_values", setup_board, op_generate_board_values, 0},
+    {"call_ball", setup_board, op_call_ball, 0},
+    {"is_match (75 balls a game)", setup_board, op_is_match, 0},
+    {"is_winner (no winner)", setup_board, op_is_winner, 0},
+    {"is_winner (row winner)", setup_winner, op_is_winner, 1},
+    {"print_board", setup_board, op_print_board, 1},
+};
+
+/* Time Run
+ *
+ * Calls op iterations times and adds the
+ * allocations the calls made to allocated
+ * Returns the time taken in ns
+ */
+long long time_run(struct bingo_bench *b, long iterations,
+                   uint64_t *allocated) {
+    b->setup();
+    uint64_t before = allocations;
+    long long started = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        b->op(i);
+    }
+    long long elapsed = bench_now() - started;
+    *allocated += allocations - before;
+    return elapsed;
+}
+
+/* Run Bench
+ *
+ * Finds how many calls take min_ms, warms up, and
+ * prints the median of runs runs and its allocations
+ */
+void run_bench(struct bingo_bench *b, long min_ms, long runs) {
+    // Output of functions that print goes to /dev/null
+    int saved_stdout = -1;
+    if (b->quiet) {
+        fflush(stdout);
+        saved_stdout = dup(STDOUT_FILENO);
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+
+    uint64_t allocated = 0;
+    long iterations = 1;
+    while (time_run(b, iterations, &allocated) < min_ms * 1000000LL) {
+        iterations *= 2;
+    }
+    time_run(b, iterations, &allocated);
+
+    long long times[MAX_RUNS];
+    allocated = 0;
+    for (long run = 0; run < runs; run++) {
+        times[run] = time_run(b, iterations, &allocated);
+    }
+    qsort(times, runs, sizeof(times[0]), compare_times);
+
+    if (b->quiet) {
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+
+    double calls = (double)iterations * runs;
+    printf("%-32s %12ld ops %10.1f ns/op %8.2f allocs/op "
+           "(%.1f to %.1f ns/op)\n",
+           b->name, iterations, (double)times[runs / 2] / iterations,
+           allocated / calls, (double)times[0] / iterations,
+           (double)times[runs - 1] / iterations);
+}
+
+int main(int argc, char **argv) {
+    long min_ms = bench_arg(argc, argv, 1, 100);
+    long runs = bench_arg(argc, argv, 2, 5);
+    if (min_ms <= 0 || runs <= 0 || runs > MAX_RUNS) {
+        fprintf(stderr, "min_ms must be above 0 and runs from 1 to %d\n",
+                MAX_RUNS);
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        run_bench(&benches[i], min_ms, runs);
+    }
+    return 0;
+}
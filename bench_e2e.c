@@ -0,0 +1,799 @@
+// System files
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Local files
+#include "bench.h"
+#include "bingo.h"
+#include "msg.h"
+#include "fragments.h"
+#include "bench_net.h"
+#include "metrics.h"
+
+/* End to End Benchmark
+ *
+ * Starts a server on loopback and plays M games of N
+ * players against it, every player with its own socket
+ *
+ * join      from sending a 'j' to having the whole roster
+ *           of the 'j' answer
+ * converge  from the last player of a game sending an
+ *           'l' until every player of the game has the
+ *           roster of it joining again
+ * ball      from the host sending a ball to a player
+ *           until that player ran is_match on it
+ * fanout    from the host sending a ball until the last
+ *           player of the game ran is_match on it
+ *
+ * The results are printed as one line of JSON, so runs
+ * of different builds and sizes can be compared
+ *
+ * ./bench_e2e [-g games] [-n players] [-r churn_rounds]
+ *             [-b balls] [-W join_window] [-T timeout_ms]
+ *             [-s server] [-w workers] [-P port]
+ */
+#define DEFAULT_GAMES 4
+#define DEFAULT_PLAYERS 8
+#define DEFAULT_ROUNDS 5
+#define DEFAULT_BALLS 20
+#define DEFAULT_WINDOW 64
+#define DEFAULT_TIMEOUT 2000
+#define DEFAULT_PORT 7500
+
+// How long the server has to start, in ms
+#define STARTUP_TIMEOUT 2000
+
+struct player {
+    int sock;
+    struct sockaddr_in addr;
+    int game_index;
+
+    // The roster this player has, kept as a version
+    // and a count like the client does
+    unsigned int version;
+    int members;
+    int joined;
+
+    // The request waiting for an answer and when
+    // it was sent in ns
+    char pending;
+    uint64_t sent;
+
+    int **board;
+
+    // Made the first time a fragment arrives
+    struct reassembly *incoming;
+};
+
+struct game {
+    unsigned int game;
+    int first;
+    int joined;
+
+    // The version every player needs to converge, 0 until
+    // the player that left has joined again
+    unsigned int target;
+    int converged;
+    uint64_t churn_started;
+
+    // Players that ran is_match on the current ball
+    int matched;
+    uint64_t ball_sent;
+};
+
+// Options
+int game_count = DEFAULT_GAMES;
+int player_count = DEFAULT_PLAYERS;
+int rounds = DEFAULT_ROUNDS;
+int balls = DEFAULT_BALLS;
+int join_window = DEFAULT_WINDOW;
+int timeout = DEFAULT_TIMEOUT;
+const char *server_path = "./server";
+const char *workers = NULL;
+unsigned short port = DEFAULT_PORT;
+
+struct sockaddr_in server_address;
+pid_t server_pid;
+int events;
+
+struct player *players;
+struct game *games;
+
+// The count of answers the current step is waiting for
+int waiting;
+
+// Players yet to send their 'j' in the join step
+int next_join;
+
+// The player whose fragments are being put together
+struct player *receiving;
+
+// Results
+struct histogram join_latency;
+struct histogram converge_latency;
+struct histogram ball_latency;
+struct histogram fanout_latency;
+uint64_t join_failures;
+uint64_t timeouts;
+uint64_t resyncs;
+uint64_t messages_lost;
+uint64_t pings;
+
+// Function Prototypes
+void parse_options(int argc, char **argv);
+void start_server();
+void stop_server();
+void open_players();
+void send_request(struct player *p, char msg_type, unsigned int game,
+                  const void *msg, size_t length);
+void start_join();
+void pump();
+void receive(struct player *p);
+void handle_message(struct player *p, packet *data,
+                    struct sockaddr_in *from);
+void set_version(struct player *p, unsigned int version);
+void game_converged(struct game *g);
+void apply_roster(struct player *p, packet *data);
+void apply_delta(struct player *p, packet *data);
+void request_resync(struct player *p, unsigned int game);
+void handle_answer(struct player *p, packet *data);
+void receive_ball(struct player *p, packet *data);
+void message_lost(fragment *info, unsigned int game);
+void create_games();
+void join_games();
+void churn();
+void call_balls();
+void print_histogram(const char *name, struct histogram *h);
+void print_results(double elapsed);
+
+int main(int argc, char **argv) {
+    parse_options(argc, argv);
+
+    // Every player needs a descriptor
+    bench_raise_fd_limit();
+
+    events = epoll_create1(0);
+    if (events == -1) {
+        perror("epoll_create1");
+        return 1;
+    }
+    open_players();
+    start_server();
+
+    long long started = bench_now();
+    create_games();
+    join_games();
+    churn();
+    call_balls();
+    double elapsed = (bench_now() - started) / 1e9;
+
+    stop_server();
+    print_results(elapsed);
+    return 0;
+}
+
+/* Parse Options
+ *
+ * Reads the size of the run and how to start the server
+ */
+void parse_options(int argc, char **argv) {
+    int option;
+    while ((option = getopt(argc, argv, "g:n:r:b:W:T:s:w:P:")) != -1) {
+        switch (option) {
+            case 'g':
+                game_count = atoi(optarg);
+                break;
+            case 'n':
+                player_count = atoi(optarg);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            case 'b':
+                balls = atoi(optarg);
+                break;
+            case 'W':
+                join_window = atoi(optarg);
+                break;
+            case 'T':
+                timeout = atoi(optarg);
+                break;
+            case 's':
+                server_path = optarg;
+                break;
+            case 'w':
+                workers = optarg;
+                break;
+            case 'P':
+                port = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr,
+                        "Usage: %s [-g games] [-n players] "
+                        "[-r churn_rounds] [-b balls] [-W join_window] "
+                        "[-T timeout_ms] [-s server] [-w workers] "
+                        "[-P port]\n",
+                        argv[0]);
+                exit(1);
+        }
+    }
+
+    if (game_count <= 0 || player_count <= 0 || join_window <= 0 ||
+        timeout <= 0) {
+        fprintf(stderr, "%s\n",
+                "games, players, join_window and timeout must be above 0");
+        exit(1);
+    }
+
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    server_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+/* Start Server
+ *
+ * Runs the server with room for every game and player,
+ * and waits until it answers an 's'. Each worker gets a
+ * share of the games and creates are spread by address,
+ * so there is room for twice the games
+ */
+void start_server() {
+    char max_games[16];
+    char max_players[16];
+    char server_port[16];
+    snprintf(max_games, sizeof(max_games), "%d", 2 * game_count);
+    snprintf(max_players, sizeof(max_players), "%d", player_count);
+    snprintf(server_port, sizeof(server_port), "%u", port);
+
+    const char *args[12];
+    int count = 0;
+    args[count++] = server_path;
+    args[count++] = "-g";
+    args[count++] = max_games;
+    args[count++] = "-p";
+    args[count++] = max_players;
+    args[count++] = "-l";
+    args[count++] = "error";
+    if (workers != NULL) {
+        args[count++] = "-w";
+        args[count++] = workers;
+    }
+    args[count++] = server_port;
+    args[count] = NULL;
+
+    server_pid = fork();
+    if (server_pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (server_pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        execv(server_path, (char **)args);
+        perror("execv");
+        _exit(1);
+    }
+
+    // The first player asks until the server answers
+    struct player *p = &players[0];
+    uint64_t give_up = metrics_clock() + STARTUP_TIMEOUT * 1000000ULL;
+    while (metrics_clock() < give_up) {
+        message_header header;
+        memset(&header, 0, sizeof(header));
+        header.msg_type = 's';
+        bench_send(p->sock, &header, NULL, &server_address, 1);
+        usleep(50000);
+
+        packet data;
+        if (recv(p->sock, &data, sizeof(data), 0) > 0) {
+            // Answers to the other asks may still come
+            usleep(50000);
+            while (recv(p->sock, &data, sizeof(data), 0) > 0) {
+            }
+            return;
+        }
+    }
+    fprintf(stderr, "The server did not start on port %u\n", port);
+    stop_server();
+    exit(1);
+}
+
+/* Stop Server
+ *
+ * Stops the server and waits for it to end
+ */
+void stop_server() {
+    kill(server_pid, SIGTERM);
+    waitpid(server_pid, NULL, 0);
+}
+
+/* Open Players
+ *
+ * Gives every player a socket of its own on
+ * the loopback address, watched by events
+ */
+void open_players() {
+    int total = game_count * player_count;
+    players = (struct player *)calloc(total, sizeof(struct player));
+    games = (struct game *)calloc(game_count, sizeof(struct game));
+
+    for (int i = 0; i < total; i++) {
+        struct player *p = &players[i];
+        p->sock = bench_open_socket(events, i, &p->addr);
+        p->game_index = i / player_count;
+        p->board = generate_board_values();
+    }
+
+    for (int i = 0; i < game_count; i++) {
+        games[i].first = i * player_count;
+    }
+}
+
+/* Send Request
+ *
+ * Sends a request to the server and
+ * notes when it was sent
+ */
+void send_request(struct player *p, char msg_type, unsigned int game,
+                  const void *msg, size_t length) {
+    message_header header;
+    memset(&header, 0, sizeof(header));
+    header.msg_type = msg_type;
+    header.game = game;
+    header.msg_length = length;
+
+    p->pending = msg_type;
+    p->sent = metrics_clock();
+    bench_send(p->sock, &header, msg, &server_address, 1);
+}
+
+/* Pump
+ *
+ * Handles packets until the answers the current step
+ * waits for are in, or no packet arrives for timeout ms
+ * more than it takes to ask for a lost message again
+ * Answers still missing are counted as timeouts
+ */
+void pump() {
+    struct epoll_event ready[256];
+    uint64_t quiet = (timeout + FRAGMENT_TIMEOUT) * 1000000ULL;
+    uint64_t give_up = metrics_clock() + quiet;
+    uint64_t next_expire = 0;
+    while (waiting > 0 && metrics_clock() < give_up) {
+        int count = epoll_wait(events, ready, 256, 1);
+        if (count > 0) {
+            give_up = metrics_clock() + quiet;
+        }
+        for (int i = 0; i < count; i++) {
+            receive(&players[ready[i].data.u32]);
+        }
+
+        // Messages that stopped arriving are asked for again
+        uint64_t now = metrics_clock() / 1000000;
+        if (now >= next_expire) {
+            for (int i = 0; i < game_count * player_count; i++) {
+                if (players[i].incoming != NULL) {
+                    receiving = &players[i];
+                    reassembly_expire(players[i].incoming, now);
+                }
+            }
+            next_expire = now + FRAGMENT_TIMEOUT / 4;
+        }
+    }
+    timeouts += waiting;
+    waiting = 0;
+}
+
+/* Receive
+ *
+ * Reads every packet waiting on the socket of a player
+ */
+void receive(struct player *p) {
+    packet data;
+    struct sockaddr_in from;
+    while (bench_receive(p->sock, &data, &from)) {
+        handle_message(p, &data, &from);
+    }
+}
+
+/* Handle Message
+ *
+ * Does what the client does with a packet
+ */
+void handle_message(struct player *p, packet *data,
+                    struct sockaddr_in *from) {
+    switch (data->header.msg_type) {
+        case 'p':
+            bench_answer_ping(p->sock, data, from);
+            pings++;
+            break;
+        case 'a':
+        case 'd':
+            apply_delta(p, data);
+            break;
+        case 'u':
+            // Answers a join whose roster was lost
+            if (p->pending == 'j') {
+                handle_answer(p, data);
+            } else {
+                apply_roster(p, data);
+            }
+            break;
+        case 'm':
+            receive_ball(p, data);
+            break;
+        case 'f': {
+            receiving = p;
+            packet *whole = bench_reassemble(
+                &p->incoming, data, metrics_clock() / 1000000, message_lost);
+            if (whole != NULL) {
+                handle_message(p, whole, from);
+                free(whole);
+            }
+            break;
+        }
+        default:
+            if (data->header.msg_type == p->pending) {
+                handle_answer(p, data);
+            }
+            break;
+    }
+}
+
+/* Set Version
+ *
+ * Moves a player to a newer roster, and counts the
+ * player once it has the roster its game waits for
+ */
+void set_version(struct player *p, unsigned int version) {
+    struct game *g = &games[p->game_index];
+    unsigned int old = p->version;
+    p->version = version;
+    if (g->target == 0 || !p->joined) {
+        return;
+    }
+    if ((int)(old - g->target) < 0 && (int)(version - g->target) >= 0) {
+        g->converged++;
+        if (g->converged == g->joined) {
+            game_converged(g);
+        }
+    }
+}
+
+/* Game Converged
+ *
+ * Every player of a game has the roster it waits for
+ */
+void game_converged(struct game *g) {
+    histogram_record(&converge_latency, metrics_clock() - g->churn_started);
+    g->target = 0;
+    waiting--;
+}
+
+/* Apply Roster
+ *
+ * Takes the whole roster of a 'j' or 'u'
+ */
+void apply_roster(struct player *p, packet *data) {
+    unsigned int version;
+    if (data->header.msg_length < sizeof(version)) {
+        return;
+    }
+    memcpy(&version, data->msg, sizeof(version));
+    p->members = (data->header.msg_length - sizeof(version)) /
+                 sizeof(struct sockaddr_in);
+    set_version(p, version);
+}
+
+/* Apply Delta
+ *
+ * Takes one change to the roster, and asks for the
+ * whole roster again when a change was missed
+ */
+void apply_delta(struct player *p, packet *data) {
+    roster_delta delta;
+    if (!p->joined || data->header.msg_length < sizeof(delta)) {
+        return;
+    }
+    memcpy(&delta, data->msg, sizeof(delta));
+    if ((int)(delta.version - p->version) <= 0) {
+        return;
+    }
+    if (delta.version != p->version + 1) {
+        request_resync(p, data->header.game);
+        return;
+    }
+    p->members += data->header.msg_type == 'a' ? 1 : -1;
+    set_version(p, delta.version);
+}
+
+/* Request Resync
+ *
+ * Asks the server for the whole roster with a 'y'
+ */
+void request_resync(struct player *p, unsigned int game) {
+    resyncs++;
+    message_header header;
+    memset(&header, 0, sizeof(header));
+    header.msg_type = 'y';
+    header.game = game;
+    bench_send(p->sock, &header, NULL, &server_address, 1);
+}
+
+/* Handle Answer
+ *
+ * Takes the answer to a 'c', 'j' or 'l'
+ */
+void handle_answer(struct player *p, packet *data) {
+    struct game *g = &games[p->game_index];
+    char msg_type = p->pending;
+    p->pending = 0;
+
+    if (data->header.msg_error != '\0') {
+        if (msg_type != 'l') {
+            join_failures++;
+        }
+        waiting--;
+        if (msg_type == 'j' && next_join >= 0) {
+            start_join();
+        }
+        return;
+    }
+
+    switch (msg_type) {
+        case 'c':
+            g->game = data->header.game;
+            memcpy(&p->version, data->msg, sizeof(p->version));
+            p->members = 1;
+            p->joined = 1;
+            g->joined++;
+            waiting--;
+            break;
+        case 'j':
+            histogram_record(&join_latency, metrics_clock() - p->sent);
+            p->joined = 1;
+            g->joined++;
+            apply_roster(p, data);
+            if (next_join >= 0) {
+                waiting--;
+                start_join();
+                break;
+            }
+
+            // Joined again while churning, every player
+            // has to reach the version it got
+            g->target = p->version;
+            g->converged = 0;
+            for (int i = 0; i < player_count; i++) {
+                struct player *other = &players[g->first + i];
+                if (other->joined &&
+                    (int)(other->version - g->target) >= 0) {
+                    g->converged++;
+                }
+            }
+            if (g->converged == g->joined) {
+                game_converged(g);
+            }
+            break;
+        case 'l':
+            p->joined = 0;
+            p->version = 0;
+            p->members = 0;
+            g->joined--;
+            waiting--;
+            break;
+    }
+}
+
+/* Receive Ball
+ *
+ * Runs is_match on a ball from the host
+ */
+void receive_ball(struct player *p, packet *data) {
+    struct game *g = &games[p->game_index];
+    if (data->header.game != g->game || g->ball_sent == 0) {
+        return;
+    }
+    is_match(p->board, atoi(data->msg));
+
+    uint64_t now = metrics_clock();
+    histogram_record(&ball_latency, now - g->ball_sent);
+    g->matched++;
+    if (g->matched == g->joined) {
+        histogram_record(&fanout_latency, now - g->ball_sent);
+        g->ball_sent = 0;
+        waiting--;
+    }
+}
+
+/* Message Lost
+ *
+ * Counts a message that did not all arrive. A lost roster
+ * is asked for again as the client does, and the 'u' that
+ * answers is taken as the answer to a lost 'j'
+ */
+void message_lost(fragment *info, unsigned int game) {
+    messages_lost++;
+    if (info->msg_type == 'j' || info->msg_type == 'u') {
+        request_resync(receiving, game);
+    }
+}
+
+/* Create Games
+ *
+ * The first player of every game makes it
+ */
+void create_games() {
+    for (int i = 0; i < game_count; i++) {
+        send_request(&players[games[i].first], 'c', 0, "host", 5);
+    }
+    waiting = game_count;
+    pump();
+}
+
+/* Start Join
+ *
+ * Sends the 'j' of the next player that is not a host
+ */
+void start_join() {
+    int total = game_count * player_count;
+    while (next_join < total) {
+        struct player *p = &players[next_join];
+        next_join++;
+        struct game *g = &games[p->game_index];
+        if (p != &players[g->first] && g->game != 0) {
+            send_request(p, 'j', g->game, "player", 7);
+            return;
+        }
+    }
+}
+
+/* Join Games
+ *
+ * Every other player joins, with at most
+ * join_window joins waiting at once
+ */
+void join_games() {
+    next_join = 0;
+    waiting = 0;
+    for (int i = 0; i < game_count; i++) {
+        if (games[i].game != 0) {
+            waiting += player_count - 1;
+        }
+    }
+    for (int i = 0; i < join_window; i++) {
+        start_join();
+    }
+    pump();
+    next_join = -1;
+}
+
+/* Churn
+ *
+ * In every round the last player of each game leaves and
+ * joins again, and the game converges on the new roster
+ */
+void churn() {
+    for (int round = 0; round < rounds; round++) {
+        waiting = 0;
+        for (int i = 0; i < game_count; i++) {
+            struct game *g = &games[i];
+            struct player *p = &players[g->first + player_count - 1];
+            g->target = 0;
+            g->churn_started = 0;
+            if (player_count > 1 && p->joined) {
+                g->churn_started = metrics_clock();
+                send_request(p, 'l', g->game, NULL, 0);
+                waiting++;
+            }
+        }
+        pump();
+
+        for (int i = 0; i < game_count; i++) {
+            struct game *g = &games[i];
+            struct player *p = &players[g->first + player_count - 1];
+            if (g->churn_started != 0 && !p->joined) {
+                send_request(p, 'j', g->game, "player", 7);
+                waiting++;
+            }
+        }
+        pump();
+    }
+}
+
+/* Call Balls
+ *
+ * The host of every game sends each ball to every
+ * player, itself included, as the client does
+ */
+void call_balls() {
+    for (int call = 0; call < balls; call++) {
+        int ball = call_ball();
+        if (ball == -1) {
+            // Every ball was called, start a new round
+            reset_used();
+            for (int i = 0; i < game_count * player_count; i++) {
+                remove_board(players[i].board);
+                players[i].board = generate_board_values();
+            }
+            ball = call_ball();
+        }
+
+        message_header header;
+        memset(&header, 0, sizeof(header));
+        header.msg_type = 'm';
+        char ball_string[20];
+        snprintf(ball_string, sizeof(ball_string), "%d", ball);
+        header.msg_length = strlen(ball_string) + 1;
+
+        waiting = 0;
+        for (int i = 0; i < game_count; i++) {
+            struct game *g = &games[i];
+            struct player *host = &players[g->first];
+            if (!host->joined) {
+                continue;
+            }
+            header.game = g->game;
+            g->matched = 0;
+            g->ball_sent = metrics_clock();
+            for (int j = 0; j < player_count; j++) {
+                struct player *p = &players[g->first + j];
+                if (p->joined) {
+                    bench_send(host->sock, &header, ball_string, &p->addr, 0);
+                }
+            }
+            waiting++;
+        }
+        pump();
+        for (int i = 0; i < game_count; i++) {
+            games[i].ball_sent = 0;
+        }
+    }
+}
+
+/* Print Histogram
+ *
+ * Prints a histogram as a JSON object, in us
+ */
+void print_histogram(const char *name, struct histogram *h) {
+    printf("\"%s\":{\"count\":%lu,\"mean_us\":%.1f,\"p50_us\":%.1f,"
+           "\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}",
+           name, (unsigned long)h->count,
+           h->count == 0 ? 0 : (double)h->sum / h->count / 1e3,
+           histogram_percentile(h, 50) / 1e3,
+           histogram_percentile(h, 90) / 1e3,
+           histogram_percentile(h, 99) / 1e3, h->max / 1e3);
+}
+
+/* Print Results
+ *
+ * Prints the run as one line of JSON
+ */
+void print_results(double elapsed) {
+    printf("{\"games\":%d,\"players\":%d,\"workers\":\"%s\","
+           "\"seconds\":%.3f,",
+           game_count, player_count, workers == NULL ? "" : workers,
+           elapsed);
+    print_histogram("join", &join_latency);
+    printf(",");
+    print_histogram("converge", &converge_latency);
+    printf(",");
+    print_histogram("ball", &ball_latency);
+    printf(",");
+    print_histogram("fanout", &fanout_latency);
+    printf(",\"join_failures\":%lu,\"timeouts\":%lu,\"resyncs\":%lu,"
+           "\"messages_lost\":%lu,\"pings\":%lu}\n",
+           (unsigned long)join_failures, (unsigned long)timeouts,
+           (unsigned long)resyncs, (unsigned long)messages_lost,
+           (unsigned long)pings);
+}
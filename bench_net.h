@@ -0,0 +1,151 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+/* Bench Net
+ *
+ * What the load tools share to run many players in one
+ * process. Every player has a socket of its own on the
+ * loopback address, all watched by one epoll set, and
+ * talks v2 to the server and v1 to other players
+ *
+ * Include msg.h and fragments.h before this file
+ */
+
+/* Bench Raise FD Limit
+ *
+ * Lets the process open as many sockets as it is allowed
+ */
+void bench_raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/* Bench Open Socket
+ *
+ * Opens a non blocking socket on the loopback address
+ * and adds it to events with index as its data. The
+ * address it got is written to addr if it is not NULL
+ * Exits if the socket can not be opened
+ */
+int bench_open_socket(int events, uint32_t index, struct sockaddr_in *addr) {
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(local);
+
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sock == -1 ||
+        bind(sock, (struct sockaddr *)&local, sizeof(local)) == -1 ||
+        getsockname(sock, (struct sockaddr *)&local, &length) == -1) {
+        fprintf(stderr, "Failed to open socket %u: %s\n", index,
+                strerror(errno));
+        exit(1);
+    }
+
+    // The roster of a large game arrives as a burst of fragments
+    int buffer_size = 1 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size,
+               sizeof(buffer_size));
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u32 = index;
+    epoll_ctl(events, EPOLL_CTL_ADD, sock, &event);
+
+    if (addr != NULL) {
+        *addr = local;
+    }
+    return sock;
+}
+
+/* Bench Send
+ *
+ * Sends msg_length bytes of msg with a v2
+ * header, or a v1 header if v2 is 0
+ */
+void bench_send(int sock, message_header *header, const void *msg,
+                struct sockaddr_in *to, int v2) {
+    packet out;
+    size_t length;
+    if (v2) {
+        length = header_encode_v2(header, (unsigned char *)&out);
+    } else {
+        memcpy(&out.header, header, sizeof(out.header));
+        length = sizeof(out.header);
+    }
+    if (msg != NULL && header->msg_length > 0) {
+        memcpy((char *)&out + length, msg, header->msg_length);
+    }
+    sendto(sock, &out, length + header->msg_length, 0, (struct sockaddr *)to,
+           sizeof(*to));
+}
+
+/* Bench Receive
+ *
+ * Reads the next valid packet waiting on a socket and
+ * ends its message with a terminator, as the client does
+ * Returns 0 once there are none left
+ */
+int bench_receive(int sock, packet *data, struct sockaddr_in *from) {
+    while (1) {
+        socklen_t addrlen = sizeof(*from);
+        ssize_t length = recvfrom(sock, data, sizeof(*data), 0,
+                                  (struct sockaddr *)from, &addrlen);
+        if (length == -1) {
+            return 0;
+        }
+        int version = packet_decode(data, length);
+        if (version == -1) {
+            continue;
+        }
+        if (version == 1 && (size_t)length < sizeof(*data)) {
+            ((char *)data)[length] = '\0';
+        }
+        return 1;
+    }
+}
+
+/* Bench Answer Ping
+ *
+ * Answers a ping with the game number it came with
+ */
+void bench_answer_ping(int sock, packet *ping, struct sockaddr_in *from) {
+    message_header header;
+    memset(&header, 0, sizeof(header));
+    header.msg_type = 'p';
+    header.game = ping->header.game;
+    bench_send(sock, &header, NULL, from, 1);
+}
+
+/* Bench Reassemble
+ *
+ * Adds an 'f' piece to the messages a player is putting
+ * together, making the reassembly the first time
+ * Returns the whole message once it has arrived, which
+ * the caller frees, otherwise NULL
+ */
+packet *bench_reassemble(struct reassembly **incoming, packet *piece,
+                         uint64_t now, void (*lost)(fragment *,
+                                                    unsigned int)) {
+    if (*incoming == NULL) {
+        *incoming = (struct reassembly *)malloc(sizeof(struct reassembly));
+        if (*incoming == NULL) {
+            return NULL;
+        }
+        reassembly_init(*incoming, lost);
+    }
+    reassembly_expire(*incoming, now);
+    return reassembly_add(*incoming, piece, now);
+}
@@ -0,0 +1,232 @@
+// System files
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local files
+#include "bench.h"
+#include "peer_table.h"
+#include "uthash.h"
+
+/* Peer Registry Benchmark
+ *
+ * Compares the flat peer table keyed by the packed
+ * IP Address and port against the old uthash table
+ * keyed by a "%d:%d" string
+ *
+ * ./bench_peers [peers] [rounds]
+ */
+
+struct peer {
+    char name[20];
+    unsigned int ip_addr;
+    short port;
+    unsigned int game;
+    short status;
+};
+
+struct string_peer {
+    char name[20];
+    char ip_and_port[20];
+    unsigned int game;
+    short status;
+    UT_hash_handle hh;
+};
+
+unsigned int *ips;
+short *ports;
+long *order;
+
+// Keeps the compiler from removing lookups
+volatile unsigned long sink;
+
+/* Get IP Address
+ *
+ * Same parsing the server used to do on every
+ * iteration of the string keyed table
+ */
+unsigned int get_ip(char *ip_port) {
+    int i;
+    for (i = 0; i < 20; i++) {
+        if (ip_port[i] == ':') {
+            break;
+        }
+    }
+    char char_ip[i + 1];
+    strncpy(char_ip, ip_port, i);
+    char_ip[i] = '\0';
+
+    return (unsigned int)strtoul(char_ip, NULL, 0);
+}
+
+/* Get Port
+ *
+ * Same parsing the server used to do on every
+ * iteration of the string keyed table
+ */
+short get_port(char *ip_port) {
+    int j = -1;
+    int k = -1;
+    for (int i = 0; i < 20; i++) {
+        if (j == -1 && ip_port[i] == ':') {
+            j = i + 1;
+        }
+        if (ip_port[i] == '\0') {
+            k = i;
+            break;
+        }
+    }
+    char char_short[k - j + 1];
+    strncpy(char_short, ip_port + j, k - j);
+    char_short[k - j] = '\0';
+
+    return (short)strtoul(char_short, NULL, 0);
+}
+
+/* Bench Flat
+ *
+ * Insert, lookup, sweep and delete with the flat table
+ */
+void bench_flat(long peers, long rounds) {
+    struct peer *records = (struct peer *)calloc(peers, sizeof(struct peer));
+    long long insert_ns = 0, find_ns = 0, sweep_ns = 0, delete_ns = 0;
+
+    for (long r = 0; r < rounds; r++) {
+        struct peer_table table;
+        peer_table_init(&table, 16);
+
+        long long start = bench_now();
+        for (long i = 0; i < peers; i++) {
+            records[i].ip_addr = ips[i];
+            records[i].port = ports[i];
+            peer_table_insert(&table, peer_key(ips[i], ports[i]), &records[i]);
+        }
+        insert_ns += bench_now() - start;
+
+        start = bench_now();
+        for (long i = 0; i < peers; i++) {
+            long j = order[i];
+            struct peer *p =
+                peer_table_find(&table, peer_key(ips[j], ports[j]));
+            sink += p->port;
+        }
+        find_ns += bench_now() - start;
+
+        start = bench_now();
+        size_t index = 0;
+        struct peer *p;
+        while ((p = peer_table_next(&table, &index)) != NULL) {
+            sink += p->ip_addr + p->port;
+        }
+        sweep_ns += bench_now() - start;
+
+        start = bench_now();
+        for (long i = 0; i < peers; i++) {
+            long j = order[i];
+            peer_table_remove(&table, peer_key(ips[j], ports[j]));
+        }
+        delete_ns += bench_now() - start;
+
+        peer_table_free(&table);
+    }
+
+    long long ops = peers * rounds;
+    bench_report("flat insert", ops, insert_ns);
+    bench_report("flat lookup", ops, find_ns);
+    bench_report("flat sweep (per peer)", ops, sweep_ns);
+    bench_report("flat delete", ops, delete_ns);
+    free(records);
+}
+
+/* Bench Strings
+ *
+ * Insert, lookup, sweep and delete the way the server
+ * did it with uthash and formatted string keys
+ */
+void bench_strings(long peers, long rounds) {
+    struct string_peer *records =
+        (struct string_peer *)calloc(peers, sizeof(struct string_peer));
+    long long insert_ns = 0, find_ns = 0, sweep_ns = 0, delete_ns = 0;
+
+    for (long r = 0; r < rounds; r++) {
+        struct string_peer *table = NULL;
+
+        long long start = bench_now();
+        for (long i = 0; i < peers; i++) {
+            sprintf(records[i].ip_and_port, "%d:%d", ips[i], ports[i]);
+            struct string_peer *p = &records[i];
+            HASH_ADD_STR(table, ip_and_port, p);
+        }
+        insert_ns += bench_now() - start;
+
+        start = bench_now();
+        for (long i = 0; i < peers; i++) {
+            long j = order[i];
+            char ip_port[20];
+            sprintf(ip_port, "%d:%d", ips[j], ports[j]);
+            struct string_peer *p;
+            HASH_FIND_STR(table, ip_port, p);
+            sink += p->game;
+        }
+        find_ns += bench_now() - start;
+
+        start = bench_now();
+        for (struct string_peer *p = table; p != NULL;
+             p = (struct string_peer *)p->hh.next) {
+            sink += get_ip(p->ip_and_port) + get_port(p->ip_and_port);
+        }
+        sweep_ns += bench_now() - start;
+
+        start = bench_now();
+        for (long i = 0; i < peers; i++) {
+            long j = order[i];
+            char ip_port[20];
+            sprintf(ip_port, "%d:%d", ips[j], ports[j]);
+            struct string_peer *p;
+            HASH_FIND_STR(table, ip_port, p);
+            HASH_DEL(table, p);
+        }
+        delete_ns += bench_now() - start;
+    }
+
+    long long ops = peers * rounds;
+    bench_report("uthash insert", ops, insert_ns);
+    bench_report("uthash lookup", ops, find_ns);
+    bench_report("uthash sweep (per peer)", ops, sweep_ns);
+    bench_report("uthash delete", ops, delete_ns);
+    free(records);
+}
+
+int main(int argc, char **argv) {
+    long peers = bench_arg(argc, argv, 1, 10000);
+    long rounds = bench_arg(argc, argv, 2, 20);
+
+    ips = (unsigned int *)malloc(peers * sizeof(unsigned int));
+    ports = (short *)malloc(peers * sizeof(short));
+    order = (long *)malloc(peers * sizeof(long));
+
+    // Peers spread over a handful of addresses like NATed players
+    srand(1);
+    for (long i = 0; i < peers; i++) {
+        ips[i] = 0x0100007f + ((i / 50000) << 24);
+        ports[i] = (short)(1024 + i % 50000);
+        order[i] = i;
+    }
+
+    // Look peers up in a different order than they were added
+    for (long i = peers - 1; i > 0; i--) {
+        long j = rand() % (i + 1);
+        long t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    printf("peers: %ld rounds: %ld\n", peers, rounds);
+    bench_flat(peers, rounds);
+    bench_strings(peers, rounds);
+
+    free(ips);
+    free(ports);
+    free(order);
+    return 0;
+}
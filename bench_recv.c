@@ -0,0 +1,171 @@
+// System files
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Local files
+#include "bench.h"
+#include "msg.h"
+#include "udp_batch.h"
+
+/* Receive Benchmark
+ *
+ * Compares reading packets with one recvfrom per packet,
+ * like the server used to, against recv_batch_fill
+ *
+ * Each round sends a burst of small packets to a loopback
+ * socket and then times how long it takes to read them all
+ *
+ * ./bench_recv [burst] [rounds]
+ */
+
+int recv_sock;
+int send_sock;
+struct sockaddr_in recv_addr;
+
+/* Send Burst
+ *
+ * Fills the receive buffer with count lobby queries
+ */
+void send_burst(long count) {
+    packet out;
+    memset(&out, 0, sizeof(out));
+    out.header.msg_type = 'q';
+    out.header.msg_length = sizeof(lobby_query);
+
+    struct iovec iov;
+    iov.iov_base = &out;
+    iov.iov_len = sizeof(out.header) + sizeof(lobby_query);
+
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    for (int i = 0; i < UDP_BATCH_SIZE; i++) {
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &recv_addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(recv_addr);
+    }
+
+    long sent = 0;
+    while (sent < count) {
+        long want = count - sent;
+        if (want > UDP_BATCH_SIZE) {
+            want = UDP_BATCH_SIZE;
+        }
+        int done = sendmmsg(send_sock, msgs, want, 0);
+        if (done <= 0) {
+            perror("sendmmsg");
+            exit(1);
+        }
+        sent += done;
+    }
+}
+
+/* Drain Recvfrom
+ *
+ * Reads count packets one system call at a time
+ */
+long drain_recvfrom(long count) {
+    packet in;
+    struct sockaddr_in from;
+    long got = 0;
+
+    while (got < count) {
+        socklen_t addrlen = sizeof(from);
+        if (recvfrom(recv_sock, &in, sizeof(in), 0, (struct sockaddr *)&from,
+                     &addrlen) == -1) {
+            break;
+        }
+        got++;
+    }
+    return got;
+}
+
+/* Drain Batch
+ *
+ * Reads count packets a batch at a time
+ */
+long drain_batch(struct recv_batch *batch, long count) {
+    long got = 0;
+
+    while (got < count) {
+        int received = recv_batch_fill(batch, recv_sock);
+        if (received == -1) {
+            break;
+        }
+        got += received;
+    }
+    return got;
+}
+
+int main(int argc, char **argv) {
+    long burst = bench_arg(argc, argv, 1, 2000);
+    long rounds = bench_arg(argc, argv, 2, 200);
+
+    recv_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    send_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (recv_sock < 0 || send_sock < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    // Make room for a whole burst
+    int buffer = 4 << 20;
+    if (setsockopt(recv_sock, SOL_SOCKET, SO_RCVBUFFORCE, &buffer,
+                   sizeof(buffer)) == -1) {
+        setsockopt(recv_sock, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+    }
+
+    // Give up on a round if packets were dropped
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 200000;
+    setsockopt(recv_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    memset(&recv_addr, 0, sizeof(recv_addr));
+    recv_addr.sin_family = AF_INET;
+    recv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    recv_addr.sin_port = 0;
+    if (bind(recv_sock, (struct sockaddr *)&recv_addr, sizeof(recv_addr))) {
+        perror("bind");
+        return 1;
+    }
+    socklen_t addrlen = sizeof(recv_addr);
+    getsockname(recv_sock, (struct sockaddr *)&recv_addr, &addrlen);
+
+    struct recv_batch batch;
+    recv_batch_init(&batch, UDP_BATCH_SIZE);
+
+    long long recvfrom_ns = 0, batch_ns = 0;
+    long recvfrom_got = 0, batch_got = 0;
+
+    for (long r = 0; r < rounds; r++) {
+        send_burst(burst);
+        long long start = bench_now();
+        recvfrom_got += drain_recvfrom(burst);
+        recvfrom_ns += bench_now() - start;
+
+        send_burst(burst);
+        start = bench_now();
+        batch_got += drain_batch(&batch, burst);
+        batch_ns += bench_now() - start;
+    }
+
+    printf("burst: %ld rounds: %ld batch size: %d\n", burst, rounds,
+           UDP_BATCH_SIZE);
+    bench_report("recvfrom (per packet)", recvfrom_got, recvfrom_ns);
+    bench_report("recvmmsg batch (per packet)", batch_got, batch_ns);
+    if (recvfrom_got != burst * rounds || batch_got != burst * rounds) {
+        printf("dropped: %ld recvfrom, %ld batch\n",
+               burst * rounds - recvfrom_got, burst * rounds - batch_got);
+    }
+
+    recv_batch_free(&batch);
+    close(recv_sock);
+    close(send_sock);
+    return 0;
+}
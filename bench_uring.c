@@ -0,0 +1,411 @@
+// System files
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Local files
+#include "bench.h"
+#include "msg.h"
+#include "fragments.h"
+#include "bench_net.h"
+#include "udp_batch.h"
+#include "uring.h"
+
+/* Uring Benchmark
+ *
+ * Compares the request rate and latency of a plain loopback
+ * echo server reading and writing with recvfrom and sendto,
+ * with recvmmsg and sendmmsg, and with io_uring. Then does
+ * the same with the server answering lobby queries, once
+ * with epoll and once started with -u
+ *
+ * The echo rows only show what each way of reading and
+ * writing costs, the server rows go through the whole
+ * request path of each backend
+ *
+ * The client keeps window requests in flight and times the
+ * answer to every one. Answers come back in the order the
+ * requests were sent, so each is matched to the oldest
+ *
+ * ./bench_uring [requests] [window] [server] [port]
+ */
+#define DEFAULT_SERVER "./server"
+#define DEFAULT_PORT 7520
+
+// How long to wait for the server to answer after starting
+#define STARTUP_TIMEOUT 2000
+
+// A request that stops the echo server
+#define STOP_TYPE 'x'
+
+struct echo_server {
+    const char *name;
+    void *(*run)(void *);
+    int sock;
+    struct sockaddr_in addr;
+};
+
+/* Echo Recvfrom
+ *
+ * Answers every request with its own sendto
+ */
+void *echo_recvfrom(void *ptr) {
+    struct echo_server *server = (struct echo_server *)ptr;
+    packet in;
+    struct sockaddr_in from;
+
+    while (1) {
+        socklen_t addrlen = sizeof(from);
+        ssize_t length = recvfrom(server->sock, &in, sizeof(in), 0,
+                                  (struct sockaddr *)&from, &addrlen);
+        if (length < (ssize_t)sizeof(message_header)) {
+            continue;
+        }
+        if (in.header.msg_type == STOP_TYPE) {
+            break;
+        }
+        sendto(server->sock, &in, length, 0, (struct sockaddr *)&from,
+               addrlen);
+    }
+    return NULL;
+}
+
+/* Echo Batch
+ *
+ * Answers each batch of requests with one sendmmsg
+ */
+void *echo_batch(void *ptr) {
+    struct echo_server *server = (struct echo_server *)ptr;
+    struct recv_batch batch;
+    struct send_batch replies;
+    recv_batch_init(&batch, UDP_BATCH_SIZE);
+    send_batch_init(&replies, UDP_BATCH_SIZE, NULL);
+    send_batch_begin(&replies, server->sock);
+
+    int running = 1;
+    while (running) {
+        if (recv_batch_fill(&batch, server->sock) == -1) {
+            continue;
+        }
+        for (unsigned int i = 0; i < batch.count; i++) {
+            if (batch.packets[i].header.msg_type == STOP_TYPE) {
+                running = 0;
+            }
+            send_batch_copy(&replies, &batch.addrs[i], &batch.packets[i],
+                            batch.msgs[i].msg_len);
+        }
+        send_batch_flush(&replies);
+    }
+
+    send_batch_free(&replies);
+    recv_batch_free(&batch);
+    return NULL;
+}
+
+/* Echo Uring
+ *
+ * Receives with a multishot receive and answers
+ * every round of completions through a send ring
+ */
+void *echo_uring(void *ptr) {
+    struct echo_server *server = (struct echo_server *)ptr;
+    struct uring ring;
+    struct uring send_ring;
+    struct uring_buffers buffers;
+    if (uring_init(&ring, 64) == -1 ||
+        uring_buffers_init(&ring, &buffers, 0, 256, URING_BUFFER_SIZE) ==
+            -1 ||
+        uring_init(&send_ring, UDP_BATCH_SIZE) == -1) {
+        perror("io_uring");
+        exit(1);
+    }
+
+    struct send_batch replies;
+    send_batch_init(&replies, UDP_BATCH_SIZE, NULL);
+    send_batch_begin(&replies, server->sock);
+    replies.flush = uring_send_batch;
+    replies.backend = &send_ring;
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    uring_recv_multishot(&ring, server->sock, &message, &buffers, 0);
+
+    int running = 1;
+    while (running) {
+        if (uring_enter(&ring, 1) == -1) {
+            continue;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+            int result = cqe->res;
+            unsigned int flags = cqe->flags;
+            uring_cqe_seen(&ring);
+
+            if (flags & IORING_CQE_F_BUFFER) {
+                unsigned short id = flags >> IORING_CQE_BUFFER_SHIFT;
+                struct sockaddr_in *from;
+                size_t size;
+                packet *in = uring_received_packet(
+                    buffers.data + (size_t)id * buffers.size, result, &from,
+                    &size);
+                if (in != NULL) {
+                    if (in->header.msg_type == STOP_TYPE) {
+                        running = 0;
+                    }
+                    send_batch_copy(&replies, from, in, size);
+                }
+                uring_buffers_give(&buffers, id);
+            }
+            // Post the receive again only if it ran out of
+            // buffers, any other error would come right back
+            if (flags & IORING_CQE_F_MORE) {
+                continue;
+            }
+            if (result < 0 && result != -ENOBUFS) {
+                fprintf(stderr, "io_uring receive failed: %s\n",
+                        strerror(-result));
+                exit(1);
+            }
+            uring_recv_multishot(&ring, server->sock, &message, &buffers,
+                                 0);
+        }
+        send_batch_flush(&replies);
+    }
+
+    send_batch_free(&replies);
+    uring_free(&send_ring);
+    uring_free(&ring);
+    uring_buffers_free(&buffers);
+    return NULL;
+}
+
+/* Start Server
+ *
+ * Runs the server on port, with flag if it is not NULL,
+ * and waits until it answers a lobby query from sock
+ * Returns its process id, or -1 if it did not start
+ */
+pid_t start_server(const char *path, const char *flag, unsigned short port,
+                   int sock) {
+    char server_port[16];
+    snprintf(server_port, sizeof(server_port), "%u", port);
+
+    const char *args[6];
+    int count = 0;
+    args[count++] = path;
+    args[count++] = "-l";
+    args[count++] = "error";
+    if (flag != NULL) {
+        args[count++] = flag;
+    }
+    args[count++] = server_port;
+    args[count] = NULL;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execv(path, (char **)args);
+        perror("execv");
+        _exit(1);
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    message_header header;
+    memset(&header, 0, sizeof(header));
+    header.msg_type = 'q';
+
+    long long give_up = bench_now() + STARTUP_TIMEOUT * 1000000LL;
+    while (bench_now() < give_up) {
+        bench_send(sock, &header, NULL, &addr, 0);
+        packet in;
+        struct sockaddr_in from;
+        if (bench_receive(sock, &in, &from)) {
+            // Answers to the other asks may still come
+            usleep(50000);
+            while (bench_receive(sock, &in, &from)) {
+            }
+            return pid;
+        }
+    }
+    fprintf(stderr, "%s did not start on port %u\n", path, port);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+/* Open Client
+ *
+ * Opens the socket the requests are sent from
+ * Waits at most wait_ms for an answer
+ */
+int open_client(long wait_ms) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(sock, (struct sockaddr *)&local, sizeof(local));
+
+    struct timeval timeout;
+    timeout.tv_sec = wait_ms / 1000;
+    timeout.tv_usec = (wait_ms % 1000) * 1000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sock;
+}
+
+/* Run Client
+ *
+ * Sends lobby queries to addr with window of them in
+ * flight and prints the rate and the round trip percentiles
+ */
+void run_client(const char *name, struct sockaddr_in *addr, long requests,
+                long window) {
+    // Requests in flight are taken as lost after 200 ms
+    int sock = open_client(200);
+
+    long long *sent_at = (long long *)malloc(requests * sizeof(long long));
+    long long *times = (long long *)malloc(requests * sizeof(long long));
+    message_header header;
+    memset(&header, 0, sizeof(header));
+    header.msg_type = 'q';
+
+    long sent = 0, answered = 0, lost = 0, in_flight = 0;
+    long long start = bench_now();
+    while (answered + lost < requests) {
+        while (in_flight < window && sent < requests) {
+            sent_at[sent] = bench_now();
+            bench_send(sock, &header, NULL, addr, 0);
+            sent++;
+            in_flight++;
+        }
+
+        packet in;
+        struct sockaddr_in from;
+        if (!bench_receive(sock, &in, &from)) {
+            // Give up on everything in flight
+            lost += in_flight;
+            in_flight = 0;
+            continue;
+        }
+        times[answered] = bench_now() - sent_at[answered + lost];
+        answered++;
+        if (in_flight > 0) {
+            in_flight--;
+        }
+    }
+    long long elapsed = bench_now() - start;
+
+    qsort(times, answered, sizeof(long long), compare_times);
+    double rate = elapsed > 0 ? answered * 1e9 / elapsed : 0;
+    double p50 = answered > 0 ? times[answered / 2] / 1000.0 : 0;
+    double p99 = answered > 0 ? times[answered * 99 / 100] / 1000.0 : 0;
+    printf("%-24s %12.0f req/s %10.1f us p50 %10.1f us p99", name, rate, p50,
+           p99);
+    if (lost != 0) {
+        printf(" %ld lost", lost);
+    }
+    printf("\n");
+
+    free(sent_at);
+    free(times);
+    close(sock);
+}
+
+int main(int argc, char **argv) {
+    long requests = bench_arg(argc, argv, 1, 200000);
+    long window = bench_arg(argc, argv, 2, 64);
+    const char *server_path = argc > 3 ? argv[3] : DEFAULT_SERVER;
+    long port = bench_arg(argc, argv, 4, DEFAULT_PORT);
+    if (requests <= 0 || window <= 0) {
+        fprintf(stderr, "%s\n", "requests and window must be above 0");
+        return 1;
+    }
+    if (port <= 0 || port >= 65535) {
+        fprintf(stderr, "%s\n", "port must be from 1 to 65534");
+        return 1;
+    }
+
+    struct echo_server servers[3];
+    servers[0].name = "echo recvfrom/sendto";
+    servers[0].run = echo_recvfrom;
+    servers[1].name = "echo recvmmsg/sendmmsg";
+    servers[1].run = echo_batch;
+    servers[2].name = "echo io_uring";
+    servers[2].run = echo_uring;
+
+    printf("requests: %ld window: %ld\n", requests, window);
+    for (int i = 0; i < 3; i++) {
+        struct echo_server *server = &servers[i];
+        server->sock = socket(AF_INET, SOCK_DGRAM, 0);
+        memset(&server->addr, 0, sizeof(server->addr));
+        server->addr.sin_family = AF_INET;
+        server->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(server->sock, (struct sockaddr *)&server->addr,
+                 sizeof(server->addr))) {
+            perror("bind");
+            return 1;
+        }
+        socklen_t addrlen = sizeof(server->addr);
+        getsockname(server->sock, (struct sockaddr *)&server->addr, &addrlen);
+
+        pthread_t thread;
+        pthread_create(&thread, NULL, server->run, server);
+        run_client(server->name, &server->addr, requests, window);
+
+        // Stop the server
+        int sock = open_client(200);
+        message_header stop;
+        memset(&stop, 0, sizeof(stop));
+        stop.msg_type = STOP_TYPE;
+        bench_send(sock, &stop, NULL, &server->addr, 0);
+        close(sock);
+
+        pthread_join(thread, NULL);
+        close(server->sock);
+    }
+
+    // The same queries through the request path of the server
+    const char *names[2] = {"server epoll", "server io_uring (-u)"};
+    const char *flags[2] = {NULL, "-u"};
+    for (int i = 0; i < 2; i++) {
+        int sock = open_client(50);
+        pid_t pid = start_server(server_path, flags[i], port, sock);
+        close(sock);
+        if (pid == -1) {
+            continue;
+        }
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        run_client(names[i], &addr, requests, window);
+
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
@@ -1,5 +1,6 @@
 // System files
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -10,11 +11,14 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 // Local files
 #include "bingo.h"
 #include "msg.h"
+#include "fragments.h"
+#include "log.h"
 
 char name[20];
 char my_name[20];
@@ -25,16 +29,30 @@ int gen_ball = 0;
 int has_winner = 0;
 int match_count = 0;
 int peer_num = 0;
+int peer_capacity = 0;
 int sock;
 
 pthread_mutex_t print_lock;
 pthread_mutex_t player_lock;
 
 struct sockaddr_in my_addr;
-struct sockaddr_in peer_list[255];
+struct sockaddr_in *peer_list = NULL;
 struct sockaddr_in server_address;
 
 unsigned int game_number = 0;
+unsigned int roster_version = 0;
+
+// The filters and place of the lobby page being browsed
+lobby_query browse_query;
+
+// Checks if the lobby is being watched
+int watching_lobby = 0;
+
+// Set once the server has answered in v2
+int server_v2 = 0;
+
+// Messages from the server that came in fragments
+struct reassembly incoming;
 
 // Functions in this file
 void create_game_request();
@@ -48,13 +66,30 @@ void leave_game_request();
 void leave_game_response(packet *new_packet);
 void parse_args(int argc, char **argv);
 void player_connection_updates(packet *new_packet);
+void roster_delta_update(packet *new_packet);
+int read_roster(packet *new_packet);
+void request_roster_resync(unsigned int game);
 void print_name(packet *new_packet);
 void *read_user_input(void *ptr);
 void receive_message(struct sockaddr_in *from_addr, packet *new_packet);
 void receive_packet();
+void handle_message(struct sockaddr_in *from_addr, packet *new_packet,
+                    int version);
+void message_lost(fragment *info, unsigned int game);
+uint64_t now_ms();
+int reserve_peers(int count);
 void request_open_games();
-void reply_to_ping(struct sockaddr_in *from_addr);
+void browse_games(char *args);
+void get_lobby_page(packet *new_packet);
+void watch_lobby_request();
+void watch_lobby_response(packet *new_packet);
+void get_lobby_changes(packet *new_packet);
+void request_stats();
+void get_stats(packet *new_packet);
+void reply_to_ping(struct sockaddr_in *from_addr, unsigned int game, int v2);
 void send_message(char *msg);
+int send_packet_to(packet *new_packet, struct sockaddr_in *to_addr, int v2);
+int send_to_server(packet *new_packet);
 void stop_generate_ball();
 
 int main(int argc, char **argv) {
@@ -73,6 +108,24 @@ int main(int argc, char **argv) {
         abort();
     }
 
+    // The roster of a large game arrives as a burst of fragments
+    int buffer_size = 4 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+    // Wake up now and then to drop fragments that never finish
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = FRAGMENT_TIMEOUT / 4 * 1000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    reassembly_init(&incoming, message_lost);
+
+    // Errors are written by the log writer so
+    // receiving never waits on stderr
+    if (log_start() == -1) {
+        fprintf(stderr, "%s\n", "Failed to start logging");
+        abort();
+    }
+
     // Thread for reading input
     pthread_t input_thread;
     pthread_create(&input_thread, NULL, read_user_input, NULL);
@@ -147,9 +200,7 @@ void *read_user_input(void *ptr) {
 
         // Clear out an input that is too long
         if (ch == NULL) {
-            pthread_mutex_lock(&print_lock);
-            fprintf(stderr, "%s\n", "Cannot Read the Input");
-            pthread_mutex_unlock(&print_lock);
+            log_line(LOG_ERROR, "%s", "Cannot Read the Input");
             continue;
         }
 
@@ -162,9 +213,7 @@ void *read_user_input(void *ptr) {
 
         // Ensure the first character is a dash
         if (read_line[0] != '-') {
-            pthread_mutex_lock(&print_lock);
-            fprintf(stderr, "%s\n", "Incorrect format");
-            pthread_mutex_unlock(&print_lock);
+            log_line(LOG_WARN, "%s", "Incorrect format");
             continue;
         }
 
@@ -182,9 +231,7 @@ void *read_user_input(void *ptr) {
 
                 // Ensure the game is valid
                 if (new_game_number < 0) {
-                    pthread_mutex_lock(&print_lock);
-                    fprintf(stderr, "%s\n", "Not a valid game");
-                    pthread_mutex_unlock(&print_lock);
+                    log_line(LOG_WARN, "%s", "Not a valid game");
 
                 } else {
                     join_room_request(new_game_number);
@@ -200,11 +247,26 @@ void *read_user_input(void *ptr) {
                 request_open_games();
                 break;
 
+            // 'b' - Browse a page of games
+            case 'b':
+                browse_games(read_line + 2);
+                break;
+
+            // 'w' - Start or stop watching the lobby
+            case 'w':
+                watch_lobby_request();
+                break;
+
             // 'i' - Display game info
             case 'i':
                 get_game_info();
                 break;
 
+            // 't' - Display server stats
+            case 't':
+                request_stats();
+                break;
+
             // 's' - Start game
             case 's':
                 if (gen_ball == 1) {
@@ -222,14 +284,18 @@ void *read_user_input(void *ptr) {
                 printf("-j < game_number > : Join game\n");
                 printf("-l : Leave game\n");
                 printf("-q : Query open games\n");
+                printf(
+                    "-b [ cursor [ min_players [ max_players [ o ] ] ] ] : "
+                    "Browse games a page at a time, -b alone shows the next "
+                    "page, o only shows games that are not full\n");
+                printf("-w : Start or stop watching lobby changes\n");
                 printf("-i : Display game info\n");
+                printf("-t : Display server stats\n");
                 printf("-s : Start or Stop the game\n\n");
                 break;
             default:
-                pthread_mutex_lock(&print_lock);
-                fprintf(stderr, "%s\n%s", "Unknown Command Entered",
-                        "Use -? for help\n\n");
-                pthread_mutex_unlock(&print_lock);
+                log_line(LOG_WARN, "%s\n%s", "Unknown Command Entered",
+                         "Use -? for help\n");
                 break;
         }
     }
@@ -246,58 +312,109 @@ void receive_packet() {
     // Socket where the packet is from
     struct sockaddr_in from_addr;
 
-    // Length of the address
-    socklen_t addrlen = 10;
-
     // Make a new packet
     packet new_packet;
 
     while (1) {
-        if (recvfrom(sock, &new_packet, sizeof(new_packet), 0,
-                     (struct sockaddr *)&from_addr, &addrlen) == -1) {
-            pthread_mutex_lock(&print_lock);
-            fprintf(stderr, "%s\n",
-                    "Ignoring packet that was failed to receive");
-            pthread_mutex_unlock(&print_lock);
+        // Length of the address
+        socklen_t addrlen = sizeof(from_addr);
+
+        ssize_t length = recvfrom(sock, &new_packet, sizeof(new_packet), 0,
+                                  (struct sockaddr *)&from_addr, &addrlen);
+        reassembly_expire(&incoming, now_ms());
+        if (length == -1) {
+            // Nothing arrived before the timeout
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                continue;
+            }
+            log_line(LOG_WARN, "%s",
+                     "Ignoring packet that was failed to receive");
             continue;
         }
 
-        // Check the header for what action to take
-        switch (new_packet.header.msg_type) {
-            case 'c':
-                create_game_response(&new_packet);
-                break;
-            case 'j':
-                join_game_response(&new_packet);
-                break;
-            case 'l':
-                leave_game_response(&new_packet);
-                break;
-            case 'u':
-                player_connection_updates(&new_packet);
-                break;
-            case 'r':
-                get_open_games(&new_packet);
-                break;
-            case 'm':
-                receive_message(&from_addr, &new_packet);
-                break;
-            case 'p':
-                reply_to_ping(&from_addr);
-                break;
-            case 'g':
-                gen_ball = 0;
-                stop_generate_ball();
-                break;
-            case 'n':
-                print_name(&new_packet);
-                break;
-            default:
-                pthread_mutex_lock(&print_lock);
-                fprintf(stderr, "%s\n", "Unknown Packet Received");
-                pthread_mutex_unlock(&print_lock);
-                break;
+        // Only the server sends v2, so answer it in v2 from now on
+        int version = packet_decode(&new_packet, length);
+        if (version == -1) {
+            continue;
+        }
+        if (version == 2) {
+            server_v2 = 1;
+        } else if ((size_t)length < sizeof(new_packet)) {
+            ((char *)&new_packet)[length] = '\0';
         }
+
+        handle_message(&from_addr, &new_packet, version);
+    }
+}
+
+/* Handle Message
+ *
+ * Inspects the header of a message to determine what
+ * action will be taken. A message that came in fragments
+ * is handled once all of it has arrived
+ */
+void handle_message(struct sockaddr_in *from_addr, packet *new_packet,
+                    int version) {
+    // Check the header for what action to take
+    switch (new_packet->header.msg_type) {
+        case 'c':
+            create_game_response(new_packet);
+            break;
+        case 'j':
+            join_game_response(new_packet);
+            break;
+        case 'l':
+            leave_game_response(new_packet);
+            break;
+        case 'u':
+            player_connection_updates(new_packet);
+            break;
+        case 'a':
+        case 'd':
+            roster_delta_update(new_packet);
+            break;
+        case 'y':
+            log_line(LOG_ERROR, "%s", "Could not resync the roster");
+            break;
+        case 'r':
+            get_open_games(new_packet);
+            break;
+        case 'q':
+            get_lobby_page(new_packet);
+            break;
+        case 'w':
+            watch_lobby_response(new_packet);
+            break;
+        case 'v':
+            get_lobby_changes(new_packet);
+            break;
+        case 'm':
+            receive_message(from_addr, new_packet);
+            break;
+        case 'p':
+            reply_to_ping(from_addr, new_packet->header.game, version == 2);
+            break;
+        case 'g':
+            gen_ball = 0;
+            stop_generate_ball();
+            break;
+        case 'n':
+            print_name(new_packet);
+            break;
+        case 's':
+            get_stats(new_packet);
+            break;
+        case 'f': {
+            packet *whole = reassembly_add(&incoming, new_packet, now_ms());
+            if (whole != NULL) {
+                handle_message(from_addr, whole, version);
+                free(whole);
+            }
+            break;
+        }
+        default:
+            log_line(LOG_WARN, "%s", "Unknown Packet Received");
+            break;
     }
 }
 
@@ -310,17 +427,14 @@ void create_game_request() {
     packet new_packet;
     new_packet.header.msg_type = 'c';
     new_packet.header.msg_error = '\0';
-    new_packet.header.msg_length = strlen(name);
+    new_packet.header.game = 0;
+    new_packet.header.msg_length = strlen(name) + 1;
 
     strcpy(new_packet.msg, name);
 
     // Try to send the packet to the server
-    if (sendto(sock, &new_packet, sizeof(new_packet), 0,
-               (struct sockaddr *)&server_address,
-               sizeof(struct sockaddr_in)) == -1) {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%s\n", "Failed to send packet to server");
-        pthread_mutex_unlock(&print_lock);
+    if (send_to_server(&new_packet) == -1) {
+        log_line(LOG_ERROR, "%s", "Failed to send packet to server");
     }
 }
 
@@ -334,18 +448,14 @@ void join_room_request(int new_game_number) {
     new_packet.header.msg_type = 'j';
     new_packet.header.msg_error = '\0';
     new_packet.header.game = new_game_number;
-    new_packet.header.msg_length = strlen(name);
+    new_packet.header.msg_length = strlen(name) + 1;
 
     printf("Player Name:%s", name);
     strcpy(new_packet.msg, name);
 
     // Try and send the packet to the server
-    if (sendto(sock, &new_packet, sizeof(new_packet), 0,
-               (struct sockaddr *)&server_address,
-               sizeof(struct sockaddr_in)) == -1) {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%s\n", "Failed to send packet to server");
-        pthread_mutex_unlock(&print_lock);
+    if (send_to_server(&new_packet) == -1) {
+        log_line(LOG_ERROR, "%s", "Failed to send packet to server");
     }
 }
 
@@ -359,18 +469,11 @@ void leave_game_request() {
     new_packet.header.msg_type = 'l';
     new_packet.header.msg_error = '\0';
     new_packet.header.game = game_number;
-    // new_packet.header.msg_length = 0;
-    new_packet.header.msg_length = strlen(name);
-
-    strcpy(new_packet.msg, name);
+    new_packet.header.msg_length = 0;
 
     // Try to send the packet to the server
-    if (sendto(sock, &new_packet, sizeof(new_packet.header), 0,
-               (struct sockaddr *)&server_address,
-               sizeof(struct sockaddr_in)) == -1) {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%s\n", "Failed to send packet to server");
-        pthread_mutex_unlock(&print_lock);
+    if (send_to_server(&new_packet) == -1) {
+        log_line(LOG_ERROR, "%s", "Failed to send packet to server");
     }
 }
 
@@ -382,9 +485,7 @@ void leave_game_request() {
 void send_message(char *msg) {
     // If there is no message
     if (msg[0] == '\0') {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%s\n", "There is not message");
-        pthread_mutex_unlock(&print_lock);
+        log_line(LOG_WARN, "%s", "There is not message");
         return;
     }
 
@@ -414,9 +515,7 @@ void send_message(char *msg) {
                    sizeof(new_packet.header) + new_packet.header.msg_length, 0,
                    (struct sockaddr *)&(peer_list[i]),
                    sizeof(struct sockaddr_in)) == -1) {
-            pthread_mutex_lock(&print_lock);
-            fprintf(stderr, "%s %d\n", "Failed to send message to peer", i);
-            pthread_mutex_unlock(&print_lock);
+            log_line(LOG_ERROR, "%s %d", "Failed to send message to peer", i);
         }
     }
     pthread_mutex_unlock(&player_lock);
@@ -435,12 +534,59 @@ void request_open_games() {
     new_packet.header.msg_length = 0;
 
     // Try and send the packet to the server
-    if (sendto(sock, &new_packet, sizeof(new_packet.header), 0,
-               (struct sockaddr *)&server_address,
-               sizeof(struct sockaddr_in)) == -1) {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%s\n", "Failed to send packet to server");
-        pthread_mutex_unlock(&print_lock);
+    if (send_to_server(&new_packet) == -1) {
+        log_line(LOG_ERROR, "%s", "Failed to send packet to server");
+    }
+}
+
+/* Browse Games
+ *
+ * Asks the server for one page of games
+ * With no arguments the next page is asked for
+ * using the filters from last time
+ */
+void browse_games(char *args) {
+    unsigned int cursor;
+    unsigned int min_players = 0;
+    unsigned int max_players = 0;
+    char open[2] = "";
+
+    int fields = sscanf(args, "%u %u %u %1s", &cursor, &min_players,
+                        &max_players, open);
+    if (fields >= 1) {
+        browse_query.cursor = cursor;
+        browse_query.min_players = min_players;
+        browse_query.max_players = max_players;
+        browse_query.open_only = open[0] == 'o';
+    }
+
+    packet new_packet;
+    new_packet.header.msg_type = 'q';
+    new_packet.header.msg_error = '\0';
+    new_packet.header.game = game_number;
+    new_packet.header.msg_length = sizeof(browse_query);
+    memcpy(new_packet.msg, &browse_query, sizeof(browse_query));
+
+    if (send_to_server(&new_packet) == -1) {
+        log_line(LOG_ERROR, "%s", "Failed to send packet to server");
+    }
+}
+
+/* Watch Lobby Request
+ *
+ * Asks the server to start, or stop, sending
+ * changes to the lobby as they happen
+ */
+void watch_lobby_request() {
+    packet new_packet;
+    new_packet.header.msg_type = 'w';
+    new_packet.header.msg_error = '\0';
+    new_packet.header.game = game_number;
+    new_packet.header.msg_length = 1;
+    new_packet.msg[0] = !watching_lobby;
+
+    if (send_to_server(&new_packet) == -1) {
+        log_line(LOG_ERROR, "%s", "Failed to send packet to server");
     }
 }
 
@@ -451,11 +597,12 @@ void request_open_games() {
  * Prints out all people that are in this game
  */
 void get_game_info() {
+    pthread_mutex_lock(&player_lock);
     pthread_mutex_lock(&print_lock);
 
     // If you have no peers
     if (peer_num == 0) {
-        fprintf(stderr, "%s\n", "You are not in a game");
+        log_line(LOG_WARN, "%s", "You are not in a game");
     } else {
         printf("%s %d\n", "You are in game:", game_number);
         printf("%s\n", "member(s): ");
@@ -465,6 +612,7 @@ void get_game_info() {
         packet new_packet;
         new_packet.header.msg_type = 'n';
         new_packet.header.msg_error = '\0';
+        new_packet.header.game = game_number;
 
         for (int i = 0; i < peer_num; i++) {
             // Get the IP Address
@@ -476,19 +624,16 @@ void get_game_info() {
             char *print_format = (char *)"%d:%d";
             sprintf(ip_and_port, print_format, ip_addr, port);
 
-            new_packet.header.msg_length = strlen(ip_and_port);
+            new_packet.header.msg_length = strlen(ip_and_port) + 1;
             strcpy(new_packet.msg, ip_and_port);
 
-            if (sendto(sock, &new_packet, sizeof(new_packet), 0,
-                       (struct sockaddr *)&server_address,
-                       sizeof(struct sockaddr_in)) == -1) {
-                pthread_mutex_lock(&print_lock);
-                fprintf(stderr, "%s\n", "Failed to get name of person");
-                pthread_mutex_unlock(&print_lock);
+            if (send_to_server(&new_packet) == -1) {
+                log_line(LOG_ERROR, "%s", "Failed to get name of person");
             }
         }
     }
     pthread_mutex_unlock(&print_lock);
+    pthread_mutex_unlock(&player_lock);
 }
 
 /* Create Game Response
@@ -502,18 +647,15 @@ void get_game_info() {
 void create_game_response(packet *new_packet) {
     // If there is an error
     if (new_packet->header.msg_error != '\0') {
-        pthread_mutex_lock(&print_lock);
-
         if (new_packet->header.msg_error == 'o') {
-            fprintf(stderr, "%s\n", "Out of the game");
+            log_line(LOG_WARN, "%s", "Out of the game");
 
             // If you are already in a game
         } else if (new_packet->header.msg_error == 'e') {
-            fprintf(stderr, "%s\n", "You are already in a game");
+            log_line(LOG_WARN, "%s", "You are already in a game");
         } else {
-            fprintf(stderr, "%s\n", "Unknown Error");
+            log_line(LOG_WARN, "%s", "Unknown Error");
         }
-        pthread_mutex_unlock(&print_lock);
         return;
     }
 
@@ -523,8 +665,17 @@ void create_game_response(packet *new_packet) {
     game_number = new_packet->header.game;
 
     // Because they may the game, they are the first person in it
+    if (reserve_peers(1) == -1) {
+        pthread_mutex_unlock(&player_lock);
+        return;
+    }
     peer_num = 1;
 
+    // The roster version the game starts at
+    if (new_packet->header.msg_length >= sizeof(roster_version)) {
+        memcpy(&roster_version, new_packet->msg, sizeof(roster_version));
+    }
+
     // Copy the peer list to memory
     memcpy(peer_list, &my_addr, sizeof(struct sockaddr_in));
     pthread_mutex_unlock(&player_lock);
@@ -545,25 +696,22 @@ void create_game_response(packet *new_packet) {
 void join_game_response(packet *new_packet) {
     // If there is an error
     if (new_packet->header.msg_error != '\0') {
-        pthread_mutex_lock(&print_lock);
-
         // If the error is there is no more space
         if (new_packet->header.msg_error == 'f') {
-            fprintf(stderr, "%s\n", "Game is full");
+            log_line(LOG_WARN, "%s", "Game is full");
 
             // If the game does not exist
         } else if (new_packet->header.msg_error == 'e') {
-            fprintf(stderr, "%s\n", "Game does not exist");
+            log_line(LOG_WARN, "%s", "Game does not exist");
 
             // If you are alread in the game
         } else if (new_packet->header.msg_error == 'a') {
-            fprintf(stderr, "%s\n", "You are already in that game");
+            log_line(LOG_WARN, "%s", "You are already in that game");
 
             // Other error
         } else {
-            fprintf(stderr, "%s\n", "Unkown Error");
+            log_line(LOG_WARN, "%s", "Unkown Error");
         }
-        pthread_mutex_unlock(&print_lock);
         return;
     }
 
@@ -573,22 +721,16 @@ void join_game_response(packet *new_packet) {
     game_number = new_packet->header.game;
 
     // New number of peers
-    peer_num = new_packet->header.msg_length / sizeof(struct sockaddr_in);
+    peer_num = read_roster(new_packet);
 
     // If there are no peers
     if (peer_num <= 0) {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%s\n", "Cannot join new game");
-        pthread_mutex_unlock(&print_lock);
+        log_line(LOG_WARN, "%s", "Cannot join new game");
 
         // Remove the player from the game
         game_number = 0;
         peer_num = 0;
     } else {
-        // Copy the peer list to memory
-        memcpy(peer_list, new_packet->msg,
-               peer_num * sizeof(struct sockaddr_in));
-
         pthread_mutex_lock(&print_lock);
         printf("%s %d\n", "You have joined game: ", game_number);
         pthread_mutex_unlock(&print_lock);
@@ -604,15 +746,12 @@ void join_game_response(packet *new_packet) {
 void leave_game_response(packet *new_packet) {
     // If there is an error
     if (new_packet->header.msg_error != '\0') {
-        pthread_mutex_lock(&print_lock);
-
         // Check to see what type of error it is
         if (new_packet->header.msg_error == 'e') {
-            fprintf(stderr, "%s\n", "You are not in a game");
+            log_line(LOG_WARN, "%s", "You are not in a game");
         } else {
-            fprintf(stderr, "%s\n", "Unkown Error");
+            log_line(LOG_WARN, "%s", "Unkown Error");
         }
-        pthread_mutex_unlock(&print_lock);
         return;
 
     } else {
@@ -631,34 +770,192 @@ void leave_game_response(packet *new_packet) {
 
 /* Play Connection Updates
  *
- * Checks to see if players are still connected
+ * Replaces the list of peers with the whole
+ * roster that was sent by the server
  */
 void player_connection_updates(packet *new_packet) {
     pthread_mutex_lock(&player_lock);
 
-    int new_peer_num =
-        new_packet->header.msg_length / sizeof(struct sockaddr_in);
+    // Ignore rosters for other games
+    if (new_packet->header.game != game_number) {
+        pthread_mutex_unlock(&player_lock);
+        return;
+    }
+
+    int old_peer_num = peer_num;
+    int new_peer_num = read_roster(new_packet);
 
     // If there are no new peers
     if (new_peer_num <= 0) {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%s\n", "Missing Peers");
-        pthread_mutex_unlock(&print_lock);
+        log_line(LOG_WARN, "%s", "Missing Peers");
     } else {
+        // Set the new number of peers
+        peer_num = new_peer_num;
+
         pthread_mutex_lock(&print_lock);
-        if (new_peer_num > peer_num) {
+        printf("%s %d %s\n", "Roster updated,", peer_num, "player(s)");
+        if (new_peer_num > old_peer_num) {
             printf("%s\n", "A new player has joined");
-        } else {
+        } else if (new_peer_num < old_peer_num) {
             printf("%s\n", "A player has left");
         }
         pthread_mutex_unlock(&print_lock);
+    }
+    pthread_mutex_unlock(&player_lock);
+}
 
-        // Set the new number of peers
-        peer_num = new_peer_num;
-        memcpy(peer_list, new_packet->msg,
-               peer_num * sizeof(struct sockaddr_in));
+/* Read Roster
+ *
+ * Copies a whole roster from the packet into the peer list
+ * and takes its version. Returns the number of peers
+ * or -1 if the roster is not valid
+ *
+ * The roster of a large game is put together from
+ * fragments first, so it can be longer than a packet
+ */
+int read_roster(packet *new_packet) {
+    unsigned int length = new_packet->header.msg_length;
+
+    if (length < sizeof(roster_version)) {
+        return -1;
+    }
+
+    int new_peer_num = (length - sizeof(roster_version)) /
+                       sizeof(struct sockaddr_in);
+    if (reserve_peers(new_peer_num) == -1) {
+        return -1;
+    }
+
+    memcpy(&roster_version, new_packet->msg, sizeof(roster_version));
+    memcpy(peer_list, new_packet->msg + sizeof(roster_version),
+           new_peer_num * sizeof(struct sockaddr_in));
+    return new_peer_num;
+}
+
+/* Reserve Peers
+ *
+ * Makes sure the peer list has room for count peers,
+ * growing it if it is too small. Expects player_lock
+ * Returns -1 if there is no memory for them
+ */
+int reserve_peers(int count) {
+    if (count <= peer_capacity) {
+        return 0;
+    }
+
+    int capacity = peer_capacity == 0 ? 16 : peer_capacity;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+
+    struct sockaddr_in *grown = (struct sockaddr_in *)realloc(
+        peer_list, capacity * sizeof(struct sockaddr_in));
+    if (grown == NULL) {
+        log_line(LOG_ERROR, "%s", "Out of memory for the list of peers");
+        return -1;
+    }
+    peer_list = grown;
+    peer_capacity = capacity;
+    return 0;
+}
+
+/* Roster Delta Update
+ *
+ * Adds ('a') or drops ('d') one player from the list of peers
+ * If a version was missed the whole roster is asked for instead
+ */
+void roster_delta_update(packet *new_packet) {
+    roster_delta delta;
+    memcpy(&delta, new_packet->msg, sizeof(delta));
+
+    pthread_mutex_lock(&player_lock);
+
+    // Ignore changes to other games and changes that are old
+    if (new_packet->header.game != game_number || peer_num == 0 ||
+        (int)(delta.version - roster_version) <= 0) {
+        pthread_mutex_unlock(&player_lock);
+        return;
+    }
+
+    // There is a gap, so the list can't be trusted
+    if (delta.version != roster_version + 1) {
+        pthread_mutex_unlock(&player_lock);
+        request_roster_resync(new_packet->header.game);
+        return;
+    }
+    roster_version = delta.version;
+
+    // Look for the player in the list
+    int index = -1;
+    for (int i = 0; i < peer_num; i++) {
+        if (peer_list[i].sin_addr.s_addr == delta.addr.sin_addr.s_addr &&
+            peer_list[i].sin_port == delta.addr.sin_port) {
+            index = i;
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&print_lock);
+    if (new_packet->header.msg_type == 'a') {
+        if (index == -1 && reserve_peers(peer_num + 1) == 0) {
+            peer_list[peer_num] = delta.addr;
+            peer_num++;
+        }
+        printf("%s\n", "A new player has joined");
+    } else {
+        // Move the last player into the gap
+        if (index != -1) {
+            peer_list[index] = peer_list[peer_num - 1];
+            peer_num--;
+        }
+        printf("%s\n", "A player has left");
+    }
+    pthread_mutex_unlock(&print_lock);
+
+    pthread_mutex_unlock(&player_lock);
+}
+
+/* Request Roster Resync
+ *
+ * Asks the server for the whole roster of a game
+ */
+void request_roster_resync(unsigned int game) {
+    packet new_packet;
+    new_packet.header.msg_type = 'y';
+    new_packet.header.msg_error = '\0';
+    new_packet.header.game = game;
+    new_packet.header.msg_length = 0;
+
+    if (send_to_server(&new_packet) == -1) {
+        log_line(LOG_ERROR, "%s", "Failed to send packet to server");
+    }
+}
+
+/* Message Lost
+ *
+ * Called when a message sent in fragments did not all
+ * arrive. A lost roster is asked for again, and the
+ * roster of a game that was just joined makes it the
+ * current game so the answer is taken
+ */
+void message_lost(fragment *info, unsigned int game) {
+    if (info->msg_type != 'j' && info->msg_type != 'u') {
+        log_line(LOG_WARN, "%s", "Part of a message from the server was lost");
+        return;
+    }
+
+    pthread_mutex_lock(&player_lock);
+    if (info->msg_type == 'j' && game != game_number) {
+        game_number = game;
+        peer_num = 0;
     }
+    int current = game == game_number;
     pthread_mutex_unlock(&player_lock);
+
+    if (current) {
+        log_line(LOG_WARN, "%s", "Part of the roster was lost, asking again");
+        request_roster_resync(game);
+    }
 }
 
 /* Get Open Games
@@ -668,6 +965,123 @@ void player_connection_updates(packet *new_packet) {
 void get_open_games(packet *new_packet) {
     pthread_mutex_lock(&print_lock);
     printf("Room List: \n%s", new_packet->msg);
+    if (new_packet->header.msg_error == 't') {
+        printf("%s\n", "There are more games, use b to browse them all");
+    }
+    pthread_mutex_unlock(&print_lock);
+}
+
+/* Request Stats
+ *
+ * Asks the server for its metrics
+ */
+void request_stats() {
+    packet new_packet;
+    new_packet.header.msg_type = 's';
+    new_packet.header.msg_error = '\0';
+    new_packet.header.game = 0;
+    new_packet.header.msg_length = 0;
+
+    if (send_to_server(&new_packet) == -1) {
+        log_line(LOG_ERROR, "%s", "Failed to send packet to server");
+    }
+}
+
+/* Get Stats
+ *
+ * Prints the metrics of the server
+ */
+void get_stats(packet *new_packet) {
+    pthread_mutex_lock(&print_lock);
+    printf("Server stats: \n%s", new_packet->msg);
+    if (new_packet->header.msg_error == 't') {
+        printf("%s\n", "The stats were cut short");
+    }
+    pthread_mutex_unlock(&print_lock);
+}
+
+/* Get Lobby Page
+ *
+ * Prints one page of games and keeps
+ * the cursor for the next page
+ */
+void get_lobby_page(packet *new_packet) {
+    lobby_page page;
+    if (new_packet->header.msg_length < sizeof(page)) {
+        return;
+    }
+    memcpy(&page, new_packet->msg, sizeof(page));
+    if (page.count > LOBBY_PAGE_MAX) {
+        return;
+    }
+
+    lobby_entry entries[LOBBY_PAGE_MAX];
+    memcpy(entries, new_packet->msg + sizeof(page),
+           page.count * sizeof(lobby_entry));
+
+    pthread_mutex_lock(&print_lock);
+    printf("Room List: \n");
+    for (unsigned int i = 0; i < page.count; i++) {
+        printf("Game: %u - %u/%u\n", entries[i].game, entries[i].players,
+               entries[i].max_players);
+    }
+
+    browse_query.cursor = page.next_cursor;
+    if (page.next_cursor != 0) {
+        printf("%s\n", "More games, use -b for the next page");
+    } else {
+        printf("%s\n", "End of the list");
+    }
+    pthread_mutex_unlock(&print_lock);
+}
+
+/* Watch Lobby Response
+ *
+ * Prints if the lobby is being watched
+ */
+void watch_lobby_response(packet *new_packet) {
+    pthread_mutex_lock(&print_lock);
+    if (new_packet->header.msg_error != '\0') {
+        log_line(LOG_WARN, "%s", "Could not watch the lobby");
+    } else {
+        watching_lobby = new_packet->msg[0];
+        if (watching_lobby) {
+            printf("%s\n", "Watching the lobby, use -b to see every game");
+        } else {
+            printf("%s\n", "Stopped watching the lobby");
+        }
+    }
+    pthread_mutex_unlock(&print_lock);
+}
+
+/* Get Lobby Changes
+ *
+ * Prints the games that changed since the last update
+ */
+void get_lobby_changes(packet *new_packet) {
+    lobby_page page;
+    if (new_packet->header.msg_length < sizeof(page)) {
+        return;
+    }
+    memcpy(&page, new_packet->msg, sizeof(page));
+    if (page.count > LOBBY_PAGE_MAX) {
+        return;
+    }
+
+    lobby_entry entries[LOBBY_PAGE_MAX];
+    memcpy(entries, new_packet->msg + sizeof(page),
+           page.count * sizeof(lobby_entry));
+
+    pthread_mutex_lock(&print_lock);
+    printf("Lobby changes: \n");
+    for (unsigned int i = 0; i < page.count; i++) {
+        if (entries[i].players == 0) {
+            printf("Game: %u - ended\n", entries[i].game);
+        } else {
+            printf("Game: %u - %u/%u\n", entries[i].game, entries[i].players,
+                   entries[i].max_players);
+        }
+    }
     pthread_mutex_unlock(&print_lock);
 }
 
@@ -723,22 +1137,22 @@ void receive_message(struct sockaddr_in *from_addr, packet *new_packet) {
 
 /* Reply to Ping
  *
- * Responds to a ping from the server
+ * Responds to a ping from the server in the version
+ * it came in. The game number of the ping is sent
+ * back as it is
  */
-void reply_to_ping(struct sockaddr_in *from_addr) {
+void reply_to_ping(struct sockaddr_in *from_addr, unsigned int game,
+                   int v2) {
     // Make packet to be sent
     packet new_packet;
     new_packet.header.msg_type = 'p';
     new_packet.header.msg_error = '\0';
+    new_packet.header.game = game;
     new_packet.header.msg_length = 0;
 
     // Try to send the packet
-    if (sendto(sock, &new_packet, sizeof(new_packet.header), 0,
-               (struct sockaddr *)from_addr,
-               sizeof(struct sockaddr_in)) == -1) {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%s\n", "Cound not respond to ping request");
-        pthread_mutex_unlock(&print_lock);
+    if (send_packet_to(&new_packet, from_addr, v2) == -1) {
+        log_line(LOG_ERROR, "%s", "Cound not respond to ping request");
     }
 }
 
@@ -774,4 +1188,52 @@ void stop_generate_ball() {
  * Prints out the name that is sent
  * from the server
  */
-void print_name(packet *new_packet) { printf("\t%s:\n", new_packet->msg); }
\ No newline at end of file
+void print_name(packet *new_packet) { printf("\t%s:\n", new_packet->msg); }
+
+/* Send Packet To
+ *
+ * Sends the header and msg_length bytes of message
+ * In v1 the header says the client can read v2
+ * Returns -1 if the packet could not be sent
+ */
+int send_packet_to(packet *new_packet, struct sockaddr_in *to_addr, int v2) {
+    size_t size = new_packet->header.msg_length;
+    if (size > sizeof(new_packet->msg)) {
+        size = sizeof(new_packet->msg);
+    }
+
+    packet wire;
+    size_t header_length;
+    if (v2) {
+        header_length =
+            header_encode_v2(&new_packet->header, (unsigned char *)&wire);
+    } else {
+        memcpy(new_packet->header.protocol, PROTOCOL_HINT, 2);
+        memcpy(&wire.header, &new_packet->header, sizeof(wire.header));
+        header_length = sizeof(wire.header);
+    }
+    memcpy((char *)&wire + header_length, new_packet->msg, size);
+
+    ssize_t sent = sendto(sock, &wire, header_length + size, 0,
+                          (struct sockaddr *)to_addr, sizeof(*to_addr));
+    return sent == -1 ? -1 : 0;
+}
+
+/* Send To Server
+ *
+ * Sends a packet to the server, in v2
+ * once the server has answered in v2
+ */
+int send_to_server(packet *new_packet) {
+    return send_packet_to(new_packet, &server_address, server_v2);
+}
+
+/* Now MS
+ *
+ * Returns a clock that only goes forward, in milliseconds
+ */
+uint64_t now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,186 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Exporter
+ *
+ * A very small HTTP server on a loopback TCP port, for
+ * monitoring to scrape. It runs on a thread of its own
+ * and answers one request at a time, so a slow scraper
+ * only ever holds up other scrapes
+ *
+ * GET /metrics is answered with whatever render writes,
+ * anything else gets a 404
+ */
+#define EXPORTER_BUFFER_SIZE (256 * 1024)
+
+// How long a scraper has to send its request or
+// take the answer, in ms
+#define EXPORTER_TIMEOUT 1000
+
+// How long to wait before accepting again after an
+// error such as running out of descriptors, in ms
+#define EXPORTER_BACKOFF 100
+
+struct exporter {
+    int listen_fd;
+
+    // Writes the page into out, at most room bytes
+    // Returns the number of bytes written
+    size_t (*render)(char *out, size_t room);
+
+    char *page;
+};
+
+/* Exporter Send
+ *
+ * Writes all of a buffer to a connection
+ * Returns -1 if the connection went away
+ */
+int exporter_send(int connection, const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(connection, buffer, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return -1;
+        }
+        buffer += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+/* Exporter Answer
+ *
+ * Reads one request from a connection and answers it
+ */
+void exporter_answer(struct exporter *e, int connection) {
+    struct timeval timeout;
+    timeout.tv_sec = EXPORTER_TIMEOUT / 1000;
+    timeout.tv_usec = EXPORTER_TIMEOUT % 1000 * 1000;
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+               sizeof(timeout));
+    setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+               sizeof(timeout));
+
+    // Only the request line is needed
+    char request[1024];
+    size_t used = 0;
+    while (used < sizeof(request) - 1) {
+        ssize_t got = recv(connection, request + used,
+                           sizeof(request) - 1 - used, 0);
+        if (got <= 0) {
+            return;
+        }
+        used += got;
+        request[used] = '\0';
+        if (strstr(request, "\r\n") != NULL) {
+            break;
+        }
+    }
+    request[used] = '\0';
+
+    const char *status = "404 Not Found";
+    size_t length = 0;
+    if (strncmp(request, "GET /metrics ", 13) == 0 ||
+        strncmp(request, "GET /metrics?", 13) == 0) {
+        status = "200 OK";
+        length = e->render(e->page, EXPORTER_BUFFER_SIZE);
+    }
+
+    char header[256];
+    int header_length =
+        snprintf(header, sizeof(header),
+                 "HTTP/1.0 %s\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n",
+                 status, length);
+    if (exporter_send(connection, header, header_length) == 0) {
+        exporter_send(connection, e->page, length);
+    }
+}
+
+/* Exporter Run
+ *
+ * Answers scrapes for as long as the program runs
+ */
+void *exporter_run(void *ptr) {
+    struct exporter *e = (struct exporter *)ptr;
+    for (;;) {
+        int connection = accept(e->listen_fd, NULL, NULL);
+        if (connection == -1) {
+            // Errors that do not go away on their own would
+            // otherwise keep the thread spinning
+            if (errno != EINTR && errno != ECONNABORTED) {
+                usleep(EXPORTER_BACKOFF * 1000);
+            }
+            continue;
+        }
+        exporter_answer(e, connection);
+        close(connection);
+    }
+    return NULL;
+}
+
+/* Exporter Stop
+ *
+ * Closes the socket and frees the page of an exporter
+ * whose thread did not start
+ */
+void exporter_stop(struct exporter *e) {
+    close(e->listen_fd);
+    e->listen_fd = -1;
+    free(e->page);
+    e->page = NULL;
+}
+
+/* Exporter Start
+ *
+ * Listens on port of the loopback address and starts
+ * the thread that answers scrapes
+ * Returns -1 if it could not be started
+ */
+int exporter_start(struct exporter *e, unsigned short port,
+                   size_t (*render)(char *, size_t)) {
+    e->render = render;
+    e->page = (char *)malloc(EXPORTER_BUFFER_SIZE);
+    if (e->page == NULL) {
+        return -1;
+    }
+    e->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (e->listen_fd == -1) {
+        free(e->page);
+        e->page = NULL;
+        return -1;
+    }
+
+    int reuse = 1;
+    setsockopt(e->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+               sizeof(reuse));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(e->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(e->listen_fd, 16) == -1) {
+        exporter_stop(e);
+        return -1;
+    }
+
+    pthread_t exporter_thread;
+    if (pthread_create(&exporter_thread, NULL, exporter_run, e) != 0) {
+        exporter_stop(e);
+        return -1;
+    }
+    pthread_detach(exporter_thread);
+    return 0;
+}
@@ -0,0 +1,209 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Reassembly
+ *
+ * Puts messages that were sent as 'f' packets back
+ * together, see Fragments in msg.h
+ *
+ * A few messages can be in progress at once. A message is
+ * dropped when FRAGMENT_TIMEOUT ms pass before all of its
+ * pieces arrive, or when its room is needed for a newer
+ * message, and lost is called so it can be asked for again
+ *
+ * Include msg.h before this file
+ */
+#define REASSEMBLY_SLOTS 4
+
+struct reassembly_slot {
+    int in_use;
+
+    // Taken from the first piece that arrived
+    fragment info;
+    unsigned int game;
+
+    // Which pieces have arrived, one flag per piece
+    unsigned char *have;
+    unsigned int pieces;
+    unsigned int received;
+
+    // The whole message, with room for a terminator
+    packet *whole;
+    uint64_t started;
+};
+
+struct reassembly {
+    struct reassembly_slot slots[REASSEMBLY_SLOTS];
+    void (*lost)(fragment *info, unsigned int game);
+};
+
+/* Reassembly Init
+ *
+ * Sets up with no messages in progress
+ */
+void reassembly_init(struct reassembly *r,
+                     void (*lost)(fragment *, unsigned int)) {
+    memset(r, 0, sizeof(*r));
+    r->lost = lost;
+}
+
+/* Reassembly Release
+ *
+ * Frees what a slot holds and marks it unused
+ */
+void reassembly_release(struct reassembly_slot *slot) {
+    free(slot->have);
+    free(slot->whole);
+    memset(slot, 0, sizeof(*slot));
+}
+
+/* Reassembly Drop
+ *
+ * Gives up on the message in a slot
+ */
+void reassembly_drop(struct reassembly *r, struct reassembly_slot *slot) {
+    fragment info = slot->info;
+    unsigned int game = slot->game;
+    reassembly_release(slot);
+    if (r->lost != NULL) {
+        r->lost(&info, game);
+    }
+}
+
+/* Reassembly Start
+ *
+ * Takes a slot for a new message, dropping the
+ * oldest message in progress if there is no free one
+ * Returns NULL if there is no memory for the message
+ */
+struct reassembly_slot *reassembly_start(struct reassembly *r,
+                                         fragment *info, unsigned int game,
+                                         uint64_t now) {
+    struct reassembly_slot *slot = NULL;
+    for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+        struct reassembly_slot *next = &r->slots[i];
+        if (!next->in_use) {
+            slot = next;
+            break;
+        }
+        if (slot == NULL || next->started < slot->started) {
+            slot = next;
+        }
+    }
+    if (slot->in_use) {
+        reassembly_drop(r, slot);
+    }
+
+    // The message is read like any other packet, so
+    // there is always room for a whole packet
+    size_t size = offsetof(packet, msg) + info->total + 1;
+    if (size < sizeof(packet)) {
+        size = sizeof(packet);
+    }
+
+    slot->pieces = (info->total + FRAGMENT_DATA - 1) / FRAGMENT_DATA;
+    slot->have = (unsigned char *)calloc(slot->pieces, 1);
+    slot->whole = (packet *)malloc(size);
+    if (slot->have == NULL || slot->whole == NULL) {
+        reassembly_release(slot);
+        return NULL;
+    }
+
+    slot->in_use = 1;
+    slot->info = *info;
+    slot->game = game;
+    slot->received = 0;
+    slot->started = now;
+    return slot;
+}
+
+/* Reassembly Add
+ *
+ * Adds the piece in an 'f' packet to its message
+ * Returns the whole message once every piece has arrived,
+ * which the caller frees, otherwise NULL
+ *
+ * Pieces that do not fit the message they claim to
+ * be part of, and pieces seen before, are ignored
+ */
+packet *reassembly_add(struct reassembly *r, packet *piece, uint64_t now) {
+    if (piece->header.msg_length < sizeof(fragment)) {
+        return NULL;
+    }
+    fragment info;
+    memcpy(&info, piece->msg, sizeof(info));
+    size_t length = piece->header.msg_length - sizeof(info);
+
+    // Check the piece is a proper part of a message
+    if (info.total == 0 || info.total > FRAGMENT_MAX_TOTAL ||
+        info.offset >= info.total || info.offset % FRAGMENT_DATA != 0 ||
+        info.msg_type == 'f') {
+        return NULL;
+    }
+    size_t expected = info.total - info.offset;
+    if (expected > FRAGMENT_DATA) {
+        expected = FRAGMENT_DATA;
+    }
+    if (length != expected) {
+        return NULL;
+    }
+
+    struct reassembly_slot *slot = NULL;
+    for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+        if (r->slots[i].in_use && r->slots[i].info.id == info.id) {
+            slot = &r->slots[i];
+            break;
+        }
+    }
+    if (slot == NULL) {
+        slot = reassembly_start(r, &info, piece->header.game, now);
+        if (slot == NULL) {
+            return NULL;
+        }
+    } else if (slot->info.total != info.total ||
+               slot->info.msg_type != info.msg_type) {
+        return NULL;
+    }
+
+    unsigned int index = info.offset / FRAGMENT_DATA;
+    if (slot->have[index]) {
+        return NULL;
+    }
+    slot->have[index] = 1;
+    slot->received++;
+    memcpy(slot->whole->msg + info.offset, piece->msg + sizeof(info), length);
+
+    if (slot->received < slot->pieces) {
+        return NULL;
+    }
+
+    // Hand the message over as if it came in one packet
+    packet *whole = slot->whole;
+    memset(&whole->header, 0, sizeof(whole->header));
+    whole->header.msg_type = slot->info.msg_type;
+    whole->header.msg_error = slot->info.msg_error;
+    whole->header.game = slot->game;
+    whole->header.msg_length = slot->info.total;
+    char *msg = whole->msg;
+    msg[slot->info.total] = '\0';
+
+    slot->whole = NULL;
+    reassembly_release(slot);
+    return whole;
+}
+
+/* Reassembly Expire
+ *
+ * Drops every message that has been in progress
+ * for FRAGMENT_TIMEOUT ms or more
+ */
+void reassembly_expire(struct reassembly *r, uint64_t now) {
+    for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+        struct reassembly_slot *slot = &r->slots[i];
+        if (slot->in_use && now - slot->started >= FRAGMENT_TIMEOUT) {
+            reassembly_drop(r, slot);
+        }
+    }
+}
@@ -0,0 +1,128 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Game IDs
+ *
+ * Hands out game numbers between 1 and capacity
+ *
+ * Free numbers are kept on a stack so that taking
+ * and returning a number does not depend on how many
+ * games there are. The bitmap records which numbers
+ * are in use
+ *
+ * Only the owner takes and returns numbers, but other
+ * threads read free_count and the bitmap, so those are
+ * loaded and stored atomically
+ */
+struct game_ids {
+    unsigned int *free_ids;
+    unsigned int free_count;
+    uint64_t *used;
+    unsigned int capacity;
+};
+
+/* Game IDs Init
+ *
+ * Every number starts out free. The stack is filled
+ * backwards so the lowest numbers are handed out first
+ */
+void game_ids_init(struct game_ids *ids, unsigned int capacity) {
+    ids->capacity = capacity;
+    ids->free_ids = (unsigned int *)malloc(capacity * sizeof(unsigned int));
+    ids->used = (uint64_t *)calloc(capacity / 64 + 1, sizeof(uint64_t));
+
+    for (unsigned int i = 0; i < capacity; i++) {
+        ids->free_ids[i] = capacity - i;
+    }
+    ids->free_count = capacity;
+}
+
+/* Game IDs Free
+ *
+ * Deallocates the stack and the bitmap
+ */
+void game_ids_free(struct game_ids *ids) {
+    free(ids->free_ids);
+    free(ids->used);
+    ids->free_ids = NULL;
+    ids->used = NULL;
+    ids->free_count = 0;
+    ids->capacity = 0;
+}
+
+/* Game IDs In Use
+ *
+ * 0 -> the number is free or out of range
+ * 1 -> the number belongs to a game
+ */
+int game_ids_in_use(struct game_ids *ids, unsigned int id) {
+    if (id == 0 || id > ids->capacity) {
+        return 0;
+    }
+    uint64_t word = __atomic_load_n(&ids->used[id / 64], __ATOMIC_RELAXED);
+    return (word >> (id % 64)) & 1;
+}
+
+/* Game IDs Acquire
+ *
+ * Returns a free game number, or 0 if all
+ * of the numbers are in use
+ */
+unsigned int game_ids_acquire(struct game_ids *ids) {
+    if (ids->free_count == 0) {
+        return 0;
+    }
+
+    unsigned int free_count = ids->free_count - 1;
+    __atomic_store_n(&ids->free_count, free_count, __ATOMIC_RELAXED);
+    unsigned int id = ids->free_ids[free_count];
+    uint64_t word = __atomic_load_n(&ids->used[id / 64], __ATOMIC_RELAXED);
+    __atomic_store_n(&ids->used[id / 64], word | (uint64_t)1 << (id % 64),
+                     __ATOMIC_RELAXED);
+    return id;
+}
+
+/* Game IDs Release
+ *
+ * Returns a game number so it can be used again
+ */
+void game_ids_release(struct game_ids *ids, unsigned int id) {
+    if (game_ids_in_use(ids, id) == 0) {
+        return;
+    }
+
+    uint64_t word = __atomic_load_n(&ids->used[id / 64], __ATOMIC_RELAXED);
+    __atomic_store_n(&ids->used[id / 64], word & ~((uint64_t)1 << (id % 64)),
+                     __ATOMIC_RELAXED);
+    ids->free_ids[ids->free_count] = id;
+    __atomic_store_n(&ids->free_count, ids->free_count + 1, __ATOMIC_RELAXED);
+}
+
+/* Game IDs Next
+ *
+ * Returns the first game number in use that is
+ * larger than after, or 0 if there is none
+ * Skips over 64 free numbers at a time
+ */
+unsigned int game_ids_next(struct game_ids *ids, unsigned int after) {
+    unsigned int id = after + 1;
+    if (id == 0 || id > ids->capacity) {
+        return 0;
+    }
+
+    unsigned int word = id / 64;
+    uint64_t bits = __atomic_load_n(&ids->used[word], __ATOMIC_RELAXED) &
+                    (~(uint64_t)0 << (id % 64));
+    unsigned int words = ids->capacity / 64 + 1;
+
+    while (bits == 0) {
+        word++;
+        if (word >= words) {
+            return 0;
+        }
+        bits = __atomic_load_n(&ids->used[word], __ATOMIC_RELAXED);
+    }
+
+    id = word * 64 + __builtin_ctzll(bits);
+    return id <= ids->capacity ? id : 0;
+}
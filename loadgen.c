@@ -0,0 +1,622 @@
+// System files
+#include <arpa/inet.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+// Local files
+#include "bench.h"
+#include "msg.h"
+#include "fragments.h"
+#include "bench_net.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+
+/* Load Generator
+ *
+ * Puts load on a running server from many virtual clients
+ * in one process. Each virtual client has its own socket
+ * and does what a player does: it looks at the lobby, joins
+ * a game that is still filling up or makes a new one, stays
+ * for a while answering pings, and then leaves
+ *
+ * Players arrive at random at the given rate, picking a
+ * virtual client that is not busy. Each game is filled up
+ * to a size drawn from the chosen distribution, and every
+ * player stays for an exponential time with the given mean
+ *
+ * At the end the request rate, the errors the server
+ * answered with and the latency of each request are printed
+ *
+ * ./loadgen [-c clients] [-r arrivals_per_s] [-d duration_s]
+ *           [-n game_size] [-D fixed|uniform|geometric]
+ *           [-H hold_ms] [-T timeout_ms] [-S seed]
+ *           [server_ip] [server_port]
+ */
+#define DEFAULT_CLIENTS 1000
+#define DEFAULT_RATE 500
+#define DEFAULT_DURATION 10
+#define DEFAULT_GAME_SIZE 8
+#define DEFAULT_HOLD 5000
+#define DEFAULT_TIMEOUT 1000
+
+// What a virtual client is doing
+#define STATE_IDLE 0
+#define STATE_LOOKING 1
+#define STATE_CREATING 2
+#define STATE_JOINING 3
+#define STATE_PLAYING 4
+#define STATE_LEAVING 5
+
+#define SIZE_FIXED 0
+#define SIZE_UNIFORM 1
+#define SIZE_GEOMETRIC 2
+
+struct vclient {
+    int sock;
+    int state;
+    unsigned int game;
+
+    // The request waiting for an answer, 0 if there is
+    // none, and when it was sent in ns
+    char pending;
+    uint64_t sent;
+
+    // When the request times out or the player leaves
+    struct wheel_timer timer;
+
+    // Made the first time a fragment arrives
+    struct reassembly *incoming;
+};
+
+/* Forming Game
+ *
+ * A game made by a virtual client that is still
+ * filling up. members counts the joins in flight
+ */
+struct forming_game {
+    unsigned int game;
+    int members;
+    int size;
+};
+
+// Options
+int client_count = DEFAULT_CLIENTS;
+double arrival_rate = DEFAULT_RATE;
+int duration = DEFAULT_DURATION;
+int game_size = DEFAULT_GAME_SIZE;
+int size_distribution = SIZE_FIXED;
+int hold_time = DEFAULT_HOLD;
+int request_timeout = DEFAULT_TIMEOUT;
+struct sockaddr_in server_address;
+
+struct vclient *clients;
+int *idle_clients;
+int idle_count;
+
+struct forming_game *forming;
+int forming_count;
+
+struct timer_wheel wheel;
+
+// Results
+struct metrics latency;
+uint64_t requests_sent;
+uint64_t answers;
+uint64_t timeouts;
+uint64_t late_answers;
+uint64_t errors[256];
+uint64_t pings_answered;
+uint64_t roster_pushes;
+uint64_t arrivals;
+uint64_t arrivals_missed;
+uint64_t messages_lost;
+
+// Function Prototypes
+void parse_options(int argc, char **argv);
+uint64_t now_ms();
+double random_unit();
+int draw_game_size();
+void open_clients(int events);
+void send_request(struct vclient *c, char msg_type, unsigned int game,
+                  const void *msg, size_t length);
+void arrive();
+void choose_game(struct vclient *c);
+void become_idle(struct vclient *c);
+void start_playing(struct vclient *c);
+void drop_forming(unsigned int game);
+void receive(struct vclient *c);
+void handle_message(struct vclient *c, packet *data,
+                    struct sockaddr_in *from);
+void handle_answer(struct vclient *c, packet *data);
+void timer_fired(struct vclient *c);
+void message_lost(fragment *info, unsigned int game);
+void print_results(double elapsed);
+
+int main(int argc, char **argv) {
+    parse_options(argc, argv);
+
+    // Every virtual client needs a descriptor
+    bench_raise_fd_limit();
+
+    int events = epoll_create1(0);
+    if (events == -1) {
+        perror("epoll_create1");
+        return 1;
+    }
+    open_clients(events);
+    timer_wheel_init(&wheel, now_ms());
+
+    long long started = bench_now();
+    uint64_t stop_at = now_ms() + (uint64_t)duration * 1000;
+    uint64_t drain_until = 0;
+    double next_arrival = (double)now_ms();
+
+    struct epoll_event ready[256];
+    while (1) {
+        uint64_t now = now_ms();
+
+        // Players arrive until the run is over
+        if (drain_until == 0) {
+            while (next_arrival <= (double)now) {
+                arrive();
+                next_arrival += -log(1 - random_unit()) * 1000 / arrival_rate;
+            }
+            if (now >= stop_at) {
+                // Everyone still playing leaves within the next
+                // request_timeout ms, spread out so the leaves
+                // do not all reach the server at once
+                drain_until = now + 3 * request_timeout;
+                for (int i = 0; i < client_count; i++) {
+                    struct vclient *c = &clients[i];
+                    uint64_t leave = now + 1 + (uint64_t)(random_unit() *
+                                                          request_timeout);
+                    if (c->state == STATE_PLAYING &&
+                        c->timer.expires > leave) {
+                        timer_wheel_add(&wheel, &c->timer, leave);
+                    }
+                }
+            }
+        } else if (idle_count == client_count || now >= drain_until) {
+            break;
+        }
+
+        struct wheel_timer *timer;
+        while ((timer = timer_wheel_expire(&wheel, now)) != NULL) {
+            timer_fired((struct vclient *)((char *)timer -
+                                           offsetof(struct vclient, timer)));
+        }
+
+        int count = epoll_wait(events, ready, 256, 1);
+        for (int i = 0; i < count; i++) {
+            receive(&clients[ready[i].data.u32]);
+        }
+    }
+
+    print_results((bench_now() - started) / 1e9);
+    return 0;
+}
+
+/* Parse Options
+ *
+ * Reads the options and the server address
+ */
+void parse_options(int argc, char **argv) {
+    unsigned short port = 7400;
+    const char *host = "127.0.0.1";
+
+    int option;
+    while ((option = getopt(argc, argv, "c:r:d:n:D:H:T:S:")) != -1) {
+        switch (option) {
+            case 'c':
+                client_count = atoi(optarg);
+                break;
+            case 'r':
+                arrival_rate = atof(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'n':
+                game_size = atoi(optarg);
+                break;
+            case 'D':
+                if (strcmp(optarg, "fixed") == 0) {
+                    size_distribution = SIZE_FIXED;
+                } else if (strcmp(optarg, "uniform") == 0) {
+                    size_distribution = SIZE_UNIFORM;
+                } else if (strcmp(optarg, "geometric") == 0) {
+                    size_distribution = SIZE_GEOMETRIC;
+                } else {
+                    fprintf(stderr, "Unknown distribution \"%s\"\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'H':
+                hold_time = atoi(optarg);
+                break;
+            case 'T':
+                request_timeout = atoi(optarg);
+                break;
+            case 'S':
+                srand48(atol(optarg));
+                break;
+            default:
+                fprintf(stderr,
+                        "Usage: %s [-c clients] [-r arrivals_per_s] "
+                        "[-d duration_s] [-n game_size] "
+                        "[-D fixed|uniform|geometric] [-H hold_ms] "
+                        "[-T timeout_ms] [-S seed] [server_ip] "
+                        "[server_port]\n",
+                        argv[0]);
+                exit(1);
+        }
+    }
+    if (optind < argc) {
+        host = argv[optind];
+    }
+    if (optind + 1 < argc) {
+        port = atoi(argv[optind + 1]);
+    }
+
+    if (client_count <= 0 || arrival_rate <= 0 || game_size <= 0 ||
+        request_timeout <= 0) {
+        fprintf(stderr, "%s\n",
+                "clients, arrivals, game_size and timeout must be above 0");
+        exit(1);
+    }
+
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_address.sin_addr) != 1) {
+        fprintf(stderr, "Failed to parse server IP Address \"%s\"\n", host);
+        exit(1);
+    }
+}
+
+/* Now MS
+ *
+ * Returns a clock that only goes forward, in milliseconds
+ */
+uint64_t now_ms() { return (uint64_t)(bench_now() / 1000000); }
+
+/* Random Unit
+ *
+ * Returns a random number from 0 up to but not including 1
+ */
+double random_unit() { return drand48(); }
+
+/* Draw Game Size
+ *
+ * Returns the number of players a new game is filled up
+ * to, with game_size as the mean of the distribution
+ */
+int draw_game_size() {
+    switch (size_distribution) {
+        case SIZE_UNIFORM:
+            return 1 + (int)(random_unit() * (2 * game_size - 1));
+        case SIZE_GEOMETRIC:
+            if (game_size == 1) {
+                return 1;
+            }
+            return 1 + (int)(log(1 - random_unit()) /
+                             log(1 - 1.0 / game_size));
+        default:
+            return game_size;
+    }
+}
+
+/* Open Clients
+ *
+ * Gives every virtual client a socket of its own
+ * on the loopback address, watched by events
+ */
+void open_clients(int events) {
+    clients = (struct vclient *)calloc(client_count, sizeof(struct vclient));
+    idle_clients = (int *)malloc(client_count * sizeof(int));
+    forming = (struct forming_game *)malloc(client_count *
+                                            sizeof(struct forming_game));
+
+    for (int i = 0; i < client_count; i++) {
+        struct vclient *c = &clients[i];
+        c->sock = bench_open_socket(events, i, NULL);
+        wheel_timer_init(&c->timer);
+        c->state = STATE_IDLE;
+        idle_clients[i] = client_count - 1 - i;
+    }
+    idle_count = client_count;
+}
+
+/* Send Request
+ *
+ * Sends a request to the server and waits
+ * up to request_timeout ms for its answer
+ */
+void send_request(struct vclient *c, char msg_type, unsigned int game,
+                  const void *msg, size_t length) {
+    message_header header;
+    memset(&header, 0, sizeof(header));
+    header.msg_type = msg_type;
+    header.game = game;
+    header.msg_length = length;
+
+    c->pending = msg_type;
+    c->sent = metrics_clock();
+    requests_sent++;
+    bench_send(c->sock, &header, msg, &server_address, 1);
+    timer_wheel_add(&wheel, &c->timer, now_ms() + request_timeout);
+}
+
+/* Arrive
+ *
+ * A player arrives and looks at the lobby
+ */
+void arrive() {
+    arrivals++;
+    if (idle_count == 0) {
+        arrivals_missed++;
+        return;
+    }
+    idle_count--;
+    struct vclient *c = &clients[idle_clients[idle_count]];
+
+    lobby_query query;
+    memset(&query, 0, sizeof(query));
+    query.open_only = 1;
+
+    c->state = STATE_LOOKING;
+    send_request(c, 'q', 0, &query, sizeof(query));
+}
+
+/* Choose Game
+ *
+ * Joins a game that is filling up, or
+ * makes a new one if there is none
+ */
+void choose_game(struct vclient *c) {
+    for (int i = 0; i < forming_count; i++) {
+        struct forming_game *f = &forming[i];
+        if (f->members < f->size) {
+            f->members++;
+            c->state = STATE_JOINING;
+            c->game = f->game;
+            send_request(c, 'j', f->game, "load", 5);
+            return;
+        }
+    }
+
+    c->state = STATE_CREATING;
+    send_request(c, 'c', 0, "load", 5);
+}
+
+/* Become Idle
+ *
+ * Makes a virtual client free for the next arrival
+ */
+void become_idle(struct vclient *c) {
+    timer_wheel_remove(&wheel, &c->timer);
+    c->state = STATE_IDLE;
+    c->pending = 0;
+    c->game = 0;
+    idle_clients[idle_count] = c - clients;
+    idle_count++;
+}
+
+/* Start Playing
+ *
+ * Stays in the game for an exponential hold time
+ */
+void start_playing(struct vclient *c) {
+    c->state = STATE_PLAYING;
+    c->pending = 0;
+    uint64_t hold = (uint64_t)(-log(1 - random_unit()) * hold_time);
+    timer_wheel_add(&wheel, &c->timer, now_ms() + hold);
+}
+
+/* Drop Forming
+ *
+ * Stops filling up a game
+ */
+void drop_forming(unsigned int game) {
+    for (int i = 0; i < forming_count; i++) {
+        if (forming[i].game == game) {
+            forming_count--;
+            forming[i] = forming[forming_count];
+            return;
+        }
+    }
+}
+
+/* Receive
+ *
+ * Reads every packet waiting on the socket of a client
+ */
+void receive(struct vclient *c) {
+    packet data;
+    struct sockaddr_in from;
+    while (bench_receive(c->sock, &data, &from)) {
+        handle_message(c, &data, &from);
+    }
+}
+
+/* Handle Message
+ *
+ * Answers pings, puts fragments back together
+ * and passes answers to the request they are for
+ */
+void handle_message(struct vclient *c, packet *data,
+                    struct sockaddr_in *from) {
+    switch (data->header.msg_type) {
+        case 'p':
+            bench_answer_ping(c->sock, data, from);
+            pings_answered++;
+            return;
+        case 'a':
+        case 'd':
+        case 'u':
+            roster_pushes++;
+            return;
+        case 'f': {
+            packet *whole =
+                bench_reassemble(&c->incoming, data, now_ms(), message_lost);
+            if (whole != NULL) {
+                handle_message(c, whole, from);
+                free(whole);
+            }
+            return;
+        }
+    }
+
+    if (c->pending == 0 || data->header.msg_type != c->pending) {
+        late_answers++;
+        return;
+    }
+    handle_answer(c, data);
+}
+
+/* Handle Answer
+ *
+ * Records how long the request took and moves
+ * the client on to what it does next
+ */
+void handle_answer(struct vclient *c, packet *data) {
+    answers++;
+    metrics_record(&latency, c->pending, metrics_clock() - c->sent);
+    timer_wheel_remove(&wheel, &c->timer);
+
+    char error = data->header.msg_error;
+    if (error != '\0') {
+        errors[(unsigned char)error]++;
+    }
+
+    switch (c->state) {
+        case STATE_LOOKING:
+            choose_game(c);
+            break;
+        case STATE_CREATING: {
+            if (error != '\0') {
+                become_idle(c);
+                break;
+            }
+            c->game = data->header.game;
+            int size = draw_game_size();
+            if (size > 1) {
+                forming[forming_count].game = c->game;
+                forming[forming_count].members = 1;
+                forming[forming_count].size = size;
+                forming_count++;
+            }
+            start_playing(c);
+            break;
+        }
+        case STATE_JOINING:
+            if (error != '\0') {
+                // The game is full or gone
+                drop_forming(c->game);
+                become_idle(c);
+                break;
+            }
+            for (int i = 0; i < forming_count; i++) {
+                if (forming[i].game == c->game &&
+                    forming[i].members >= forming[i].size) {
+                    drop_forming(c->game);
+                    break;
+                }
+            }
+            start_playing(c);
+            break;
+        case STATE_LEAVING:
+            become_idle(c);
+            break;
+    }
+}
+
+/* Timer Fired
+ *
+ * Leaves the game once the hold time is up, or gives
+ * up on a request that was not answered in time
+ */
+void timer_fired(struct vclient *c) {
+    if (c->state == STATE_PLAYING) {
+        drop_forming(c->game);
+        c->state = STATE_LEAVING;
+        send_request(c, 'l', c->game, NULL, 0);
+        return;
+    }
+
+    timeouts++;
+    if (c->state == STATE_JOINING) {
+        for (int i = 0; i < forming_count; i++) {
+            if (forming[i].game == c->game) {
+                forming[i].members--;
+            }
+        }
+    }
+
+    // The server may have taken the request, so
+    // leave to be sure the player is not left behind
+    if (c->state == STATE_CREATING || c->state == STATE_JOINING) {
+        c->state = STATE_LEAVING;
+        send_request(c, 'l', c->game, NULL, 0);
+        return;
+    }
+    become_idle(c);
+}
+
+/* Message Lost
+ *
+ * Counts messages that did not all arrive
+ */
+void message_lost(fragment *info, unsigned int game) {
+    (void)info;
+    (void)game;
+    messages_lost++;
+}
+
+/* Print Results
+ *
+ * Prints the request rate, the errors and
+ * the latency of each type of request
+ */
+void print_results(double elapsed) {
+    printf("clients %d, arrivals %lu (%lu with no free client), "
+           "%.1f s\n",
+           client_count, (unsigned long)arrivals,
+           (unsigned long)arrivals_missed, elapsed);
+    printf("requests %lu, answered %lu, %.0f requests/s, "
+           "%lu timed out, %lu late\n",
+           (unsigned long)requests_sent, (unsigned long)answers,
+           answers / elapsed, (unsigned long)timeouts,
+           (unsigned long)late_answers);
+    uint64_t other = 0;
+    for (int i = 0; i < 256; i++) {
+        if (i != 'f' && i != 'e' && i != 'o') {
+            other += errors[i];
+        }
+    }
+    printf("errors: f (full) %lu, e (in a game) %lu, o (out of games) %lu, "
+           "other %lu\n",
+           (unsigned long)errors['f'], (unsigned long)errors['e'],
+           (unsigned long)errors['o'], (unsigned long)other);
+    printf("pings answered %lu, roster pushes %lu, messages lost %lu\n",
+           (unsigned long)pings_answered, (unsigned long)roster_pushes,
+           (unsigned long)messages_lost);
+
+    printf("%-8s %10s %10s %10s %10s %10s\n", "request", "count", "p50 us",
+           "p90 us", "p99 us", "max us");
+    const char *names[] = {"q", "c", "j", "l"};
+    for (int i = 0; i < 4; i++) {
+        const char *types = METRIC_TYPES;
+        struct histogram *h =
+            &latency.handlers[strchr(types, names[i][0]) - types];
+        printf("%-8s %10lu %10.1f %10.1f %10.1f %10.1f\n", names[i],
+               (unsigned long)h->count, histogram_percentile(h, 50) / 1e3,
+               histogram_percentile(h, 90) / 1e3,
+               histogram_percentile(h, 99) / 1e3, h->max / 1e3);
+    }
+}
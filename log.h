@@ -0,0 +1,311 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Logging
+ *
+ * Writes log lines to stderr without making the thread
+ * that logs wait on a lock or on stderr
+ *
+ * Each thread formats its lines into a ring of its own and
+ * a writer thread copies them out. When a ring is full the
+ * line is dropped and counted instead, and the writer says
+ * how many were dropped. Lines below log_level are not
+ * formatted at all
+ *
+ * The writer sleeps while there is nothing to write. The
+ * first line after that wakes it, and it waits
+ * LOG_WAKE_DELAY ms so the lines that follow are written
+ * together
+ */
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+
+// Records in each ring, must be a power of two
+#define LOG_RING_RECORDS 1024
+
+// Longer lines are cut short
+#define LOG_LINE_MAX 127
+
+#define LOG_WAKE_DELAY 10
+
+struct log_record {
+    unsigned char length;
+    char text[LOG_LINE_MAX];
+};
+
+struct log_ring {
+    struct log_record records[LOG_RING_RECORDS];
+
+    // head is only moved by the thread that owns the
+    // ring and tail only by the writer
+    uint64_t head;
+    uint64_t tail;
+
+    uint64_t dropped;
+    uint64_t reported;
+
+    // Rings of threads that ended are taken by new threads
+    int owned;
+    struct log_ring *next;
+};
+
+int log_level = LOG_INFO;
+
+struct log_ring *log_rings = NULL;
+__thread struct log_ring *log_own = NULL;
+pthread_key_t log_owner;
+
+int log_wake_fd = -1;
+int log_waiting = 0;
+
+/* Log Level Named
+ *
+ * Returns the level with the name debug, info,
+ * warn or error, or -1 if there is no such level
+ */
+int log_level_named(const char *name) {
+    const char *names[] = {"debug", "info", "warn", "error"};
+    for (int level = LOG_DEBUG; level <= LOG_ERROR; level++) {
+        if (strcmp(name, names[level]) == 0) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+/* Log Release
+ *
+ * Called when a thread ends, so another
+ * thread can take over its ring
+ */
+void log_release(void *ring) {
+    __atomic_store_n(&((struct log_ring *)ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+/* Log Ring
+ *
+ * Returns the ring of the calling thread, taking a free
+ * one or adding a new one the first time the thread logs
+ * Returns NULL if there is no memory for a ring
+ */
+struct log_ring *log_ring() {
+    if (log_own != NULL) {
+        return log_own;
+    }
+
+    struct log_ring *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        int free_ring = 0;
+        if (__atomic_compare_exchange_n(&ring->owned, &free_ring, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (ring == NULL) {
+        ring = (struct log_ring *)calloc(1, sizeof(struct log_ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->owned = 1;
+        ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, 1,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+
+    log_own = ring;
+    if (log_wake_fd != -1) {
+        pthread_setspecific(log_owner, ring);
+    }
+    return ring;
+}
+
+/* Log Line
+ *
+ * Formats a line, without its newline, into the ring
+ * of the calling thread. Never waits for the writer
+ */
+__attribute__((format(printf, 2, 3))) void log_line(int level,
+                                                    const char *format, ...) {
+    if (level < log_level) {
+        return;
+    }
+    struct log_ring *ring = log_ring();
+    if (ring == NULL) {
+        return;
+    }
+
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+        LOG_RING_RECORDS) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct log_record *record = &ring->records[head & (LOG_RING_RECORDS - 1)];
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+    if (written < 0) {
+        written = 0;
+    } else if (written >= (int)sizeof(record->text)) {
+        written = sizeof(record->text) - 1;
+    }
+    record->length = written;
+
+    // The writer has to see the record before it goes to sleep
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&log_waiting, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(log_wake_fd, &one, sizeof(one)) == -1) {
+            // The writer is already being woken
+        }
+    }
+}
+
+/* Log Write
+ *
+ * Writes all of a buffer to stderr
+ */
+void log_write(const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(STDERR_FILENO, buffer, length);
+        if (written <= 0) {
+            return;
+        }
+        buffer += written;
+        length -= written;
+    }
+}
+
+/* Log Drain
+ *
+ * Writes out every record in the rings, and how
+ * many lines were dropped since the last drain
+ * Returns the number of records written
+ */
+size_t log_drain() {
+    char buffer[16384];
+    size_t used = 0;
+    size_t count = 0;
+    uint64_t dropped = 0;
+
+    struct log_ring *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+        for (uint64_t tail = ring->tail; tail != head; tail++) {
+            struct log_record *record =
+                &ring->records[tail & (LOG_RING_RECORDS - 1)];
+            if (used + record->length + 1 > sizeof(buffer)) {
+                log_write(buffer, used);
+                used = 0;
+            }
+            memcpy(buffer + used, record->text, record->length);
+            used += record->length;
+            buffer[used] = '\n';
+            used++;
+            count++;
+        }
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+        uint64_t total = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        dropped += total - ring->reported;
+        ring->reported = total;
+    }
+
+    if (dropped != 0) {
+        // Make room so the report is never cut
+        char report[64];
+        int written = snprintf(report, sizeof(report),
+                               "Dropped %lu log lines\n",
+                               (unsigned long)dropped);
+        if (used + written > sizeof(buffer)) {
+            log_write(buffer, used);
+            used = 0;
+        }
+        memcpy(buffer + used, report, written);
+        used += written;
+    }
+    log_write(buffer, used);
+    return count;
+}
+
+/* Log Dropped
+ *
+ * Returns the number of lines dropped so far
+ */
+uint64_t log_dropped() {
+    uint64_t dropped = 0;
+    struct log_ring *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
+
+/* Log Writer
+ *
+ * Writes out the rings for as long as the program runs
+ */
+void *log_writer(void *arg) {
+    (void)arg;
+    for (;;) {
+        if (log_drain() != 0) {
+            continue;
+        }
+
+        // Look once more after saying the writer is
+        // asleep, in case a line came in between
+        __atomic_store_n(&log_waiting, 1, __ATOMIC_SEQ_CST);
+        if (log_drain() != 0) {
+            __atomic_store_n(&log_waiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        uint64_t count;
+        if (read(log_wake_fd, &count, sizeof(count)) == -1) {
+            __atomic_store_n(&log_waiting, 0, __ATOMIC_SEQ_CST);
+        }
+
+        struct timespec delay;
+        delay.tv_sec = 0;
+        delay.tv_nsec = LOG_WAKE_DELAY * 1000000L;
+        nanosleep(&delay, NULL);
+    }
+    return NULL;
+}
+
+/* Log Start
+ *
+ * Starts the writer thread. Lines logged before
+ * it starts are written once it does
+ * Returns -1 if it could not be started
+ */
+int log_start() {
+    if (pthread_key_create(&log_owner, log_release) != 0) {
+        return -1;
+    }
+    log_wake_fd = eventfd(0, 0);
+    if (log_wake_fd == -1) {
+        return -1;
+    }
+
+    pthread_t writer_thread;
+    if (pthread_create(&writer_thread, NULL, log_writer, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(writer_thread);
+    return 0;
+}
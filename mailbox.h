@@ -0,0 +1,126 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Mailbox
+ *
+ * Hands packets from one thread to another
+ *
+ * Any thread can post to a mailbox. Only the thread that
+ * owns it takes from it, all of the waiting hand-offs at
+ * once. wake_fd becomes readable when a hand-off is posted
+ * to an empty mailbox, so the owner can wait on it with
+ * its sockets
+ *
+ * Include msg.h before this file
+ */
+struct handoff {
+    char kind;
+    unsigned int old_game;
+    struct sockaddr_in sender_addr;
+    packet data;
+};
+
+struct mailbox {
+    pthread_mutex_t lock;
+    struct handoff *items;
+    unsigned int count;
+    unsigned int capacity;
+
+    // Taken hand-offs are kept here until the next take
+    struct handoff *spare;
+    unsigned int spare_capacity;
+
+    int wake_fd;
+};
+
+/* Mailbox Init
+ *
+ * Returns -1 if the wake up descriptor could not be made
+ */
+int mailbox_init(struct mailbox *box) {
+    memset(box, 0, sizeof(*box));
+    pthread_mutex_init(&box->lock, NULL);
+    box->wake_fd = eventfd(0, EFD_NONBLOCK);
+    return box->wake_fd == -1 ? -1 : 0;
+}
+
+/* Mailbox Post
+ *
+ * Copies the hand-off into the mailbox
+ * Returns -1 if there is no memory for it
+ */
+int mailbox_post(struct mailbox *box, struct handoff *item) {
+    pthread_mutex_lock(&box->lock);
+
+    if (box->count == box->capacity) {
+        unsigned int capacity = box->capacity == 0 ? 64 : box->capacity * 2;
+        struct handoff *items = (struct handoff *)realloc(
+            box->items, capacity * sizeof(struct handoff));
+        if (items == NULL) {
+            pthread_mutex_unlock(&box->lock);
+            return -1;
+        }
+        box->items = items;
+        box->capacity = capacity;
+    }
+
+    box->items[box->count] = *item;
+    box->count++;
+    int was_empty = box->count == 1;
+    pthread_mutex_unlock(&box->lock);
+
+    // Only the first hand-off needs to wake the owner
+    if (was_empty) {
+        uint64_t one = 1;
+        if (write(box->wake_fd, &one, sizeof(one)) == -1) {
+            // The counter is already set, the owner will wake
+        }
+    }
+    return 0;
+}
+
+/* Mailbox Take
+ *
+ * Takes every hand-off that is waiting and returns them
+ * The hand-offs stay valid until the next take
+ */
+struct handoff *mailbox_take(struct mailbox *box, unsigned int *count) {
+    uint64_t posted;
+    if (read(box->wake_fd, &posted, sizeof(posted)) == -1) {
+        // Nothing was posted since the last take
+    }
+
+    pthread_mutex_lock(&box->lock);
+    struct handoff *items = box->items;
+    unsigned int capacity = box->capacity;
+    *count = box->count;
+
+    // Swap the lists so posting can go on while these are handled
+    box->items = box->spare;
+    box->capacity = box->spare_capacity;
+    box->count = 0;
+    box->spare = items;
+    box->spare_capacity = capacity;
+    pthread_mutex_unlock(&box->lock);
+
+    return items;
+}
+
+/* Mailbox Free
+ *
+ * Deallocates the mailbox and closes the wake up descriptor
+ */
+void mailbox_free(struct mailbox *box) {
+    free(box->items);
+    free(box->spare);
+    if (box->wake_fd != -1) {
+        close(box->wake_fd);
+    }
+    pthread_mutex_destroy(&box->lock);
+    memset(box, 0, sizeof(*box));
+    box->wake_fd = -1;
+}
@@ -0,0 +1,291 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Metrics
+ *
+ * Counters and latency histograms that each worker keeps
+ * for itself. Only the thread that owns a block of metrics
+ * changes it, so counting is a relaxed load and store with
+ * no lock. Any thread can add up the blocks at any time,
+ * the totals may be a moment out of date but are never torn
+ *
+ * The histograms are log-linear. Every power of two is split
+ * into HISTOGRAM_SUB buckets, so the values in a bucket are
+ * never more than a quarter apart
+ */
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+
+// Enough buckets for anything under 8 seconds in ns
+#define HISTOGRAM_BUCKETS 128
+
+// The buckets given to Prometheus are powers of two
+// of ns, from about 1 us to about 4 s
+#define PROMETHEUS_FIRST_POWER 10
+#define PROMETHEUS_LAST_POWER 32
+
+// The message types that are timed, in the order of
+// the handlers of a metrics block
+#define METRIC_TYPES "cjlrnyqwps"
+#define METRIC_TYPE_COUNT (sizeof(METRIC_TYPES) - 1)
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+struct metrics {
+    // Time taken to handle each type of request, in ns
+    struct histogram handlers[METRIC_TYPE_COUNT];
+
+    // Requests of a type the server does not know
+    uint64_t unknown;
+
+    uint64_t send_failures;
+
+    // Bytes of rosters and roster changes sent
+    uint64_t roster_bytes;
+};
+
+/* Metrics Clock
+ *
+ * Returns a clock that only goes forward, in ns
+ */
+uint64_t metrics_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Metric Add
+ *
+ * Adds to a counter. Only the thread that
+ * owns the counter can call this
+ */
+void metric_add(uint64_t *counter, uint64_t amount) {
+    uint64_t value = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    __atomic_store_n(counter, value + amount, __ATOMIC_RELAXED);
+}
+
+/* Metric Read
+ *
+ * Reads a counter from any thread
+ */
+uint64_t metric_read(uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* Histogram Bucket
+ *
+ * Returns the bucket a value is counted in
+ */
+unsigned int histogram_bucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB) {
+        return value;
+    }
+
+    int exponent = 63 - __builtin_clzll(value);
+    unsigned int sub =
+        (value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1);
+    unsigned int bucket =
+        (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB + sub;
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+/* Histogram Bucket Start
+ *
+ * Returns the smallest value counted in a bucket
+ */
+uint64_t histogram_bucket_start(unsigned int bucket) {
+    if (bucket < HISTOGRAM_SUB) {
+        return bucket;
+    }
+
+    int exponent = bucket / HISTOGRAM_SUB - 1 + HISTOGRAM_SUB_BITS;
+    uint64_t sub = bucket % HISTOGRAM_SUB;
+    return (HISTOGRAM_SUB + sub) << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+/* Histogram Record
+ *
+ * Counts one value. Only the thread that
+ * owns the histogram can call this
+ */
+void histogram_record(struct histogram *h, uint64_t value) {
+    metric_add(&h->count, 1);
+    metric_add(&h->sum, value);
+    metric_add(&h->buckets[histogram_bucket(value)], 1);
+    if (value > metric_read(&h->max)) {
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+/* Histogram Merge
+ *
+ * Adds the counts of a histogram that may be
+ * in use by another thread into total
+ */
+void histogram_merge(struct histogram *total, struct histogram *h) {
+    total->count += metric_read(&h->count);
+    total->sum += metric_read(&h->sum);
+    uint64_t max = metric_read(&h->max);
+    if (max > total->max) {
+        total->max = max;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        total->buckets[i] += metric_read(&h->buckets[i]);
+    }
+}
+
+/* Histogram Percentile
+ *
+ * Returns the value that percent of the values are
+ * at or below, as the end of the bucket it is in
+ */
+uint64_t histogram_percentile(struct histogram *h, double percent) {
+    uint64_t count = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += h->buckets[i];
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(count * percent / 100);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t end = histogram_bucket_start(i + 1) - 1;
+            return end < h->max ? end : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* Metrics Record
+ *
+ * Counts the time a request of msg_type took
+ */
+void metrics_record(struct metrics *m, char msg_type, uint64_t elapsed) {
+    const char *types = METRIC_TYPES;
+    const char *type = msg_type == '\0' ? NULL : strchr(types, msg_type);
+    if (type == NULL) {
+        metric_add(&m->unknown, 1);
+        return;
+    }
+    histogram_record(&m->handlers[type - types], elapsed);
+}
+
+/* Metrics Merge
+ *
+ * Adds a block of metrics that may be in
+ * use by another thread into total
+ */
+void metrics_merge(struct metrics *total, struct metrics *m) {
+    for (size_t i = 0; i < METRIC_TYPE_COUNT; i++) {
+        histogram_merge(&total->handlers[i], &m->handlers[i]);
+    }
+    total->unknown += metric_read(&m->unknown);
+    total->send_failures += metric_read(&m->send_failures);
+    total->roster_bytes += metric_read(&m->roster_bytes);
+}
+
+/* Text Append
+ *
+ * Adds formatted text to the room bytes at out, after
+ * the used bytes, and moves used on. Text that does
+ * not fit is cut short
+ */
+__attribute__((format(printf, 4, 5))) void text_append(char *out,
+                                                       size_t room,
+                                                       size_t *used,
+                                                       const char *format,
+                                                       ...) {
+    if (*used + 1 >= room) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(out + *used, room - *used, format, args);
+    va_end(args);
+    if (written < 0) {
+        return;
+    }
+    *used += (size_t)written < room - *used ? (size_t)written
+                                            : room - *used - 1;
+}
+
+/* Metrics Prometheus
+ *
+ * Writes the counters and the histograms of a block in
+ * the Prometheus text format, with times in seconds
+ */
+void metrics_prometheus(struct metrics *m, char *out, size_t room,
+                        size_t *used) {
+    text_append(out, room, used,
+                "# HELP bingo_unknown_packets_total Packets of an "
+                "unknown type\n"
+                "# TYPE bingo_unknown_packets_total counter\n"
+                "bingo_unknown_packets_total %lu\n"
+                "# HELP bingo_send_failures_total Packets that could "
+                "not be sent\n"
+                "# TYPE bingo_send_failures_total counter\n"
+                "bingo_send_failures_total %lu\n"
+                "# HELP bingo_roster_bytes_total Bytes of rosters and "
+                "roster changes sent\n"
+                "# TYPE bingo_roster_bytes_total counter\n"
+                "bingo_roster_bytes_total %lu\n",
+                (unsigned long)m->unknown, (unsigned long)m->send_failures,
+                (unsigned long)m->roster_bytes);
+
+    text_append(out, room, used,
+                "# HELP bingo_request_duration_seconds Time taken to "
+                "handle a request\n"
+                "# TYPE bingo_request_duration_seconds histogram\n");
+    for (size_t i = 0; i < METRIC_TYPE_COUNT; i++) {
+        struct histogram *h = &m->handlers[i];
+        char type = METRIC_TYPES[i];
+
+        // Every bucket below the one that starts at
+        // the power of two is under it
+        uint64_t below = 0;
+        unsigned int bucket = 0;
+        for (int power = PROMETHEUS_FIRST_POWER;
+             power <= PROMETHEUS_LAST_POWER; power++) {
+            unsigned int end = histogram_bucket((uint64_t)1 << power);
+            for (; bucket < end; bucket++) {
+                below += h->buckets[bucket];
+            }
+            text_append(out, room, used,
+                        "bingo_request_duration_seconds_bucket"
+                        "{type=\"%c\",le=\"%.10g\"} %lu\n",
+                        type, (double)((uint64_t)1 << power) / 1e9,
+                        (unsigned long)below);
+        }
+
+        // The count is taken from the same buckets, since
+        // count may have been read before more were counted
+        for (; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            below += h->buckets[bucket];
+        }
+        text_append(out, room, used,
+                    "bingo_request_duration_seconds_bucket"
+                    "{type=\"%c\",le=\"+Inf\"} %lu\n"
+                    "bingo_request_duration_seconds_sum{type=\"%c\"} %.9f\n"
+                    "bingo_request_duration_seconds_count{type=\"%c\"} "
+                    "%lu\n",
+                    type, (unsigned long)below, type, (double)h->sum / 1e9,
+                    type, (unsigned long)below);
+    }
+}
@@ -1,3 +1,10 @@
+#ifndef MSG_H
+#define MSG_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <string.h>
+
 /* Message Header
  *
  * Contains information on
@@ -5,10 +12,13 @@
  * The type of error (if there is any)
  * The game number the mesage is related to
  * The length of the message
+ *
+ * protocol used to be padding, see Protocol Versions
  */
 typedef struct msg_header {
     char msg_type;
     char msg_error;
+    char protocol[2];
     unsigned int game;
     unsigned int msg_length;
 } message_header;
@@ -23,4 +33,300 @@ typedef struct msg_header {
 typedef struct packet_t {
     struct msg_header header;
     char msg[1000];
-} packet;
\ No newline at end of file
+} packet;
+
+/* Roster Messages
+ *
+ * Every change to the members of a game gives
+ * the game a new roster version
+ *
+ * 'c' create response: the roster version
+ * 'j' join response and 'u' full update: the roster
+ *     version followed by every members sockaddr_in
+ * 'a' member added and 'd' member dropped: a roster_delta
+ * 'y' resync request: sent by a player that missed a
+ *     version, the server answers with a 'u'
+ */
+typedef struct roster_delta_t {
+    unsigned int version;
+    struct sockaddr_in addr;
+} roster_delta;
+
+/* Lobby Query
+ *
+ * 'q' asks the server for one page of the lobby
+ * Games are listed in order of their game number,
+ * starting after the cursor
+ *
+ * limit of 0 asks for as many games as fit in a packet
+ * max_players of 0 means there is no maximum
+ * open_only skips games that are full
+ */
+typedef struct lobby_query_t {
+    unsigned int cursor;
+    unsigned int limit;
+    unsigned int min_players;
+    unsigned int max_players;
+    unsigned char open_only;
+} lobby_query;
+
+/* Lobby Page
+ *
+ * The answer to a 'q'. next_cursor is sent back in
+ * the next query to get the page after this one,
+ * it is 0 when there are no more games
+ *
+ * The page can have fewer games than asked for
+ * when the server stops looking early, so keep
+ * going until next_cursor is 0
+ */
+typedef struct lobby_entry_t {
+    unsigned int game;
+    unsigned int players;
+    unsigned int max_players;
+} lobby_entry;
+
+typedef struct lobby_page_t {
+    unsigned int next_cursor;
+    unsigned int count;
+} lobby_page;
+
+#define LOBBY_PAGE_MAX \
+    ((sizeof(((packet *)0)->msg) - sizeof(lobby_page)) / sizeof(lobby_entry))
+
+/* Lobby Watching
+ *
+ * 'w' with a one byte message of 1 starts watching the
+ * lobby and 0 stops. The server answers with a 'w'
+ *
+ * While watching, the server sends 'v' packets with a
+ * lobby_page of the games that changed, at most once per
+ * interval. A game with 0 players has ended. Watchers
+ * must answer pings or they stop being sent changes
+ *
+ * Changes are only sent from when watching starts, use
+ * a 'q' query to get the games that already exist
+ */
+
+/* Pings
+ *
+ * The server sends 'p' to the status port of every peer
+ * Peers answer with a 'p' that keeps the game number of
+ * the ping, so the answer reaches the worker that sent it
+ */
+
+/* Stats
+ *
+ * 's' with no message asks the server for its metrics
+ * The answer is an 's' with text, one metric per line
+ *   games, peers, unknown, send_failures, roster_bytes
+ *   and log_dropped, each followed by its value
+ *   handler followed by a message type and the count,
+ *   mean, p50, p90, p99 and max time in ns it took the
+ *   server to handle requests of that type
+ */
+
+/* Fragments
+ *
+ * A message too long for one packet, such as the roster
+ * of a large game or the 'r' listing of a large lobby, is
+ * sent as 'f' packets. Each holds a fragment followed by
+ * up to FRAGMENT_DATA bytes of the message, and has the
+ * game of the whole message in its header
+ *
+ * Every piece of a message has the same id, and the id
+ * changes from one message to the next. total is the
+ * length of the whole message and offset is where the
+ * piece goes, always a multiple of FRAGMENT_DATA
+ *
+ * Pieces can arrive in any order. A message still missing
+ * pieces after FRAGMENT_TIMEOUT ms is dropped, and a lost
+ * roster is asked for again with a 'y'
+ */
+typedef struct fragment_t {
+    unsigned int id;
+    unsigned int total;
+    unsigned int offset;
+    char msg_type;
+    char msg_error;
+} fragment;
+
+// Leaves a byte of the packet for the terminator
+#define FRAGMENT_DATA (sizeof(((packet *)0)->msg) - sizeof(fragment) - 1)
+#define FRAGMENT_TIMEOUT 2000
+
+// The longest message that can be sent in fragments
+#define FRAGMENT_MAX_TOTAL (1 << 20)
+
+/* Short Replies
+ *
+ * Anyone can send an 'r' or an 's', so a spoofed request
+ * could aim a large answer at someone else. Their answers
+ * are cut at a line to at most SHORT_REPLY_MAX bytes and
+ * then have an msg_error of 't'. Use 'q' to page through
+ * a lobby that does not fit
+ */
+#define SHORT_REPLY_MAX (2 * FRAGMENT_DATA)
+
+/* Protocol Versions
+ *
+ * Version 1 sends message_header as it is in memory,
+ * 12 bytes in host byte order
+ *
+ * Version 2 sends a compact header in network order
+ *   byte 0  PROTOCOL_V2, which is never a v1 msg_type
+ *   byte 1  msg_type
+ *   byte 2  msg_error
+ *   game and then msg_length as varints, 7 bits to a
+ *   byte with the highest bits first and the top bit
+ *   set on every byte but the last
+ * followed by exactly msg_length bytes of message. The
+ * messages are the same in both versions
+ *
+ * A v1 sender that can read v2 puts PROTOCOL_HINT in the
+ * protocol bytes. The server answers a peer in v2 once it
+ * sent the hint or a v2 packet, and the client moves to v2
+ * once the server answers it in v2. Peers always talk to
+ * each other in v1
+ */
+#define PROTOCOL_V2 0x82
+#define PROTOCOL_HINT "v2"
+
+// The most and fewest bytes a header can take
+#define HEADER_MAX 13
+#define HEADER_MIN 5
+
+/* Varint Put
+ *
+ * Writes a number as a varint
+ * Returns the number of bytes written
+ */
+static inline size_t varint_put(unsigned char *out, unsigned int value) {
+    unsigned char groups[5];
+    size_t count = 0;
+    do {
+        groups[count] = value & 0x7f;
+        count++;
+        value >>= 7;
+    } while (value != 0);
+
+    for (size_t i = 0; i < count; i++) {
+        out[i] = groups[count - 1 - i] | (i + 1 < count ? 0x80 : 0);
+    }
+    return count;
+}
+
+/* Varint Get
+ *
+ * Reads a varint from at most length bytes
+ * Returns the number of bytes read, or 0 if
+ * the varint does not end in time
+ */
+static inline size_t varint_get(const unsigned char *in, size_t length,
+                                unsigned int *value) {
+    unsigned int number = 0;
+    for (size_t i = 0; i < length && i < 5; i++) {
+        number = (number << 7) | (in[i] & 0x7f);
+        if (!(in[i] & 0x80)) {
+            *value = number;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* Header Encode V2
+ *
+ * Writes a header in the v2 format, which
+ * needs room for HEADER_MAX bytes
+ * Returns the number of bytes written
+ */
+static inline size_t header_encode_v2(const message_header *header,
+                                      unsigned char *out) {
+    out[0] = PROTOCOL_V2;
+    out[1] = header->msg_type;
+    out[2] = header->msg_error;
+    size_t length = 3;
+    length += varint_put(out + length, header->game);
+    length += varint_put(out + length, header->msg_length);
+    return length;
+}
+
+/* Speaks V2
+ *
+ * Returns 1 if the sender of a
+ * decoded packet can read v2
+ */
+static inline int speaks_v2(const message_header *header) {
+    return memcmp(header->protocol, PROTOCOL_HINT, 2) == 0;
+}
+
+/* Packet Decode
+ *
+ * Turns a datagram of length bytes that was read into a
+ * packet into a packet with a normal header, in place.
+ * A v2 packet is marked with PROTOCOL_HINT
+ *
+ * msg_length is cut down to the bytes that arrived and
+ * a v2 message gets a terminator after its last byte
+ * Returns the version it was sent in, or -1 if it is
+ * not a valid packet
+ */
+static inline int packet_decode(packet *data, size_t length) {
+    unsigned char *raw = (unsigned char *)data;
+    if (length > sizeof(packet)) {
+        length = sizeof(packet);
+    }
+
+    if (length == 0 || raw[0] != PROTOCOL_V2) {
+        if (length < sizeof(message_header)) {
+            return -1;
+        }
+        // Only count the part of the message that arrived
+        if (data->header.msg_length > length - sizeof(message_header)) {
+            data->header.msg_length = length - sizeof(message_header);
+        }
+        return 1;
+    }
+    if (length < HEADER_MIN) {
+        return -1;
+    }
+
+    char msg_type = raw[1];
+    char msg_error = raw[2];
+    unsigned int game;
+    unsigned int msg_length;
+    size_t used = 3;
+
+    size_t read = varint_get(raw + used, length - used, &game);
+    if (read == 0) {
+        return -1;
+    }
+    used += read;
+    read = varint_get(raw + used, length - used, &msg_length);
+    if (read == 0) {
+        return -1;
+    }
+    used += read;
+
+    // Keep what arrived and room for the terminator
+    size_t size = length - used;
+    if (size > sizeof(data->msg) - 1) {
+        size = sizeof(data->msg) - 1;
+    }
+    if (msg_length > size) {
+        msg_length = size;
+    }
+
+    memmove(data->msg, raw + used, size);
+    data->msg[size] = '\0';
+
+    data->header.msg_type = msg_type;
+    data->header.msg_error = msg_error;
+    memcpy(data->header.protocol, PROTOCOL_HINT, 2);
+    data->header.game = game;
+    data->header.msg_length = msg_length;
+    return 2;
+}
+
+#endif
@@ -0,0 +1,236 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Peer Table
+ *
+ * Open addressing hash table that maps a packed
+ * IP Address and port number to a peer
+ *
+ * Uses linear probing with backward shift deletion
+ * so there are never any tombstones to skip over
+ */
+struct peer;
+
+struct peer_slot {
+    uint64_t key;
+    struct peer *value;
+};
+
+struct peer_table {
+    struct peer_slot *slots;
+    size_t capacity;
+    size_t count;
+};
+
+/* Peer Key
+ *
+ * Packs the IP Address (network order) and
+ * the port number into a single 64 bit key
+ */
+uint64_t peer_key(unsigned int ip_addr, short port) {
+    return ((uint64_t)ip_addr << 16) | (unsigned short)port;
+}
+
+/* Peer Key IP Address
+ *
+ * Returns the IP Address that is stored in a key
+ */
+unsigned int peer_key_ip(uint64_t key) { return (unsigned int)(key >> 16); }
+
+/* Peer Key Port
+ *
+ * Returns the port number that is stored in a key
+ */
+short peer_key_port(uint64_t key) { return (short)(key & 0xffff); }
+
+/* Peer Hash
+ *
+ * Mixes the bits of the key so that peers on the
+ * same IP Address do not land next to each other
+ */
+size_t peer_hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return (size_t)key;
+}
+
+/* Peer Table Init
+ *
+ * Allocates the slots for the table. The capacity is
+ * rounded up to a power of two
+ */
+void peer_table_init(struct peer_table *table, size_t capacity) {
+    size_t size = 16;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    table->slots = (struct peer_slot *)calloc(size, sizeof(struct peer_slot));
+    table->capacity = size;
+    table->count = 0;
+}
+
+/* Peer Table Free
+ *
+ * Deallocates the slots of the table. The peers
+ * themselves are owned by the caller
+ */
+void peer_table_free(struct peer_table *table) {
+    free(table->slots);
+    table->slots = NULL;
+    table->capacity = 0;
+    table->count = 0;
+}
+
+/* Peer Table Find
+ *
+ * Returns the peer with the given key, or NULL
+ * if there is no such peer
+ */
+struct peer *peer_table_find(struct peer_table *table, uint64_t key) {
+    size_t mask = table->capacity - 1;
+    size_t i = peer_hash(key) & mask;
+
+    while (table->slots[i].value != NULL) {
+        if (table->slots[i].key == key) {
+            return table->slots[i].value;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return NULL;
+}
+
+/* Peer Table Grow
+ *
+ * Doubles the number of slots and moves
+ * every peer into the new slots
+ * Returns -1 and keeps the old slots if
+ * the new ones could not be allocated
+ */
+int peer_table_grow(struct peer_table *table) {
+    struct peer_slot *slots = (struct peer_slot *)calloc(
+        table->capacity * 2, sizeof(struct peer_slot));
+    if (slots == NULL) {
+        return -1;
+    }
+
+    struct peer_slot *old_slots = table->slots;
+    size_t old_capacity = table->capacity;
+    table->slots = slots;
+    table->capacity = old_capacity * 2;
+
+    size_t mask = table->capacity - 1;
+    for (size_t j = 0; j < old_capacity; j++) {
+        if (old_slots[j].value == NULL) {
+            continue;
+        }
+
+        size_t i = peer_hash(old_slots[j].key) & mask;
+        while (table->slots[i].value != NULL) {
+            i = (i + 1) & mask;
+        }
+        table->slots[i] = old_slots[j];
+    }
+
+    free(old_slots);
+    return 0;
+}
+
+/* Peer Table Insert
+ *
+ * Adds a peer to the table
+ *
+ * 0 -> the peer was added
+ * -1 -> a peer with the key already exists
+ * -2 -> the table is full and could not grow
+ */
+int peer_table_insert(struct peer_table *table, uint64_t key,
+                      struct peer *value) {
+    // Keep the table at most half full, or at least
+    // one slot empty so lookups always stop
+    if ((table->count + 1) * 2 > table->capacity &&
+        peer_table_grow(table) == -1 && table->count + 1 >= table->capacity) {
+        return -2;
+    }
+
+    size_t mask = table->capacity - 1;
+    size_t i = peer_hash(key) & mask;
+
+    while (table->slots[i].value != NULL) {
+        if (table->slots[i].key == key) {
+            return -1;
+        }
+        i = (i + 1) & mask;
+    }
+
+    table->slots[i].key = key;
+    table->slots[i].value = value;
+    table->count++;
+    return 0;
+}
+
+/* Peer Table Remove
+ *
+ * Removes the peer with the given key from the table
+ * and returns it, or NULL if there is no such peer
+ */
+struct peer *peer_table_remove(struct peer_table *table, uint64_t key) {
+    size_t mask = table->capacity - 1;
+    size_t i = peer_hash(key) & mask;
+
+    while (table->slots[i].value != NULL && table->slots[i].key != key) {
+        i = (i + 1) & mask;
+    }
+
+    struct peer *removed = table->slots[i].value;
+    if (removed == NULL) {
+        return NULL;
+    }
+
+    // Shift back any peers that probed past the removed slot
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (table->slots[j].value == NULL) {
+            break;
+        }
+
+        size_t home = peer_hash(table->slots[j].key) & mask;
+
+        // Skip peers whose home slot lies between the hole and j
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+            continue;
+        }
+
+        table->slots[i] = table->slots[j];
+        i = j;
+    }
+
+    table->slots[i].value = NULL;
+    table->count--;
+    return removed;
+}
+
+/* Peer Table Next
+ *
+ * Iterates over the table. Start with *index at 0
+ * and call until NULL is returned
+ *
+ * The table must not be changed while iterating
+ */
+struct peer *peer_table_next(struct peer_table *table, size_t *index) {
+    while (*index < table->capacity) {
+        struct peer *value = table->slots[*index].value;
+        (*index)++;
+        if (value != NULL) {
+            return value;
+        }
+    }
+
+    return NULL;
+}
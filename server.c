@@ -2,731 +2,2372 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <linux/filter.h>
 #include <locale.h>
 #include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 // Local files
+#include "exporter.h"
+#include "game_ids.h"
+#include "log.h"
 #include "msg.h"
-#include "uthash.h"
-
-// Hard set values
-#define MAX_GAMES 20
-#define MAX_PLAYERS 20
+#include "mailbox.h"
+#include "metrics.h"
+#include "peer_table.h"
+#include "slab_pool.h"
+#include "timer_wheel.h"
+#include "udp_batch.h"
+#include "uring.h"
+
+// The most games looked at for one lobby query
+#define LOBBY_SCAN_LIMIT 4096
+
+// Default values, can be changed at startup
+#define DEFAULT_PORT 7400
+#define DEFAULT_MAX_GAMES 20
+#define DEFAULT_MAX_PLAYERS 20
+#define DEFAULT_LOBBY_INTERVAL 1000
+#define DEFAULT_WORKERS 1
+#define DEFAULT_LIVENESS_TIMEOUT 30000
+
+// How often peer deadlines are checked, in milliseconds
+#define LIVENESS_TICK 250
+
+// How long to wait for the answer to a ping, in milliseconds,
+// before a round trip was measured and at the least
+#define INITIAL_RTO 1000
+#define MIN_RTO LIVENESS_TICK
+
+// Pings sent to a silent peer before it is removed
+#define PING_TRIES 3
+
+// The shortest liveness_timeout that leaves room for every
+// ping to wait at least MIN_RTO
+#define MIN_LIVENESS_TIMEOUT (2 * ((1 << PING_TRIES) - 1) * MIN_RTO)
+
+// Receive buffers each io_uring worker keeps
+// posted, must be a power of two
+#define URING_BUFFERS 256
+
+// What each io_uring completion is for
+#define URING_SOCK 0
+#define URING_STATUS_SOCK 1
+#define URING_MAILBOX 2
+#define URING_LOBBY_TIMER 3
+#define URING_LIVENESS_TIMER 4
+
+// The peer directory is split so workers rarely wait on each other
+#define DIRECTORY_STRIPES 64
+
+// Kinds of hand-off between workers
+#define HANDOFF_PACKET 'f'
+#define HANDOFF_STATUS 's'
+#define HANDOFF_MOVE 'm'
+#define HANDOFF_JOIN 'j'
+
+// The most players whose addresses fit in one roster
+// message after the roster version
+#define MAX_ROSTER                                      \
+    (int)((FRAGMENT_MAX_TOTAL - sizeof(unsigned int)) / \
+          sizeof(struct sockaddr_in))
+
+// The longest line of the lobby listing
+#define LOBBY_LINE_MAX 64
 
 struct peer {
     char name[20];
-    char ip_and_port[20];
+    unsigned int ip_addr;
+    short port;
     unsigned int game;
-    short status;
-    UT_hash_handle hh;
+
+    // Where the peer is in its games member list
+    int member_index;
+
+    // The shard the record belongs to
+    int shard;
+
+    // Whether the peer reads v2 packets
+    char v2;
+
+    // When the peer is next checked on
+    struct wheel_timer liveness;
+
+    // When anything was last heard from the peer and when
+    // the first unanswered ping was sent, or 0, in ms
+    uint64_t heard;
+    uint64_t pinged;
+    int ping_tries;
+
+    // Smoothed round trip time of pings and its
+    // variation in ms, 0 before the first answer
+    unsigned int srtt;
+    unsigned int rttvar;
+};
+
+/* Game
+ *
+ * A game and the list of peers that are in it
+ * A game with no members is not in use
+ *
+ * The roster holds the address of each member in the
+ * same order as members, ready to be sent as it is
+ *
+ * The version goes up on every change to the members
+ * and is never reset, so it keeps going up when the
+ * game number is reused
+ */
+struct game {
+    struct peer **members;
+    struct sockaddr_in *roster;
+
+    // Stored atomically, other workers read it for the lobby
+    int count;
+    unsigned int version;
+};
+
+/* Shard
+ *
+ * The games, peers and sockets owned by one worker
+ *
+ * Each shard has its own block of game numbers, from
+ * first_game + 1 to first_game plus the capacity of ids,
+ * so the shard of a game is found with one division
+ *
+ * Only the worker of a shard changes it. Requests for
+ * another shard are handed over through its mailbox
+ * number_of_games and the numbers in ids are read by
+ * other workers, so they are stored atomically
+ */
+struct shard {
+    int index;
+    unsigned int first_game;
+    int sock;
+    int status_sock;
+    struct peer_table peers;
+    struct slab_pool pool;
+    struct game_ids ids;
+    int number_of_games;
+
+    // The lobby listing, rebuilt only after games change
+    // lobby_length counts the terminator
+    char *lobby_text;
+    size_t lobby_length;
+    size_t lobby_room;
+    unsigned int lobby_built;
+
+    // Games of this shard that changed since
+    // lobby watchers were last told
+    unsigned int *lobby_changes;
+    uint64_t *lobby_changed;
+    unsigned int lobby_change_count;
+
+    struct mailbox mailbox;
+
+    // Deadlines of the peers, checked on every tick
+    // of liveness_timer while there are any
+    struct timer_wheel wheel;
+    int liveness_timer;
+    int ticking;
+
+    // Only changed by the worker, read by any thread
+    struct metrics metrics;
+};
+
+/* Directory Stripe
+ *
+ * Part of the directory of every player in a game,
+ * used to find the shard a player belongs to
+ */
+struct directory_stripe {
+    pthread_mutex_t lock;
+    struct peer_table peers;
 };
 
 // Globals
-struct peer *all_peers;
-int sock;
-int status_sock;
-pthread_mutex_t print_lock;
-pthread_mutex_t peers_lock;
+struct shard *shards;
+int shard_count = DEFAULT_WORKERS;
+unsigned int shard_games;
+struct game *games;
+struct directory_stripe directory[DIRECTORY_STRIPES];
+
+// Goes up on every change to a game, so each shard
+// knows when its lobby listing is out of date
+unsigned int lobby_version = 1;
+
+// Peers watching the lobby, shared by every shard
+// Their deadlines are kept by the first shard
+struct peer_table lobby_watchers;
+struct slab_pool watcher_pool;
+struct timer_wheel watcher_wheel;
+pthread_mutex_t watchers_lock;
+
+// The count of lobby_watchers, read without the lock
+size_t watcher_count = 0;
+
+// Limits set at startup
+unsigned short server_port = DEFAULT_PORT;
+unsigned int max_games = DEFAULT_MAX_GAMES;
+int max_players = DEFAULT_MAX_PLAYERS;
+size_t memory_budget = 0;
+unsigned int lobby_interval = DEFAULT_LOBBY_INTERVAL;
+unsigned int liveness_timeout = DEFAULT_LIVENESS_TIMEOUT;
+int use_io_uring = 0;
+
+// Loopback port of the metrics exporter, 0 when it is off
+unsigned short metrics_port = 0;
+struct exporter exporter;
+
+// The shard the calling thread works on
+__thread struct shard *shard;
+
+// The kind of hand-off being handled, 0 for a packet
+// that came straight from a socket
+__thread char handoff_kind = 0;
+
+// Every thread sends its fan-outs through its own batch
+__thread struct send_batch fan_out;
+
+// Whether the sender of the packet being handled reads
+// v2, which is the version replies to it are sent in
+__thread int reply_v2 = 0;
+
+// The id of the last message sent in fragments
+unsigned int fragment_ids = 0;
 
 // // Function Prototypes
 short parse_arguments(int argc, char **argv);
-void *out(void *ptr);
-void *inp(void *ptr);
+unsigned long parse_number(const char *text, unsigned long max,
+                           const char *what);
+void read_config(const char *path);
+void set_option(const char *option, const char *value);
+size_t game_memory();
+size_t memory_reserved();
+void *worker(void *ptr);
+void *uring_worker(void *ptr);
+int uring_arm(struct uring *ring, int tag, struct msghdr *messages,
+              struct uring_buffers *buffers, int lobby_timer);
+void handle_ready(int ready_fd, int lobby_timer);
+int start_timer(unsigned int interval);
+void watch_descriptor(int events, int descriptor);
+uint64_t now_ms();
+uint64_t liveness_now();
+void set_ticking(int on);
+void check_liveness();
+int expire_peers(struct timer_wheel *wheel, uint64_t now, int watchers);
+void schedule_liveness(struct timer_wheel *wheel, struct peer *p,
+                       uint64_t at);
+uint64_t first_deadline(struct peer *p);
+unsigned int peer_rto(struct peer *p);
+void sample_rtt(struct peer *p, unsigned int rtt);
+void mark_heard(struct peer *p, uint64_t now);
+void peer_heard(unsigned int ip_addr, short port);
+void ping_peer(struct peer *p);
+void handle_handoff(struct handoff *item);
+int hand_off(packet *get_packet, struct sockaddr_in *sender_addr, char kind);
+int route_packet(packet *get_packet, unsigned int ip_addr, short port);
+void post_handoff(int target, char kind, packet *data,
+                  struct sockaddr_in *sender_addr, unsigned int old_game);
+void move_out(struct handoff *item);
+void handle_packet(packet *get_packet, struct sockaddr_in *sender_addr);
+void handle_status_packet(packet *get_packet,
+                          struct sockaddr_in *sender_addr);
 void mark_peer_alive(unsigned int ip_addr, short port);
-void ping_players();
-void remove_inactive_players();
 void create_game(unsigned int ip_addr, short port, char *name);
-void join_game(unsigned int ip_addr, short port, unsigned int game, char *name);
+void join_game(unsigned int ip_addr, short port, unsigned int game, char *name,
+               unsigned int moved_from);
 void leave_game(unsigned int ip_addr, short port);
 void list_games(unsigned int ip_addr, short port);
-void peer_list(unsigned int join_ip, short join_port, unsigned int game,
-               char *name);
+void build_lobby();
+int grow_lobby(size_t needed);
+void query_lobby(unsigned int ip_addr, short port, packet *query_packet);
+void watch_lobby(unsigned int ip_addr, short port, packet *watch_packet);
+void note_lobby_change(unsigned int game);
+void send_lobby_changes();
+struct send_batch *fan_out_batch(int socket);
+void queue_reply(packet *send_packet, size_t length, unsigned int ip_addr,
+                 short port);
+void queue_message(message_header *header, struct iovec *data, int count,
+                   struct sockaddr_in *send_addr, int v2);
+void gather_bytes(struct iovec *data, int count, size_t offset, char *out,
+                  size_t length);
+size_t wire_header(message_header *header, int v2, unsigned char *out);
+void report_send_failure(struct sockaddr_in *send_addr, int error);
+void send_delta(unsigned int game, char msg_type, unsigned int ip_addr,
+                short port);
+void resync_roster(unsigned int ip_addr, short port, unsigned int game);
 void send_error(unsigned int ip_addr, short port, char msg_type,
                 char msg_error);
 void get_player_name(unsigned long ip_addr, short port);
+void send_stats(unsigned int ip_addr, short port);
+size_t cut_reply(const char *text, size_t length, char *msg_error);
+void total_metrics(struct metrics *total, size_t *peers);
+size_t render_metrics(char *out, size_t room);
+void send_roster(struct game *g, unsigned int game, char msg_type,
+                 struct peer *p);
+struct game *find_game(unsigned int game);
+int game_shard(unsigned int game);
+unsigned int next_game(unsigned int after);
+unsigned int acquire_game();
+struct directory_stripe *directory_stripe_of(uint64_t key);
+int directory_add(struct peer *p);
+void directory_remove(uint64_t key);
+int directory_owner(uint64_t key);
+int open_game(unsigned int game);
+void add_member(struct peer *p, unsigned int game);
+void remove_member(struct peer *p);
+struct peer *make_peer(struct slab_pool *pool, unsigned int ip_addr,
+                       short port, char *name);
+void init_shard(struct shard *s, int index, unsigned int first_game,
+                unsigned int capacity);
+int open_socket(unsigned short port);
+int attach_steering(int socket);
 
 int get_number_of_games();
 struct sockaddr_in get_sockaddr_in(unsigned int ip_addr, short port);
-unsigned int get_ip(char *ip_port);
-short get_port(char *ip_port);
 
-/* Input
+/* Handle Status Packet
+ *
+ * Uses the packet header to determine what to do
+ * with a packet from the status socket
+ */
+void handle_status_packet(packet *get_packet,
+                          struct sockaddr_in *sender_addr) {
+    // Get the IP Address and port
+    unsigned int ip_addr = sender_addr->sin_addr.s_addr;
+    short port = htons(sender_addr->sin_port);
+
+    // Answers from players of another shard are handed to it
+    if (hand_off(get_packet, sender_addr, HANDOFF_STATUS)) {
+        return;
+    }
+    reply_v2 = speaks_v2(&get_packet->header);
+    uint64_t started = metrics_clock();
+
+    switch (get_packet->header.msg_type) {
+        // Player responded to ping
+        case 'p':
+            mark_peer_alive(ip_addr, port);
+            metrics_record(&shard->metrics, 'p', metrics_clock() - started);
+            break;
+        default:
+            log_line(LOG_WARN, "%s", "Received unknown packet");
+            metric_add(&shard->metrics.unknown, 1);
+            break;
+    }
+}
+
+/* Handle Packet
+ *
+ * Checks the message header of a packet from the
+ * primary socket to determine what needs to be done
+ */
+void handle_packet(packet *get_packet, struct sockaddr_in *sender_addr) {
+    // Get the IP Address of the sender
+    unsigned int ip_addr = sender_addr->sin_addr.s_addr;
+
+    // Get Port Number of the sender
+    short port = htons(sender_addr->sin_port);
+
+    // Requests for the games and players of
+    // another shard are handed to it
+    if (hand_off(get_packet, sender_addr, HANDOFF_PACKET)) {
+        return;
+    }
+    reply_v2 = speaks_v2(&get_packet->header);
+    uint64_t started = metrics_clock();
+
+    // Any request shows the player is still there
+    peer_heard(ip_addr, port);
+
+    switch (get_packet->header.msg_type) {
+        case 'c':
+            create_game(ip_addr, port, get_packet->msg);
+            break;
+        case 'j':
+            join_game(ip_addr, port, get_packet->header.game, get_packet->msg,
+                      0);
+            break;
+        case 'l':
+            leave_game(ip_addr, port);
+            break;
+        case 'r':
+            list_games(ip_addr, port);
+            break;
+        case 'n':
+            get_player_name(ip_addr, port);
+            break;
+        case 'y':
+            resync_roster(ip_addr, port, get_packet->header.game);
+            break;
+        case 'q':
+            query_lobby(ip_addr, port, get_packet);
+            break;
+        case 'w':
+            watch_lobby(ip_addr, port, get_packet);
+            break;
+        case 's':
+            send_stats(ip_addr, port);
+            break;
+        default:
+            log_line(LOG_WARN, "%s", "Unkown Type of Packet Recieved");
+            metric_add(&shard->metrics.unknown, 1);
+            return;
+    }
+
+    metrics_record(&shard->metrics, get_packet->header.msg_type,
+                   metrics_clock() - started);
+}
+
+/* Worker
+ *
+ * Runs one shard on one thread. Waits on the sockets and
+ * mailbox of the shard and on a timer for lobby changes
+ * and one for peer deadlines, so nothing runs while it
+ * is idle
  */
-void *inp(void *ptr) {
-    socklen_t addrlen = 10;
-    struct sockaddr_in sender_addr;
-    packet get_packet;
+void *worker(void *ptr) {
+    shard = (struct shard *)ptr;
 
+    struct recv_batch batch;
+    recv_batch_init(&batch, UDP_BATCH_SIZE);
+
+    int lobby_timer = start_timer(lobby_interval);
+
+    int events = epoll_create1(0);
+    if (events == -1) {
+        fprintf(stderr, "Failed to create epoll: %s\n", strerror(errno));
+        abort();
+    }
+    watch_descriptor(events, shard->sock);
+    watch_descriptor(events, shard->status_sock);
+    watch_descriptor(events, shard->mailbox.wake_fd);
+    watch_descriptor(events, lobby_timer);
+    watch_descriptor(events, shard->liveness_timer);
+
+    struct epoll_event ready[8];
     while (1) {
-        // check ping socket - mark sender status
-
-        // Check to see if the packet was not sucessfuly received
-        if (recvfrom(status_sock, &get_packet, sizeof(get_packet), 0,
-                     (struct sockaddr *)&sender_addr, &addrlen) == -1) {
-            pthread_mutex_lock(&print_lock);
-            fprintf(stderr, "%p\n", "ignoring Packet that failed to receive");
-            pthread_mutex_unlock(&print_lock);
-        } else {
-            // Get the IP Address and port
-            unsigned int ip_addr = sender_addr.sin_addr.s_addr;
-            short port = htons(sender_addr.sin_port);
-
-            // Use the packet header to determine what to do
-            switch (get_packet.header.msg_type) {
-                // Player responded to ping
-                case 'p':
-                    mark_peer_alive(ip_addr, port);
-                    break;
-                default:
-                    pthread_mutex_lock(&print_lock);
-                    fprintf(stderr, "%p\n", "Received unknown packet");
-                    pthread_mutex_unlock(&print_lock);
-                    break;
+        int count = epoll_wait(events, ready, 8, -1);
+        if (count == -1) {
+            if (errno != EINTR) {
+                log_line(LOG_ERROR, "Failed to wait for packets: %s",
+                         strerror(errno));
+            }
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            int ready_fd = ready[i].data.fd;
+
+            if (ready_fd == shard->sock) {
+                // Requests from players
+                if (recv_batch_fill(&batch, shard->sock) == -1) {
+                    continue;
+                }
+                for (unsigned int j = 0; j < batch.count; j++) {
+                    if (packet_decode(&batch.packets[j],
+                                      batch.msgs[j].msg_len) != -1) {
+                        handle_packet(&batch.packets[j], &batch.addrs[j]);
+                    }
+                }
+            } else if (ready_fd == shard->status_sock) {
+                // Answers to pings
+                if (recv_batch_fill(&batch, shard->status_sock) == -1) {
+                    continue;
+                }
+                for (unsigned int j = 0; j < batch.count; j++) {
+                    if (packet_decode(&batch.packets[j],
+                                      batch.msgs[j].msg_len) != -1) {
+                        handle_status_packet(&batch.packets[j],
+                                             &batch.addrs[j]);
+                    }
+                }
+            } else {
+                handle_ready(ready_fd, lobby_timer);
             }
         }
+
+        // Send the replies queued while handling the packets
+        send_batch_flush(&fan_out);
     }
     return NULL;
 }
 
-/* Out
+/* Uring Worker
+ *
+ * Runs one shard like worker, but through io_uring. A
+ * multishot receive stays posted on each socket and the
+ * mailbox and timers are polled on the same ring, so one
+ * system call submits, waits and collects everything
+ *
+ * Sends go through a second ring, flushed in batches
+ * Falls back to worker if io_uring can not be used, or
+ * if a request ends with an error other than running
+ * out of buffers, which would only come back if posted
+ * again
  */
-void *out(void *ptr) {
-    clock_t current_time;
-    ping_players();
-    current_time = clock();
-    while (1) {
-        // If the time to respond is longer than 60 seconds
-        if ((float)(clock() - current_time) / CLOCKS_PER_SEC >= 60) {
-            pthread_mutex_lock(&print_lock);
-            fprintf(stderr, "%p\n", "Checking for pings");
-            pthread_mutex_unlock(&print_lock);
+void *uring_worker(void *ptr) {
+    shard = (struct shard *)ptr;
+
+    struct uring ring;
+    struct uring send_ring;
+    struct uring_buffers buffers;
+    if (uring_init(&ring, 64) == -1) {
+        log_line(LOG_WARN, "io_uring is not available, using epoll: %s",
+                 strerror(errno));
+        return worker(ptr);
+    }
+    if (uring_buffers_init(&ring, &buffers, 0, URING_BUFFERS,
+                           URING_BUFFER_SIZE) == -1) {
+        log_line(LOG_WARN, "io_uring buffer rings are not available, "
+                           "using epoll: %s",
+                 strerror(errno));
+        uring_free(&ring);
+        return worker(ptr);
+    }
+    int sending = uring_init(&send_ring, UDP_BATCH_SIZE) == 0;
+    if (!sending) {
+        log_line(LOG_WARN, "%s", "io_uring sends are not available");
+    } else {
+        fan_out_batch(shard->sock);
+        fan_out.flush = uring_send_batch;
+        fan_out.backend = &send_ring;
+    }
+
+    int lobby_timer = start_timer(lobby_interval);
 
-            // Remove any players that did not respond
-            remove_inactive_players();
-            // recheck player status
-            ping_players();
-            current_time = clock();
+    // Only the room for the sender is read from these
+    struct msghdr messages[2];
+    memset(messages, 0, sizeof(messages));
+
+    for (int tag = URING_SOCK; tag <= URING_LIVENESS_TIMER; tag++) {
+        if (uring_arm(&ring, tag, messages, &buffers, lobby_timer) == -1) {
+            fprintf(stderr, "%s\n", "Failed to start io_uring requests");
+            abort();
         }
     }
-    return NULL;
+
+    int error = 0;
+    while (error == 0) {
+        // Submit what was queued and wait for something to happen
+        if (uring_enter(&ring, 1) == -1) {
+            if (errno != EINTR) {
+                log_line(LOG_ERROR, "Failed to wait for packets: %s",
+                         strerror(errno));
+            }
+            continue;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+            int tag = cqe->user_data;
+            int result = cqe->res;
+            unsigned int flags = cqe->flags;
+            uring_cqe_seen(&ring);
+
+            if (tag == URING_SOCK || tag == URING_STATUS_SOCK) {
+                if (flags & IORING_CQE_F_BUFFER) {
+                    unsigned short id = flags >> IORING_CQE_BUFFER_SHIFT;
+                    char *buffer = buffers.data + (size_t)id * buffers.size;
+
+                    struct sockaddr_in *sender_addr;
+                    size_t size;
+                    packet *data = uring_received_packet(buffer, result,
+                                                         &sender_addr, &size);
+                    if (data != NULL && packet_decode(data, size) == -1) {
+                        data = NULL;
+                    }
+                    if (data != NULL && tag == URING_SOCK) {
+                        // Requests from players
+                        handle_packet(data, sender_addr);
+                    } else if (data != NULL) {
+                        // Answers to pings
+                        handle_status_packet(data, sender_addr);
+                    }
+                    uring_buffers_give(&buffers, id);
+                }
+            } else if (result > 0) {
+                int ready_fd = shard->mailbox.wake_fd;
+                if (tag == URING_LOBBY_TIMER) {
+                    ready_fd = lobby_timer;
+                } else if (tag == URING_LIVENESS_TIMER) {
+                    ready_fd = shard->liveness_timer;
+                }
+                handle_ready(ready_fd, lobby_timer);
+            }
+
+            if (flags & IORING_CQE_F_MORE) {
+                continue;
+            }
+            if (result < 0 && result != -ENOBUFS) {
+                error = -result;
+                break;
+            }
+
+            // The request ended, usually because every
+            // buffer was in use, so post it again
+            if (uring_arm(&ring, tag, messages, &buffers, lobby_timer) == -1) {
+                log_line(LOG_ERROR, "%s", "Failed to restart io_uring request");
+            }
+        }
+
+        // Send the replies queued while handling the packets
+        send_batch_flush(&fan_out);
+    }
+
+    log_line(LOG_ERROR, "io_uring request failed, using epoll: %s",
+             strerror(error));
+    if (sending) {
+        fan_out.flush = NULL;
+        fan_out.backend = NULL;
+        uring_free(&send_ring);
+    }
+    uring_free(&ring);
+    uring_buffers_free(&buffers);
+    close(lobby_timer);
+    return worker(ptr);
 }
 
-/* Mark Peers as Alive
+/* Uring Arm
  *
- * Sets the peer's status to be alive
- * so that they will not be reomved
+ * Posts the multishot request that the tag stands for
+ * Returns -1 if the ring is full
  */
-void mark_peer_alive(unsigned int ip_addr, short port) {
-    // Make and alocate memory for a char array
-    // of the IP Address and port number
-    char ip_port[20];
-    memset(ip_port, 0, sizeof(ip_port));
+int uring_arm(struct uring *ring, int tag, struct msghdr *messages,
+              struct uring_buffers *buffers, int lobby_timer) {
+    switch (tag) {
+        case URING_SOCK:
+            return uring_recv_multishot(ring, shard->sock, &messages[0],
+                                        buffers, tag);
+        case URING_STATUS_SOCK:
+            return uring_recv_multishot(ring, shard->status_sock,
+                                        &messages[1], buffers, tag);
+        case URING_MAILBOX:
+            return uring_poll_multishot(ring, shard->mailbox.wake_fd, tag);
+        case URING_LOBBY_TIMER:
+            return uring_poll_multishot(ring, lobby_timer, tag);
+        default:
+            return uring_poll_multishot(ring, shard->liveness_timer, tag);
+    }
+}
 
-    // Set the print out format
-    char *print_format = (char *)"%d:%d";
-    sprintf(ip_port, print_format, ip_addr, port);
+/* Handle Ready
+ *
+ * Handles the mailbox or one of the timers
+ * of the shard becoming readable
+ */
+void handle_ready(int ready_fd, int lobby_timer) {
+    uint64_t expired;
+
+    if (ready_fd == shard->mailbox.wake_fd) {
+        // Hand-offs from the other shards
+        unsigned int taken;
+        struct handoff *items = mailbox_take(&shard->mailbox, &taken);
+        for (unsigned int j = 0; j < taken; j++) {
+            handle_handoff(&items[j]);
+        }
+    } else if (read(ready_fd, &expired, sizeof(expired)) > 0) {
+        // Tell lobby watchers what changed, once per interval
+        if (ready_fd == lobby_timer) {
+            send_lobby_changes();
+        } else if (ready_fd == shard->liveness_timer) {
+            check_liveness();
+        }
+    }
+}
 
-    struct peer *p;
-    // Find the peer in the hash table
-    HASH_FIND_STR(all_peers, ip_port, p);
-    // If the peer is found
-    if (p != NULL) {
-        // Set the peer to be alive
-        pthread_mutex_lock(&peers_lock);
-        p->status = 1;
-        pthread_mutex_unlock(&peers_lock);
-    } else {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%p\n", "Peer did not respond to ping request");
-        pthread_mutex_unlock(&print_lock);
+/* Start Timer
+ *
+ * Returns a timerfd that becomes readable
+ * every interval milliseconds
+ */
+int start_timer(unsigned int interval) {
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timer == -1) {
+        fprintf(stderr, "Failed to create timer: %s\n", strerror(errno));
+        abort();
+    }
+
+    // An interval of 0 would stop the timer
+    if (interval == 0) {
+        interval = 1;
     }
+
+    struct itimerspec every;
+    every.it_interval.tv_sec = interval / 1000;
+    every.it_interval.tv_nsec = (long)(interval % 1000) * 1000000;
+    every.it_value = every.it_interval;
+    timerfd_settime(timer, 0, &every, NULL);
+    return timer;
+}
+
+/* Watch Descriptor
+ *
+ * Adds a descriptor to the epoll set
+ * to be woken up when it is readable
+ */
+void watch_descriptor(int events, int descriptor) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = descriptor;
+
+    if (epoll_ctl(events, EPOLL_CTL_ADD, descriptor, &event) == -1) {
+        fprintf(stderr, "Failed to watch descriptor: %s\n", strerror(errno));
+        abort();
+    }
+}
+
+/* Now MS
+ *
+ * Returns a monotonic timestamp in milliseconds
+ */
+uint64_t now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
-/* Ping Players
+/* Liveness Now
  *
- * Ping players to see if they are
- * active or inactive
+ * Returns the current time in liveness ticks
+ */
+uint64_t liveness_now() { return now_ms() / LIVENESS_TICK; }
+
+/* Set Ticking
  *
- * If the player is inactive mark them for removal
+ * Starts or stops the liveness timer of the shard
+ * so an idle shard with no peers is not woken up
  */
-void ping_players() {
-    for (struct peer *p = all_peers; p != NULL; p = (struct peer *)p->hh.next) {
-        // Mark the peer as inactive
-        pthread_mutex_lock(&peers_lock);
-        p->status = 0;
-        pthread_mutex_unlock(&peers_lock);
+void set_ticking(int on) {
+    struct itimerspec every;
+    memset(&every, 0, sizeof(every));
+    if (on) {
+        every.it_interval.tv_sec = LIVENESS_TICK / 1000;
+        every.it_interval.tv_nsec = (long)(LIVENESS_TICK % 1000) * 1000000;
+        every.it_value = every.it_interval;
+    }
+    timerfd_settime(shard->liveness_timer, 0, &every, NULL);
+    shard->ticking = on;
+}
 
-        // Get the target IP Address and port
-        unsigned int ip_addr = get_ip(p->ip_and_port);
-        short port = get_port(p->ip_and_port);
+/* Check Liveness
+ *
+ * Handles the peers whose deadline has passed
+ * Only the expired peers are looked at
+ */
+void check_liveness() {
+    uint64_t now = liveness_now();
+    int removed = expire_peers(&shard->wheel, now, 0);
+
+    // The first shard also keeps the deadlines of the watchers
+    size_t watching = 0;
+    if (shard->index == 0) {
+        pthread_mutex_lock(&watchers_lock);
+        removed += expire_peers(&watcher_wheel, now, 1);
+        watching = watcher_wheel.count;
+        pthread_mutex_unlock(&watchers_lock);
+    }
 
-        // Construct a packet to send to the target
-        packet send_packet;
-        send_packet.header.msg_type = 'p';
-        send_packet.header.msg_error = '\0';
-        send_packet.header.msg_length = 0;
-        struct sockaddr_in send_addr = get_sockaddr_in(ip_addr, port);
+    if (removed != 0) {
+        log_line(LOG_INFO, "Removed %d inactive peers", removed);
+        log_line(LOG_DEBUG, "Peer records: %zu live, %zu free slots",
+                 shard->pool.live, shard->pool.free);
+    }
 
-        // Try and ping the peer
-        if (sendto(status_sock, &send_packet, sizeof(send_packet.header), 0,
-                   (struct sockaddr *)&send_addr, sizeof(send_addr)) == -1) {
-            pthread_mutex_lock(&print_lock);
-            fprintf(stderr, "%p\n", "Failed to send packet");
-            pthread_mutex_unlock(&print_lock);
-        }
+    if (shard->wheel.count == 0 && watching == 0) {
+        set_ticking(0);
     }
 }
 
-/* Remove Inactive Players
+/* Expire Peers
+ *
+ * Checks on every peer whose deadline has passed
  *
- * Looks for players that have not responeded to a ping request
+ * A peer heard from in the last half of liveness_timeout
+ * is left alone until that much time has passed since.
+ * Otherwise it is pinged, up to PING_TRIES times with the
+ * wait doubling after each one, and then removed
+ *
+ * Returns the number of peers removed
+ * Expects watchers_lock to be held for the watchers
  */
-void remove_inactive_players() {
-    for (struct peer *p = all_peers; p != NULL; p = (struct peer *)p->hh.next) {
-        // If the peer is not status
-        if (p->status == 0) {
-            // Get the port and ip address
-            unsigned int ip_addr = get_ip(p->ip_and_port);
-            short port = get_port(p->ip_and_port);
+int expire_peers(struct timer_wheel *wheel, uint64_t now, int watchers) {
+    uint64_t idle = liveness_timeout / 2;
+    uint64_t time = now_ms();
+    int removed = 0;
+
+    struct wheel_timer *timer;
+    while ((timer = timer_wheel_expire(wheel, now)) != NULL) {
+        struct peer *p =
+            (struct peer *)((char *)timer - offsetof(struct peer, liveness));
+
+        if (p->pinged == 0) {
+            // Recent packets already show the peer is there
+            if (p->heard + idle > time) {
+                schedule_liveness(wheel, p, p->heard + idle);
+                continue;
+            }
+            p->pinged = time;
+            p->ping_tries = 0;
+        }
+
+        if (p->ping_tries < PING_TRIES) {
+            ping_peer(p);
+            p->ping_tries++;
+            schedule_liveness(
+                wheel, p,
+                time + ((uint64_t)peer_rto(p) << (p->ping_tries - 1)));
+            continue;
+        }
+
+        if (watchers) {
+            // Stop sending lobby changes to the watcher
+            uint64_t key = peer_key(p->ip_addr, p->port);
+            slab_pool_release(&watcher_pool,
+                              peer_table_remove(&lobby_watchers, key));
+            __atomic_store_n(&watcher_count, lobby_watchers.count,
+                             __ATOMIC_RELAXED);
+        } else {
             // Terminate the player
-            leave_game(ip_addr, port);
+            reply_v2 = p->v2;
+            leave_game(p->ip_addr, p->port);
         }
+        removed++;
     }
+
+    return removed;
 }
 
-/* Create Game
+/* Schedule Liveness
  *
- * Creates a new group for a bingo game
+ * Sets when a peer is next checked on, at time at in
+ * milliseconds. The check happens in the tick that at
+ * falls in, so it is at most one tick early or late
  */
-void create_game(unsigned int ip_addr, short port, char *name) {
-    // Check if any more games can be made
-    int number_of_games = get_number_of_games();
-    if (number_of_games >= MAX_GAMES) {
-        // Could not create new game
-        send_error(ip_addr, port, 'c', 'o');
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "The maximun number of games reached\n");
-        pthread_mutex_unlock(&print_lock);
+void schedule_liveness(struct timer_wheel *wheel, struct peer *p,
+                       uint64_t at) {
+    // An empty wheel may not have moved in a while
+    if (wheel->count == 0) {
+        wheel->now = liveness_now();
+    }
+    timer_wheel_add(wheel, &p->liveness, at / LIVENESS_TICK);
+
+    if (!shard->ticking) {
+        set_ticking(1);
+    }
+}
+
+/* First Deadline
+ *
+ * Returns when a new peer is first checked on, spread
+ * over the second half of the idle time by its address
+ * so peers that arrive together are not pinged together
+ */
+uint64_t first_deadline(struct peer *p) {
+    uint64_t idle = liveness_timeout / 2;
+    uint64_t key = peer_key(p->ip_addr, p->port);
+    return p->heard + idle / 2 + peer_hash(key) % (idle - idle / 2);
+}
+
+/* Peer RTO
+ *
+ * Returns how long to wait for the answer to a ping,
+ * the smoothed round trip time plus four times its
+ * variation. It is kept short enough that every try
+ * fits in the second half of liveness_timeout
+ */
+unsigned int peer_rto(struct peer *p) {
+    unsigned int rto = INITIAL_RTO;
+    if (p->srtt != 0) {
+        rto = p->srtt + 4 * p->rttvar;
+    }
+
+    unsigned int longest = liveness_timeout / 2 / ((1 << PING_TRIES) - 1);
+    if (rto > longest) {
+        rto = longest;
+    }
+    if (rto < MIN_RTO) {
+        rto = MIN_RTO;
+    }
+    return rto;
+}
+
+/* Sample RTT
+ *
+ * Adds a round trip time to the smoothed round
+ * trip time of the peer and its variation
+ */
+void sample_rtt(struct peer *p, unsigned int rtt) {
+    // Anything under a millisecond still counts
+    if (rtt == 0) {
+        rtt = 1;
+    }
+
+    if (p->srtt == 0) {
+        p->srtt = rtt;
+        p->rttvar = rtt / 2;
         return;
     }
 
-    // Get the game number
-    struct peer *p;
-    int room_taken = 0;
-    unsigned int game;
-    for (game = 1; game < MAX_GAMES * 2; game++) {
-        for (p = all_peers; p != NULL; p = (struct peer *)p->hh.next) {
-            if (p->game == game) {
-                room_taken = 1;
-                break;
-            }
-        }
-        if (room_taken == 0) {
+    unsigned int error = rtt > p->srtt ? rtt - p->srtt : p->srtt - rtt;
+    p->rttvar = (3 * p->rttvar + error) / 4;
+    p->srtt = (7 * p->srtt + rtt) / 8;
+}
+
+/* Mark Heard
+ *
+ * Records that a packet came from the peer, which
+ * answers any ping that is waiting, and the
+ * version it was sent in
+ */
+void mark_heard(struct peer *p, uint64_t now) {
+    p->v2 = reply_v2;
+    p->heard = now;
+    p->pinged = 0;
+    p->ping_tries = 0;
+}
+
+/* Peer Heard
+ *
+ * Counts a request from a player of this
+ * shard as a sign that it is still there
+ */
+void peer_heard(unsigned int ip_addr, short port) {
+    struct peer *p = peer_table_find(&shard->peers, peer_key(ip_addr, port));
+    if (p != NULL) {
+        mark_heard(p, now_ms());
+    }
+}
+
+/* Handle Hand-off
+ *
+ * Handles a request another shard passed to this one
+ */
+void handle_handoff(struct handoff *item) {
+    handoff_kind = item->kind;
+    reply_v2 = speaks_v2(&item->data.header);
+
+    switch (item->kind) {
+        case HANDOFF_PACKET:
+            handle_packet(&item->data, &item->sender_addr);
+            break;
+        case HANDOFF_STATUS:
+            handle_status_packet(&item->data, &item->sender_addr);
+            break;
+        case HANDOFF_MOVE:
+            move_out(item);
+            break;
+        case HANDOFF_JOIN:
+            join_game(item->sender_addr.sin_addr.s_addr,
+                      htons(item->sender_addr.sin_port),
+                      item->data.header.game, item->data.msg,
+                      item->old_game);
             break;
-        } else {
-            room_taken = 0;
-        }
     }
 
-    // create a new peer and allocate memory for it
-    struct peer *new_peer;
-    new_peer = (struct peer *)malloc(sizeof(struct peer));
+    handoff_kind = 0;
+}
+
+/* Hand Off
+ *
+ * Passes a packet to the shard it belongs to
+ *
+ * 0 -> the packet is handled here
+ * 1 -> the packet was handed off
+ */
+int hand_off(packet *get_packet, struct sockaddr_in *sender_addr, char kind) {
+    // A packet is only ever handed off once
+    if (shard_count == 1 || handoff_kind != 0) {
+        return 0;
+    }
 
-    // Set the print format for messages
-    char *print_format = (char *)"%d:%d";
-    sprintf(new_peer->ip_and_port, print_format, ip_addr, port);
+    unsigned int ip_addr = sender_addr->sin_addr.s_addr;
+    short port = htons(sender_addr->sin_port);
 
-    // Set the game number
-    new_peer->game = game;
+    int target = route_packet(get_packet, ip_addr, port);
+    if (target == -1 || target == shard->index) {
+        return 0;
+    }
 
-    // The player is status
-    new_peer->status = 1;
+    post_handoff(target, kind, get_packet, sender_addr, 0);
+    return 1;
+}
 
-    strcpy(new_peer->name, name);
+/* Route Packet
+ *
+ * Returns the shard that should handle the packet, or
+ * -1 if any shard can. The steering program already sends
+ * most packets to the right worker, this catches the rest
+ */
+int route_packet(packet *get_packet, unsigned int ip_addr, short port) {
+    uint64_t key = peer_key(ip_addr, port);
+
+    switch (get_packet->header.msg_type) {
+        case 'c':
+            // Make the game on a shard with game numbers left
+            // The other counts may be a little out of date
+            if (shard->ids.free_count != 0) {
+                return -1;
+            }
+            for (int i = 0; i < shard_count; i++) {
+                if (__atomic_load_n(&shards[i].ids.free_count,
+                                    __ATOMIC_RELAXED) != 0) {
+                    return i;
+                }
+            }
+            return -1;
+        case 'j':
+        case 'y':
+            return game_shard(get_packet->header.game);
+        case 'w':
+            // The first shard keeps the deadlines of the watchers
+            return 0;
+        case 'l':
+        case 'n':
+        case 'p':
+            if (peer_table_find(&shard->peers, key) != NULL) {
+                return -1;
+            }
+            return directory_owner(key);
+        default:
+            return -1;
+    }
+}
 
-    // check if peer in a game
-    HASH_FIND_STR(all_peers, (new_peer->ip_and_port), p);
+/* Post Hand-off
+ *
+ * Puts a copy of the packet in the mailbox of a shard
+ */
+void post_handoff(int target, char kind, packet *data,
+                  struct sockaddr_in *sender_addr, unsigned int old_game) {
+    struct handoff item;
+    item.kind = kind;
+    item.old_game = old_game;
+    item.sender_addr = *sender_addr;
+    item.data = *data;
+
+    if (mailbox_post(&shards[target].mailbox, &item) == -1) {
+        log_line(LOG_ERROR, "Failed to hand a packet to shard %d", target);
+    }
+}
 
-    // If the peer is alread in a game
+/* Move Out
+ *
+ * Takes a player that is joining a game of another
+ * shard out of its game here, then hands the join
+ * to the shard of the new game
+ */
+void move_out(struct handoff *item) {
+    unsigned int ip_addr = item->sender_addr.sin_addr.s_addr;
+    short port = htons(item->sender_addr.sin_port);
+    uint64_t key = peer_key(ip_addr, port);
+    unsigned int old_game = 0;
+
+    // The player may have left in the mean time
+    struct peer *p = peer_table_find(&shard->peers, key);
     if (p != NULL) {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "Failed to make game. Peer is alread in a game\n");
-        pthread_mutex_unlock(&print_lock);
-        send_error(ip_addr, port, 'c', 'e');
+        old_game = p->game;
 
-        // If the peer is not in a game
-    } else {
-        // Lock peer changes
-        pthread_mutex_lock(&peers_lock);
-        // Add the peer to the game
-        HASH_ADD_STR(all_peers, ip_and_port, new_peer);
-        // Unlock peer changes
-        pthread_mutex_unlock(&peers_lock);
+        remove_member(p);
+        peer_table_remove(&shard->peers, key);
+        directory_remove(key);
+        timer_wheel_remove(&shard->wheel, &p->liveness);
+        slab_pool_release(&shard->pool, p);
+
+        send_delta(old_game, 'd', ip_addr, port);
+    }
 
-        // Lock the print
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%p created a new game:%d\n", new_peer->ip_and_port,
-                game);
-        pthread_mutex_unlock(&print_lock);
+    post_handoff(game_shard(item->data.header.game), HANDOFF_JOIN,
+                 &item->data, &item->sender_addr, old_game);
+}
 
-        // Make a new packet to be sent
-        packet send_packet;
-        send_packet.header.msg_type = 'c';
-        send_packet.header.msg_error = '\0';
-        send_packet.header.game = game;
-        send_packet.header.msg_length = 0;
+/* Mark Peers as Alive
+ *
+ * Handles the answer to a ping. The round trip is only
+ * measured when the ping was not sent more than once, as
+ * the answer could belong to any of them
+ */
+void mark_peer_alive(unsigned int ip_addr, short port) {
+    uint64_t key = peer_key(ip_addr, port);
+    uint64_t now = now_ms();
+    int watching = 0;
+
+    // The peer may also be watching the lobby
+    if (__atomic_load_n(&watcher_count, __ATOMIC_RELAXED) != 0) {
+        pthread_mutex_lock(&watchers_lock);
+        struct peer *watcher = peer_table_find(&lobby_watchers, key);
+        if (watcher != NULL) {
+            if (watcher->pinged != 0 && watcher->ping_tries == 1) {
+                sample_rtt(watcher, now - watcher->pinged);
+            }
+            mark_heard(watcher, now);
+            watching = 1;
+        }
+        pthread_mutex_unlock(&watchers_lock);
+    }
+
+    // Find the peer in the hash table
+    struct peer *p = peer_table_find(&shard->peers, key);
+    // If the peer is found
+    if (p != NULL) {
+        if (p->pinged != 0 && p->ping_tries == 1) {
+            sample_rtt(p, now - p->pinged);
+        }
+        mark_heard(p, now);
+    } else if (!watching) {
+        log_line(LOG_INFO, "%s", "Peer did not respond to ping request");
+    }
+}
+
+/* Ping Peer
+ *
+ * Asks a peer to answer on the status socket
+ */
+void ping_peer(struct peer *p) {
+    message_header header;
+    header.msg_type = 'p';
+    header.msg_error = '\0';
+    header.msg_length = 0;
+
+    // Peers answer with the same game number, which
+    // steers the answer back to this shard
+    header.game = shard->first_game + 1;
+
+    packet ping;
+    size_t length = wire_header(&header, p->v2, (unsigned char *)&ping);
+
+    struct sockaddr_in send_addr = get_sockaddr_in(p->ip_addr, p->port);
+    send_batch_copy(fan_out_batch(shard->status_sock), &send_addr, &ping,
+                    length);
+}
+
+/* Create Game
+ *
+ * Creates a new group for a bingo game
+ */
+void create_game(unsigned int ip_addr, short port, char *name) {
+    // Check if any more game numbers are free
+    // and there is memory for one more full game
+    if (shard->ids.free_count == 0 ||
+        (memory_budget != 0 &&
+         memory_reserved() + game_memory() > memory_budget)) {
+        // Could not create new game
+        send_error(ip_addr, port, 'c', 'o');
+        log_line(LOG_WARN, "The maximun number of games reached");
+        return;
+    }
+
+    // check if peer in a game, here or on another shard
+    uint64_t key = peer_key(ip_addr, port);
+    struct peer *p = peer_table_find(&shard->peers, key);
+
+    // If the peer is alread in a game
+    if (p != NULL || directory_owner(key) != -1) {
+        log_line(LOG_WARN, "Failed to make game. Peer is alread in a game");
+        send_error(ip_addr, port, 'c', 'e');
+
+        // If the peer is not in a game
+    } else {
+        // create a new peer
+        struct peer *new_peer = make_peer(&shard->pool, ip_addr, port, name);
+        if (new_peer == NULL) {
+            send_error(ip_addr, port, 'c', 'o');
+            return;
+        }
+
+        // Another shard may have just taken the peer
+        int added = directory_add(new_peer);
+        if (added != 0) {
+            slab_pool_release(&shard->pool, new_peer);
+            send_error(ip_addr, port, 'c', added == -1 ? 'e' : 'o');
+            return;
+        }
+
+        // Get the game number
+        unsigned int game = acquire_game();
+        if (open_game(game) == -1 ||
+            peer_table_insert(&shard->peers, key, new_peer) != 0) {
+            game_ids_release(&shard->ids, game - shard->first_game);
+            directory_remove(key);
+            slab_pool_release(&shard->pool, new_peer);
+            send_error(ip_addr, port, 'c', 'o');
+            return;
+        }
+
+        // Add the peer to the game
+        add_member(new_peer, game);
+        schedule_liveness(&shard->wheel, new_peer,
+                          first_deadline(new_peer));
+
+        log_line(LOG_INFO, "%u:%d created a new game:%d", ip_addr, port, game);
+
+        // Make a new packet to be sent
+        packet send_packet;
+        send_packet.header.msg_type = 'c';
+        send_packet.header.msg_error = '\0';
+        send_packet.header.game = game;
+
+        // Send the roster version the game starts at
+        send_packet.header.msg_length = sizeof(games[game].version);
+        memcpy(send_packet.msg, &games[game].version,
+               sizeof(games[game].version));
+
+        queue_reply(&send_packet,
+                    sizeof(send_packet.header) + send_packet.header.msg_length,
+                    ip_addr, port);
+    }
+}
+
+/* Join game
+ *
+ * Allows for a player to join a game
+ *
+ * moved_from is the game a player handed over by
+ * another shard was taken out of, or 0
+ */
+void join_game(unsigned int ip_addr, short port, unsigned int game,
+               char *name, unsigned int moved_from) {
+    struct game *g = find_game(game);
+
+    // If no more players can be added
+    if (g != NULL && g->count >= max_players) {
+        log_line(LOG_WARN, "Failed to join game. The game is full");
+
+        // Send an error that the player could not join
+        // the game
+        send_error(ip_addr, port, 'j', 'f');
+        return;
+    }
+
+    // If the game does not exist
+    if (g == NULL) {
+        log_line(LOG_WARN, "%s",
+                 "Failed to join the game because it does not exist");
+
+        // Send an error that to game could not be joined
+        send_error(ip_addr, port, 'j', 'e');
+        return;
+    }
+
+    // Find the peer in the hash table
+    uint64_t key = peer_key(ip_addr, port);
+    struct peer *p = peer_table_find(&shard->peers, key);
+    if (p != NULL && p->game == game) {
+        log_line(LOG_WARN, "Failed to join game, already in");
+        send_error(ip_addr, port, 'j', 'j');
+        return;
+    }
+
+    // A player in a game of another shard has to leave
+    // it there first, that shard hands the join back
+    if (p == NULL && handoff_kind != HANDOFF_JOIN) {
+        int owner = directory_owner(key);
+        if (owner != -1) {
+            packet move_packet;
+            memset(&move_packet.header, 0, sizeof(move_packet.header));
+            if (reply_v2) {
+                memcpy(move_packet.header.protocol, PROTOCOL_HINT, 2);
+            }
+            move_packet.header.msg_type = 'j';
+            move_packet.header.game = game;
+            snprintf(move_packet.msg, sizeof(move_packet.msg), "%s", name);
+            move_packet.header.msg_length = strlen(move_packet.msg) + 1;
+
+            struct sockaddr_in sender_addr = get_sockaddr_in(ip_addr, port);
+            post_handoff(owner, HANDOFF_MOVE, &move_packet, &sender_addr, 0);
+            return;
+        }
+    }
+
+    int old_game = -1;
+    // If the peer is not in the game
+    if (p == NULL) {
+        // Create a new peer
+        struct peer *new_peer = make_peer(&shard->pool, ip_addr, port, name);
+        if (new_peer == NULL) {
+            send_error(ip_addr, port, 'j', 'f');
+            return;
+        }
+
+        // Another shard may have just taken the peer
+        int added = directory_add(new_peer);
+        if (added != 0) {
+            slab_pool_release(&shard->pool, new_peer);
+            send_error(ip_addr, port, 'j', added == -1 ? 'e' : 'f');
+            return;
+        }
+        if (peer_table_insert(&shard->peers, key, new_peer) != 0) {
+            directory_remove(key);
+            slab_pool_release(&shard->pool, new_peer);
+            send_error(ip_addr, port, 'j', 'f');
+            return;
+        }
+
+        // Add the player to the game
+        add_member(new_peer, game);
+        schedule_liveness(&shard->wheel, new_peer,
+                          first_deadline(new_peer));
+        p = new_peer;
+
+        // Otherwise move them from the old game to the new one
+    } else {
+        old_game = p->game;
+
+        // Reuse the same record in the new game
+        remove_member(p);
+        snprintf(p->name, sizeof(p->name), "%s", name);
+        add_member(p, game);
+    }
+
+    // The shard the player moved from told the old game
+    int moved_here = old_game == -1 && moved_from != 0;
+
+    // If the player was not in a different game
+    if (old_game == -1 && !moved_here) {
+        log_line(LOG_INFO, "%u:%d joined game %d", ip_addr, port, game);
+
+        // Send the joining player the whole roster
+        // and tell everyone else they were added
+        send_roster(g, game, 'j', p);
+        send_delta(game, 'a', ip_addr, port);
+
+        // If the player was in an old game
+    } else {
+        log_line(LOG_INFO, "%u:%d peer switched from game %d to %d.", ip_addr,
+                 port, moved_here ? (int)moved_from : old_game, game);
+
+        // Update the peer location
+        send_roster(g, game, 'j', p);
+        send_delta(game, 'a', ip_addr, port);
+        if (!moved_here) {
+            send_delta(old_game, 'd', ip_addr, port);
+        }
+    }
+}
+
+/* Leave Game
+ *
+ * Removes a player from a game
+ */
+void leave_game(unsigned int ip_addr, short port) {
+    uint64_t key = peer_key(ip_addr, port);
+
+    // Find the peer form the list of peers
+    struct peer *p = peer_table_find(&shard->peers, key);
+    // If the peer exists
+    if (p != NULL) {
+        // Find the game they left
+        unsigned int exit_game = p->game;
+
+        // Remove the peer from the hash table
+        remove_member(p);
+        peer_table_remove(&shard->peers, key);
+        directory_remove(key);
+        timer_wheel_remove(&shard->wheel, &p->liveness);
+
+        // Give the record back to the pool
+        slab_pool_release(&shard->pool, p);
+
+        log_line(LOG_INFO, "%u:%d left %d", ip_addr, port, exit_game);
+
+        // Make a packet to send that the player has left
+        packet send_packet;
+        send_packet.header.msg_type = 'l';
+        send_packet.header.msg_error = '\0';
+        send_packet.header.game = exit_game;
+        send_packet.header.msg_length = 0;
+
+        queue_reply(&send_packet, sizeof(send_packet.header), ip_addr, port);
+
+        // Tell the rest of the game they were dropped
+        send_delta(exit_game, 'd', ip_addr, port);
+    } else {
+        // If the peer does not exits
+        // send an error
+        send_error(ip_addr, port, 'l', 'e');
+    }
+}
+
+/* List Games
+ *
+ * Sends the lobby listing of all games and their game numbers
+ * The listing is only rebuilt when a game has changed, and
+ * a long one is cut short, see Short Replies in msg.h
+ */
+void list_games(unsigned int ip_addr, short port) {
+    unsigned int version = __atomic_load_n(&lobby_version, __ATOMIC_RELAXED);
+    if (shard->lobby_built != version) {
+        build_lobby();
+    }
+
+    message_header header;
+    header.msg_type = 'r';
+    header.msg_error = '\0';
+    header.game = 0;
+
+    struct iovec listing;
+    listing.iov_base = shard->lobby_text;
+    listing.iov_len =
+        cut_reply(shard->lobby_text, shard->lobby_length, &header.msg_error);
+
+    struct sockaddr_in send_addr = get_sockaddr_in(ip_addr, port);
+    queue_message(&header, &listing, 1, &send_addr, reply_v2);
+}
+
+/* Query Lobby
+ *
+ * Sends one page of the lobby that matches the filters
+ * in the query. At most LOBBY_SCAN_LIMIT games are looked
+ * at, so a page can be short with a cursor to carry on from
+ */
+void query_lobby(unsigned int ip_addr, short port, packet *query_packet) {
+    lobby_query query;
+    memset(&query, 0, sizeof(query));
+    if (query_packet->header.msg_length >= sizeof(query)) {
+        memcpy(&query, query_packet->msg, sizeof(query));
+    }
+    if (query.limit == 0 || query.limit > LOBBY_PAGE_MAX) {
+        query.limit = LOBBY_PAGE_MAX;
+    }
+
+    packet send_packet;
+    send_packet.header.msg_type = 'q';
+    send_packet.header.msg_error = '\0';
+    send_packet.header.game = 0;
+
+    lobby_page page;
+    page.next_cursor = 0;
+    page.count = 0;
+    lobby_entry *entries = (lobby_entry *)(send_packet.msg + sizeof(page));
+
+    int scanned = 0;
+    unsigned int game = query.cursor;
+    while ((game = next_game(game)) != 0) {
+        // Stop once the page is full or enough games were looked at
+        if (page.count == query.limit || scanned == LOBBY_SCAN_LIMIT) {
+            page.next_cursor = game - 1;
+            break;
+        }
+        scanned++;
+
+        unsigned int players =
+            __atomic_load_n(&games[game].count, __ATOMIC_RELAXED);
+        if (players < query.min_players ||
+            (query.max_players != 0 && players > query.max_players) ||
+            (query.open_only && players >= (unsigned int)max_players)) {
+            continue;
+        }
+
+        entries[page.count].game = game;
+        entries[page.count].players = players;
+        entries[page.count].max_players = max_players;
+        page.count++;
+    }
+
+    memcpy(send_packet.msg, &page, sizeof(page));
+    send_packet.header.msg_length =
+        sizeof(page) + page.count * sizeof(lobby_entry);
+
+    queue_reply(&send_packet,
+                sizeof(send_packet.header) + send_packet.header.msg_length,
+                ip_addr, port);
+}
+
+/* Watch Lobby
+ *
+ * Starts or stops sending lobby changes to a peer
+ */
+void watch_lobby(unsigned int ip_addr, short port, packet *watch_packet) {
+    uint64_t key = peer_key(ip_addr, port);
+    int start = watch_packet->header.msg_length == 0 || watch_packet->msg[0];
+    char msg_error = '\0';
+
+    pthread_mutex_lock(&watchers_lock);
+    struct peer *watcher = peer_table_find(&lobby_watchers, key);
+    if (start && watcher == NULL) {
+        watcher = make_peer(&watcher_pool, ip_addr, port, (char *)"");
+        if (watcher != NULL &&
+            peer_table_insert(&lobby_watchers, key, watcher) != 0) {
+            slab_pool_release(&watcher_pool, watcher);
+            watcher = NULL;
+        }
+        if (watcher == NULL) {
+            msg_error = 'o';
+        } else {
+            schedule_liveness(&watcher_wheel, watcher,
+                              first_deadline(watcher));
+        }
+    } else if (start) {
+        // Asking again shows the watcher is still there
+        mark_heard(watcher, now_ms());
+    } else if (watcher != NULL) {
+        peer_table_remove(&lobby_watchers, key);
+        timer_wheel_remove(&watcher_wheel, &watcher->liveness);
+        slab_pool_release(&watcher_pool, watcher);
+    }
+    __atomic_store_n(&watcher_count, lobby_watchers.count, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&watchers_lock);
+
+    packet send_packet;
+    send_packet.header.msg_type = 'w';
+    send_packet.header.msg_error = msg_error;
+    send_packet.header.game = 0;
+    send_packet.header.msg_length = 1;
+    send_packet.msg[0] = start && msg_error == '\0';
+
+    queue_reply(&send_packet, sizeof(send_packet.header) + 1, ip_addr, port);
+}
+
+/* Note Lobby Change
+ *
+ * Remembers that a game changed so lobby
+ * watchers are told at the next interval
+ */
+void note_lobby_change(unsigned int game) {
+    __atomic_add_fetch(&lobby_version, 1, __ATOMIC_RELAXED);
+
+    // The bitmap covers the game numbers of this shard
+    unsigned int local = game - shard->first_game;
+    if ((shard->lobby_changed[local / 64] >> (local % 64)) & 1) {
+        return;
+    }
+    shard->lobby_changed[local / 64] |= (uint64_t)1 << (local % 64);
+    shard->lobby_changes[shard->lobby_change_count] = game;
+    shard->lobby_change_count++;
+}
+
+/* Send Lobby Changes
+ *
+ * Sends every watcher the games of this shard that changed
+ * since the last interval. The changes are batched into
+ * as few packets as they fit in
+ */
+void send_lobby_changes() {
+    if (shard->lobby_change_count == 0) {
+        return;
+    }
+
+    packet send_packet;
+    send_packet.header.msg_type = 'v';
+    send_packet.header.msg_error = '\0';
+    send_packet.header.game = 0;
+
+    lobby_page page;
+    page.next_cursor = 0;
+    lobby_entry *entries = (lobby_entry *)(send_packet.msg + sizeof(page));
+
+    unsigned int sent = 0;
+    while (sent < shard->lobby_change_count) {
+        // Fill the packet with as many changes as fit
+        page.count = 0;
+        while (sent < shard->lobby_change_count &&
+               page.count < LOBBY_PAGE_MAX) {
+            unsigned int game = shard->lobby_changes[sent];
+            unsigned int local = game - shard->first_game;
+            shard->lobby_changed[local / 64] &= ~((uint64_t)1 << (local % 64));
+
+            entries[page.count].game = game;
+            entries[page.count].players = games[game].count;
+            entries[page.count].max_players = max_players;
+            page.count++;
+            sent++;
+        }
+        memcpy(send_packet.msg, &page, sizeof(page));
+        send_packet.header.msg_length =
+            sizeof(page) + page.count * sizeof(lobby_entry);
+
+        // The changes with a header of each version
+        unsigned char header_bytes[2][HEADER_MAX];
+        struct iovec parts[2][2];
+        for (int v2 = 0; v2 < 2; v2++) {
+            parts[v2][0].iov_base = header_bytes[v2];
+            parts[v2][0].iov_len =
+                wire_header(&send_packet.header, v2, header_bytes[v2]);
+            parts[v2][1].iov_base = send_packet.msg;
+            parts[v2][1].iov_len = send_packet.header.msg_length;
+        }
+
+        struct send_batch *batch = fan_out_batch(shard->sock);
+
+        pthread_mutex_lock(&watchers_lock);
+        size_t i = 0;
+        struct peer *watcher;
+        while ((watcher = peer_table_next(&lobby_watchers, &i)) != NULL) {
+            struct sockaddr_in send_addr =
+                get_sockaddr_in(watcher->ip_addr, watcher->port);
+            send_batch_add(batch, &send_addr, parts[(int)watcher->v2], 2);
+        }
+        pthread_mutex_unlock(&watchers_lock);
+
+        // The packet is filled again for the next changes
+        send_batch_flush(batch);
+    }
+    shard->lobby_change_count = 0;
+}
+
+/* Build Lobby
+ *
+ * Writes the line for each live game into the lobby listing
+ * The listing grows as needed and stops once it would be
+ * too long to send. The length counts the terminator, like
+ * the other text messages
+ */
+void build_lobby() {
+    // Changes made while building leave the listing out of date
+    shard->lobby_built = __atomic_load_n(&lobby_version, __ATOMIC_RELAXED);
+
+    // Format for displaing games
+    char *game_format = (char *)"Game: %d - %d/%d\n";
+    size_t list_size = 0;
+    for (unsigned int game = next_game(0); game != 0;
+         game = next_game(game)) {
+        // Stop when there is no room for another line
+        if (shard->lobby_room - list_size < LOBBY_LINE_MAX &&
+            grow_lobby(list_size + LOBBY_LINE_MAX) == -1) {
+            break;
+        }
+        int players = __atomic_load_n(&games[game].count, __ATOMIC_RELAXED);
+        int written = snprintf(shard->lobby_text + list_size,
+                               shard->lobby_room - list_size, game_format,
+                               game, players, max_players);
+        if (written < 0) {
+            break;
+        }
+        list_size += written;
+    }
+    if (get_number_of_games() == 0) {
+        strcpy(shard->lobby_text, "There are no chatrooms\n");
+        list_size = strlen(shard->lobby_text);
+    }
+    shard->lobby_text[list_size] = '\0';
+    shard->lobby_length = list_size + 1;
+}
+
+/* Grow Lobby
+ *
+ * Makes room for at least needed bytes of listing
+ * Returns -1 if it would be too long to send or
+ * there is no memory for it
+ */
+int grow_lobby(size_t needed) {
+    if (needed > FRAGMENT_MAX_TOTAL) {
+        return -1;
+    }
+
+    size_t room = shard->lobby_room * 2;
+    if (room < needed) {
+        room = needed;
+    }
+    if (room > FRAGMENT_MAX_TOTAL) {
+        room = FRAGMENT_MAX_TOTAL;
+    }
+
+    char *grown = (char *)realloc(shard->lobby_text, room);
+    if (grown == NULL) {
+        return -1;
+    }
+    shard->lobby_text = grown;
+    shard->lobby_room = room;
+    return 0;
+}
+
+/* Send Delta
+ *
+ * Tells every member of the game, other than
+ * the player that changed, that a player was
+ * added ('a') or dropped ('d')
+ */
+void send_delta(unsigned int game, char msg_type, unsigned int ip_addr,
+                short port) {
+    struct game *g = find_game(game);
+
+    // No one is left to tell
+    if (g == NULL) {
+        return;
+    }
+
+    message_header header;
+    header.msg_type = msg_type;
+    header.msg_error = '\0';
+    header.game = game;
+    header.msg_length = sizeof(roster_delta);
+
+    roster_delta delta;
+    delta.version = g->version;
+    delta.addr = get_sockaddr_in(ip_addr, port);
+
+    // The delta with a header of each version
+    unsigned char header_bytes[2][HEADER_MAX];
+    struct iovec parts[2][2];
+    for (int v2 = 0; v2 < 2; v2++) {
+        parts[v2][0].iov_base = header_bytes[v2];
+        parts[v2][0].iov_len = wire_header(&header, v2, header_bytes[v2]);
+        parts[v2][1].iov_base = &delta;
+        parts[v2][1].iov_len = sizeof(delta);
+    }
+
+    struct send_batch *batch = fan_out_batch(shard->sock);
+
+    for (int i = 0; i < g->count; i++) {
+        struct peer *p = g->members[i];
+        if (p->ip_addr == ip_addr && p->port == port) {
+            continue;
+        }
+        send_batch_add(batch, &g->roster[i], parts[(int)p->v2], 2);
+        metric_add(&shard->metrics.roster_bytes, sizeof(delta));
+    }
+
+    send_batch_flush(batch);
+}
+
+/* Resync Roster
+ *
+ * Sends the whole roster to a member that
+ * missed a roster version
+ */
+void resync_roster(unsigned int ip_addr, short port, unsigned int game) {
+    struct peer *p = peer_table_find(&shard->peers, peer_key(ip_addr, port));
+    struct game *g = find_game(game);
+
+    // Only members get the roster
+    if (p == NULL || g == NULL || p->game != game) {
+        send_error(ip_addr, port, 'y', 'e');
+        return;
+    }
+
+    send_roster(g, game, 'u', p);
+}
+
+/* Send Roster
+ *
+ * Queues the version and cached roster of a game for a
+ * member. The roster of a large game goes in fragments
+ */
+void send_roster(struct game *g, unsigned int game, char msg_type,
+                 struct peer *p) {
+    message_header header;
+    header.msg_type = msg_type;
+    header.msg_error = '\0';
+    header.game = game;
+
+    struct iovec parts[2];
+    parts[0].iov_base = &g->version;
+    parts[0].iov_len = sizeof(g->version);
+    parts[1].iov_base = g->roster;
+    parts[1].iov_len = g->count * sizeof(struct sockaddr_in);
+
+    queue_message(&header, parts, 2, &g->roster[p->member_index], p->v2);
+    metric_add(&shard->metrics.roster_bytes,
+               parts[0].iov_len + parts[1].iov_len);
+}
+
+/* Parse Arguments
+ *
+ * Reads in the options and the port that were stated at startup
+ *
+ * ./server [-f config] [-g max_games] [-p max_players]
+ *          [-m memory_budget_mb] [-w workers] [-l log_level]
+ *          [-e metrics_port] [port]
+ *
+ * Options are applied in the order they are given,
+ * so options after -f override the config file
+ */
+short parse_arguments(int argc, char **argv) {
+    int option;
+    while ((option = getopt(argc, argv, "f:g:p:m:t:w:ul:e:")) != -1) {
+        switch (option) {
+            case 'f':
+                read_config(optarg);
+                break;
+            case 'g':
+                set_option("max_games", optarg);
+                break;
+            case 'p':
+                set_option("max_players", optarg);
+                break;
+            case 'm':
+                set_option("memory_budget", optarg);
+                break;
+            case 't':
+                set_option("liveness_timeout", optarg);
+                break;
+            case 'w':
+                set_option("workers", optarg);
+                break;
+            case 'u':
+                set_option("io_uring", "1");
+                break;
+            case 'l':
+                set_option("log_level", optarg);
+                break;
+            case 'e':
+                set_option("metrics_port", optarg);
+                break;
+            default:
+                fprintf(stderr,
+                        "Usage: %s [-f config] [-g max_games] "
+                        "[-p max_players] [-m memory_budget_mb] "
+                        "[-t liveness_timeout_ms] [-w workers] [-u] "
+                        "[-l log_level] [-e metrics_port] [port]\n",
+                        argv[0]);
+                exit(1);
+        }
+    }
+
+    // If the port is not given use the default
+    if (optind < argc) {
+        set_option("port", argv[optind]);
+    }
+
+    return server_port;
+}
+
+/* Parse Number
+ *
+ * Reads an unsigned number and aborts
+ * if it is not valid or larger than max
+ */
+unsigned long parse_number(const char *text, unsigned long max,
+                           const char *what) {
+    // Initiate the error number
+    errno = 0;
+
+    char *endptr = NULL;
+    unsigned long number = strtoul(text, &endptr, 10);
+
+    if (errno == 0) {
+        // If no other errors, check for invalid input and range
+        if ('\0' != endptr[0] || endptr == text)
+            errno = EINVAL;
+        else if (number > max)
+            errno = ERANGE;
+    }
+    if (errno != 0) {
+        // Report any errors and abort
+        fprintf(stderr, "Failed to parse %s \"%s\": %s\n", what, text,
+                strerror(errno));
+        abort();
+    }
+    return number;
+}
+
+/* Set Option
+ *
+ * Sets one of the startup options by name
+ * Used for both the command line and the config file
+ */
+void set_option(const char *option, const char *value) {
+    if (strcmp(option, "port") == 0) {
+        server_port = parse_number(value, USHRT_MAX, "port");
+    } else if (strcmp(option, "max_games") == 0) {
+        max_games = parse_number(value, UINT_MAX - 1, "max_games");
+    } else if (strcmp(option, "max_players") == 0) {
+        max_players = parse_number(value, INT_MAX, "max_players");
+    } else if (strcmp(option, "workers") == 0) {
+        shard_count = parse_number(value, 1024, "workers");
+    } else if (strcmp(option, "io_uring") == 0) {
+        use_io_uring = parse_number(value, 1, "io_uring");
+    } else if (strcmp(option, "liveness_timeout") == 0) {
+        liveness_timeout = parse_number(value, UINT_MAX, "liveness_timeout");
+    } else if (strcmp(option, "lobby_interval") == 0) {
+        lobby_interval = parse_number(value, UINT_MAX, "lobby_interval");
+    } else if (strcmp(option, "metrics_port") == 0) {
+        metrics_port = parse_number(value, USHRT_MAX, "metrics_port");
+    } else if (strcmp(option, "log_level") == 0) {
+        log_level = log_level_named(value);
+        if (log_level == -1) {
+            fprintf(stderr, "Failed to parse log_level \"%s\"\n", value);
+            abort();
+        }
+    } else if (strcmp(option, "memory_budget") == 0) {
+        // The budget is given in megabytes
+        memory_budget =
+            parse_number(value, SIZE_MAX >> 20, "memory_budget") << 20;
+    } else {
+        fprintf(stderr, "Unknown option \"%s\"\n", option);
+        abort();
+    }
+}
+
+/* Read Config
+ *
+ * Reads options from a file. Each line is
+ * an option name and its value, for example
+ *
+ *   max_games = 100000
+ *   max_players 50
+ *
+ * Empty lines and lines starting with # are skipped
+ */
+void read_config(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open config \"%s\": %s\n", path,
+                strerror(errno));
+        abort();
+    }
 
-        // Get the location where the packet will be sent
-        struct sockaddr_in send_addr = get_sockaddr_in(ip_addr, port);
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        // Treat = as a space
+        for (char *c = line; *c != '\0'; c++) {
+            if (*c == '=') {
+                *c = ' ';
+            }
+        }
 
-        // Try and send the packet
-        if (sendto(sock, &send_packet, sizeof(send_packet.header), 0,
-                   (struct sockaddr *)&send_addr, sizeof(send_addr)) == -1) {
-            // Print that the packet could not be sent
-            pthread_mutex_lock(&print_lock);
-            fprintf(stderr, "%p\n", " Failed to send the packet");
-            pthread_mutex_unlock(&print_lock);
+        char option[64];
+        char value[64];
+        int fields = sscanf(line, "%63s %63s", option, value);
+        if (fields <= 0 || option[0] == '#') {
+            continue;
         }
+        if (fields != 2) {
+            fprintf(stderr, "Missing value for \"%s\" in %s\n", option,
+                    path);
+            abort();
+        }
+        set_option(option, value);
     }
+
+    fclose(file);
 }
 
-/* Join game
+/* Game Memory
  *
- * Allows for a player to join a game
+ * Returns the memory a game takes when it is full
+ * Every peer needs its record, up to four table slots,
+ * and its place in the member list and roster
  */
-void join_game(unsigned int ip_addr, short port, unsigned int game,
-               char *name) {
-    struct peer *p;
-    int i = 0;
-    int game_exists = 0;
-    // For all peers in the hash list
-    for (p = all_peers; p != NULL; p = (struct peer *)p->hh.next) {
-        // If the passed game and the peers game are the same
-        if (p->game == game) {
-            i++;
-            // If no more players can be added
-            if (i >= MAX_PLAYERS) {
-                pthread_mutex_lock(&print_lock);
-                fprintf(stderr, "Failed to join game. The game is full\n");
-                pthread_mutex_unlock(&print_lock);
-
-                // Send an error that the player could not join
-                // the game
-                send_error(ip_addr, port, 'j', 'f');
-                return;
-            }
-            game_exists = 1;
-        }
-    }
+size_t game_memory() {
+    return max_players * (sizeof(struct peer) + 4 * sizeof(struct peer_slot) +
+                          sizeof(struct peer *) + sizeof(struct sockaddr_in));
+}
 
-    // If the game does not exist
-    if (game_exists == 0) {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "Failed to join the game because it does not exist\n");
-        pthread_mutex_unlock(&print_lock);
+/* Memory Reserved
+ *
+ * Returns the memory the server needs if every
+ * live game filled up. New games are only made
+ * while this stays under the memory budget
+ */
+size_t memory_reserved() {
+    size_t fixed = (max_games + 1) * sizeof(struct game) +
+                   2 * (max_games * sizeof(unsigned int) + max_games / 8);
+    return fixed + get_number_of_games() * game_memory();
+}
 
-        // Send an error that to game could not be joined
-        send_error(ip_addr, port, 'j', 'e');
-        return;
+/* Fan Out Batch
+ *
+ * Returns the send batch of the calling thread, ready
+ * to send from socket. The batch is made the first
+ * time a thread asks for it
+ */
+struct send_batch *fan_out_batch(int socket) {
+    if (fan_out.size == 0) {
+        send_batch_init(&fan_out, UDP_BATCH_SIZE, report_send_failure);
     }
+    send_batch_begin(&fan_out, socket);
+    return &fan_out;
+}
 
-    // Create a new peer and allocate memory for it
-    struct peer *new_peer;
-    new_peer = (struct peer *)malloc(sizeof(struct peer));
-
-    // Set the message output format
-    char *print_format = (char *)"%d:%d";
-    sprintf(new_peer->ip_and_port, print_format, ip_addr, port);
+/* Queue Reply
+ *
+ * Queues the first length bytes of a reply, in the
+ * version the request came in
+ */
+void queue_reply(packet *send_packet, size_t length, unsigned int ip_addr,
+                 short port) {
+    struct iovec data;
+    data.iov_base = send_packet->msg;
+    data.iov_len = 0;
+    if (length > sizeof(send_packet->header)) {
+        data.iov_len = length - sizeof(send_packet->header);
+    }
 
-    // Add them to the game
-    new_peer->game = game;
-    // Set them as an active palyer
-    new_peer->status = 1;
+    struct sockaddr_in send_addr = get_sockaddr_in(ip_addr, port);
+    queue_message(&send_packet->header, &data, 1, &send_addr, reply_v2);
+}
 
-    strcpy(new_peer->name, name);
+/* Queue Message
+ *
+ * Adds a copy of a message made of count pieces of data to
+ * the send batch of the thread, in v2 if v2 is set. It is
+ * sent when the worker is done with the packets it
+ * received, or sooner if the batch fills
+ *
+ * The length in the header is taken from the data. A
+ * message too long for one packet is sent in fragments
+ */
+void queue_message(message_header *header, struct iovec *data, int count,
+                   struct sockaddr_in *send_addr, int v2) {
+    message_header whole = *header;
+    whole.msg_length = 0;
+    for (int i = 0; i < count; i++) {
+        whole.msg_length += data[i].iov_len;
+    }
 
-    // Find the peer in the hash table
-    HASH_FIND_STR(all_peers, (new_peer->ip_and_port), p);
-    if (p != NULL && p->game == game) {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "Failed to join game, already in\n");
-        pthread_mutex_unlock(&print_lock);
-        send_error(ip_addr, port, 'j', 'j');
+    struct send_batch *batch = fan_out_batch(shard->sock);
+
+    // A v2 header is never longer than a v1 header
+    // for a message that fits in a packet
+    packet wire;
+    if (whole.msg_length <= sizeof(wire.msg)) {
+        size_t header_length =
+            wire_header(&whole, v2, (unsigned char *)&wire);
+        gather_bytes(data, count, 0, (char *)&wire + header_length,
+                     whole.msg_length);
+        send_batch_copy(batch, send_addr, &wire,
+                        header_length + whole.msg_length);
         return;
     }
-    int old_game = -1;
-    // If the peer is not in the game
-    if (p == NULL) {
-        pthread_mutex_lock(&peers_lock);
-        // Add the player to the game
-        HASH_ADD_STR(all_peers, ip_and_port, new_peer);
-        pthread_mutex_unlock(&peers_lock);
-
-        // Otherwise move them from the old game to the new one
-    } else {
-        old_game = p->game;
-        pthread_mutex_lock(&peers_lock);
 
-        // Replace the old entry
-        HASH_REPLACE_STR(all_peers, ip_and_port, new_peer, p);
-        pthread_mutex_unlock(&peers_lock);
+    fragment info;
+    memset(&info, 0, sizeof(info));
+    info.id = __atomic_add_fetch(&fragment_ids, 1, __ATOMIC_RELAXED);
+    info.total = whole.msg_length;
+    info.msg_type = whole.msg_type;
+    info.msg_error = whole.msg_error;
+
+    message_header piece;
+    piece.msg_type = 'f';
+    piece.msg_error = '\0';
+    piece.game = whole.game;
+
+    for (size_t offset = 0; offset < info.total; offset += FRAGMENT_DATA) {
+        size_t length = info.total - offset;
+        if (length > FRAGMENT_DATA) {
+            length = FRAGMENT_DATA;
+        }
+        info.offset = offset;
+        piece.msg_length = sizeof(info) + length;
+
+        size_t header_length =
+            wire_header(&piece, v2, (unsigned char *)&wire);
+        char *out = (char *)&wire + header_length;
+        memcpy(out, &info, sizeof(info));
+        gather_bytes(data, count, offset, out + sizeof(info), length);
+        send_batch_copy(batch, send_addr, &wire,
+                        header_length + piece.msg_length);
     }
+}
 
-    // If the player was not in a different game
-    if (old_game == -1) {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%p joined game %d\n", new_peer->ip_and_port, game);
-        pthread_mutex_unlock(&print_lock);
-
-        // Update the peer location
-        peer_list(ip_addr, port, game, name);
-
-        // If the player was in an old game
-    } else {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%p peer switched from game %d to %d.\n",
-                new_peer->ip_and_port, old_game, game);
-        pthread_mutex_unlock(&print_lock);
+/* Gather Bytes
+ *
+ * Copies length bytes, starting offset bytes into
+ * the data made of count pieces, to out
+ */
+void gather_bytes(struct iovec *data, int count, size_t offset, char *out,
+                  size_t length) {
+    for (int i = 0; i < count && length > 0; i++) {
+        if (offset >= data[i].iov_len) {
+            offset -= data[i].iov_len;
+            continue;
+        }
 
-        // Update the peer location
-        peer_list(ip_addr, port, game, name);
-        peer_list(0, -1, old_game, name);
+        size_t size = data[i].iov_len - offset;
+        if (size > length) {
+            size = length;
+        }
+        memcpy(out, (char *)data[i].iov_base + offset, size);
+        out += size;
+        length -= size;
+        offset = 0;
     }
 }
 
-/* Leave Game
+/* Wire Header
  *
- * Removes a player from a game
+ * Writes a header the way it is sent in v1 or v2
+ * out needs room for HEADER_MAX bytes
+ * Returns the number of bytes written
  */
-void leave_game(unsigned int ip_addr, short port) {
-    // Make a char array for the IP address and port
-    char ip_port[20];
-    memset(ip_port, 0, sizeof(ip_port));
-
-    // Set the print format
-    char *print_format = (char *)"%d:%d";
-    sprintf(ip_port, print_format, ip_addr, port);
-
-    // Make a new peer
-    struct peer *p;
+size_t wire_header(message_header *header, int v2, unsigned char *out) {
+    if (v2) {
+        return header_encode_v2(header, out);
+    }
 
-    // Find the peer form the list of peers
-    HASH_FIND_STR(all_peers, ip_port, p);
-    // If the peer exists
-    if (p != NULL) {
-        // Find the game they left
-        unsigned int exit_game = p->game;
+    // The protocol bytes are not left uninitialised
+    message_header plain = *header;
+    memset(plain.protocol, 0, sizeof(plain.protocol));
+    memcpy(out, &plain, sizeof(plain));
+    return sizeof(plain);
+}
 
-        pthread_mutex_lock(&peers_lock);
+/* Report Send Failure
+ *
+ * Logs a destination that a batched packet
+ * could not be sent to
+ */
+void report_send_failure(struct sockaddr_in *send_addr, int error) {
+    metric_add(&shard->metrics.send_failures, 1);
+    log_line(LOG_ERROR, "Failed to send packet to %u:%d: %s",
+             send_addr->sin_addr.s_addr, ntohs(send_addr->sin_port),
+             strerror(error));
+}
 
-        // Remove the peer from the hash table
-        HASH_DEL(all_peers, p);
+/* Get Number Of Games
+ *
+ * returns the total number of games
+ * The counts of other shards may be a little out of date
+ */
+int get_number_of_games() {
+    int total = 0;
+    for (int i = 0; i < shard_count; i++) {
+        total +=
+            __atomic_load_n(&shards[i].number_of_games, __ATOMIC_RELAXED);
+    }
+    return total;
+}
 
-        // Deallocate memory to p
-        free(p);
-        pthread_mutex_unlock(&peers_lock);
+/* Make Peer
+ *
+ * Takes a record from the pool and fills it in
+ * Returns NULL if there is no memory left
+ * Expects watchers_lock to be held for the watcher pool
+ */
+struct peer *make_peer(struct slab_pool *pool, unsigned int ip_addr,
+                       short port, char *name) {
+    struct peer *p = (struct peer *)slab_pool_alloc(pool);
+    if (p == NULL) {
+        return NULL;
+    }
 
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%p left %d\n", ip_port, exit_game);
-        pthread_mutex_unlock(&print_lock);
+    // Set the address of the peer
+    p->ip_addr = ip_addr;
+    p->port = port;
+
+    // The peer was just heard from
+    p->heard = now_ms();
+    p->pinged = 0;
+    p->ping_tries = 0;
+    p->srtt = 0;
+    p->rttvar = 0;
+    p->game = 0;
+    p->member_index = -1;
+    p->shard = shard->index;
+    p->v2 = reply_v2;
+    wheel_timer_init(&p->liveness);
+
+    snprintf(p->name, sizeof(p->name), "%s", name);
+    return p;
+}
 
-        // Make a packet to send that the player has left
-        packet send_packet;
-        send_packet.header.msg_type = 'l';
-        send_packet.header.msg_error = '\0';
-        send_packet.header.msg_length = 0;
+/* Find Game
+ *
+ * Returns the game with the given number,
+ * or NULL if no one is playing it
+ */
+struct game *find_game(unsigned int game) {
+    // Only the games of this shard are looked at
+    if (game <= shard->first_game ||
+        game_ids_in_use(&shard->ids, game - shard->first_game) == 0) {
+        return NULL;
+    }
+    return &games[game];
+}
 
-        // Get the location where the packet will be sent
-        struct sockaddr_in send_addr = get_sockaddr_in(ip_addr, port);
+/* Game Shard
+ *
+ * Returns the shard that owns the game number,
+ * or -1 if the number is out of range
+ */
+int game_shard(unsigned int game) {
+    if (game == 0 || game > max_games) {
+        return -1;
+    }
+    return (game - 1) / shard_games;
+}
 
-        // Try and send the packet
-        if (sendto(sock, &send_packet, sizeof(send_packet.header), 0,
-                   (struct sockaddr *)&send_addr, sizeof(send_addr)) == -1) {
-            pthread_mutex_lock(&print_lock);
-            fprintf(stderr, "%p\n", "Failed to send the packet");
-            pthread_mutex_unlock(&print_lock);
+/* Next Game
+ *
+ * Returns the first game in use with a number larger
+ * than after, or 0 if there is none. Games of other
+ * shards may have just started or ended
+ */
+unsigned int next_game(unsigned int after) {
+    // A cursor from a client can be any number
+    if (after >= max_games) {
+        return 0;
+    }
+    for (unsigned int i = after / shard_games; i < (unsigned int)shard_count;
+         i++) {
+        struct shard *s = &shards[i];
+        unsigned int local_after =
+            after > s->first_game ? after - s->first_game : 0;
+        unsigned int local = game_ids_next(&s->ids, local_after);
+        if (local != 0) {
+            return s->first_game + local;
         }
-
-        // Update the peer list
-        peer_list(0, -1, exit_game, p->name);
-    } else {
-        // If the peer does not exits
-        // send an error
-        send_error(ip_addr, port, 'l', 'e');
     }
+    return 0;
 }
 
-/* List Games
+/* Acquire Game
  *
- * Lists all games and their game numbers
+ * Returns a free game number of this shard,
+ * or 0 if all of them are in use
  */
-void list_games(unsigned int ip_addr, short port) {
-    // get the total number of games
-    int number_of_games = get_number_of_games();
-
-    // Make an array of rooms we will index
-    unsigned int game_indexed[number_of_games];
-    // Allocate memory for it
-    memset(game_indexed, 0, number_of_games * sizeof(game_indexed[0]));
-
-    // Make an array of each of the rooms
-    unsigned int room_nums[number_of_games];
-    // Allocate memory for it
-    memset(room_nums, 0, number_of_games * sizeof(room_nums[0]));
-
-    // Int array for if the game is active or inactive
-    int game_status[number_of_games];
-    // Allocate memory for the array
-    memset(game_status, 0, number_of_games * sizeof(game_status[0]));
-
-    //
-    int max_player = 0;
-    unsigned int max_game_number = 0;
-    int games_indexed = 0;
-
-    // For all peers in the hash table
-    for (struct peer *p = all_peers; p != NULL; p = (struct peer *)p->hh.next) {
-        int game_index = -1;
-        for (unsigned int j = 0; j < sizeof(room_nums) / sizeof(room_nums[0]);
-             j++) {
-            if (room_nums[j] == p->game) {
-                game_index = j;
-                break;
-            }
-        }
+unsigned int acquire_game() {
+    unsigned int local = game_ids_acquire(&shard->ids);
+    return local == 0 ? 0 : shard->first_game + local;
+}
 
-        // If the game is not indexed
-        if (game_indexed[game_index] == 0) {
-            game_index = games_indexed;
-            room_nums[game_index] = p->game;
-            game_status[game_index] = 1;
-            game_indexed[game_index] = 1;
-            games_indexed = games_indexed + 1;
-        } else {
-            game_status[game_index]++;
-        }
+/* Directory Stripe Of
+ *
+ * Returns the stripe of the directory a player is in
+ * The high bits of the hash are used since the tables
+ * use the low ones
+ */
+struct directory_stripe *directory_stripe_of(uint64_t key) {
+    return &directory[(peer_hash(key) >> 26) % DIRECTORY_STRIPES];
+}
 
-        if (game_status[game_index] > max_player) {
-            max_player = game_status[game_index];
-        }
-        if (room_nums[game_index] > max_game_number) {
-            max_game_number = room_nums[game_index];
-        }
+/* Directory Add
+ *
+ * Records which shard a player belongs to
+ * Returns -1 if the player is already on a shard,
+ * or -2 if there was no memory to record it
+ */
+int directory_add(struct peer *p) {
+    // One shard does not need to look anything up
+    if (shard_count == 1) {
+        return 0;
     }
 
-    int game_number_length;
-    // If there are no games
-    if (max_game_number == 0) {
-        game_number_length = 1;
-    } else {
-        game_number_length = (int)floor(log10((float)max_game_number)) + 1;
-    }
-    // Length of the maximum number of players
-    int max_player_length = (int)floor(log10((float)MAX_PLAYERS)) + 1;
+    uint64_t key = peer_key(p->ip_addr, p->port);
+    struct directory_stripe *stripe = directory_stripe_of(key);
 
-    // Length of the maximum number of games
-    int max_game_number_lenth = (int)floor(log10((float)max_player)) + 1;
+    pthread_mutex_lock(&stripe->lock);
+    int added = peer_table_insert(&stripe->peers, key, p);
+    pthread_mutex_unlock(&stripe->lock);
+    return added;
+}
 
-    // Format for displaing games
-    char *game_format = (char *)"Game: %d - %d/%d\n";
-    int list_entry_size = game_number_length + max_game_number_lenth +
-                          max_player_length + strlen(game_format);
-    int list_size = max_game_number_lenth * list_entry_size;
-    char *list_entry = (char *)malloc(list_entry_size);
-    char *list = (char *)malloc(list_size);
-    unsigned int i;
-    char *list_i = list;
-    for (i = 0; i < sizeof(game_status) / sizeof(game_status[0]); i++) {
-        sprintf(list_entry, game_format, room_nums[i], game_status[i],
-                MAX_PLAYERS);
-        strcpy(list_i, list_entry);
-        list_i += strlen(list_entry);
-    }
-    if (number_of_games == 0) {
-        list = (char *)"There are no chatrooms\n";
-    }
-    pthread_mutex_lock(&print_lock);
-    fprintf(stderr, "game list\n%p\n", list);
-    pthread_mutex_unlock(&print_lock);
+/* Directory Remove
+ *
+ * Forgets the shard of a player. Has to be done
+ * before the record goes back to its pool
+ */
+void directory_remove(uint64_t key) {
+    if (shard_count == 1) {
+        return;
+    }
 
-    packet send_packet;
-    send_packet.header.msg_type = 'r';
-    send_packet.header.msg_error = '\0';
-    send_packet.header.msg_length = list_size;
-    strcpy(send_packet.msg, list);
-    struct sockaddr_in send_addr = get_sockaddr_in(ip_addr, port);
+    struct directory_stripe *stripe = directory_stripe_of(key);
+    pthread_mutex_lock(&stripe->lock);
+    peer_table_remove(&stripe->peers, key);
+    pthread_mutex_unlock(&stripe->lock);
+}
 
-    if (sendto(sock, &send_packet, sizeof(send_packet), 0,
-               (struct sockaddr *)&send_addr, sizeof(send_addr)) == -1) {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%p\n", "msg_error - msg_error sending packet to peer");
-        pthread_mutex_unlock(&print_lock);
-    }
-}
-
-/* Peer List
- *
- * Generates the list of peers
- * ing the given game
- */
-void peer_list(unsigned int join_ip, short join_port, unsigned int game,
-               char *name) {
-    struct peer *p;
-    int num_in_room = 0;
-
-    // Get the room number
-    for (p = all_peers; p != NULL; p = (struct peer *)p->hh.next) {
-        if (p->game == game) {
-            num_in_room++;
-        }
-    }
-    struct sockaddr_in list[num_in_room];
-    int j = 0;
-    // Get the IP Addresses and ports of all
-    // players in the game
-    for (p = all_peers; p != NULL; p = (struct peer *)p->hh.next) {
-        if (p->game == game) {
-            unsigned int ip_addr = get_ip(p->ip_and_port);
-            short port = get_port(p->ip_and_port);
-            struct sockaddr_in peer_info = get_sockaddr_in(ip_addr, port);
-            struct sockaddr_in *peer_info_ptr = &peer_info;
-            memcpy((struct sockaddr_in *)&list[j], peer_info_ptr,
-                   sizeof(peer_info));
-            j++;
-        }
-    }
-
-    // Generate a packet for updating the number
-    // of players in a game
-    packet update_packet;
-    update_packet.header.msg_type = 'u';
-    update_packet.header.msg_error = '\0';
-    update_packet.header.msg_length = num_in_room * sizeof(struct sockaddr_in);
-    memcpy(update_packet.msg, list, num_in_room * sizeof(struct sockaddr_in));
-
-    for (p = all_peers; p != NULL; p = (struct peer *)p->hh.next) {
-        if (p->game == game) {
-            // Get the IP Address and port number
-            unsigned int ip_addr = get_ip(p->ip_and_port);
-            short port = get_port(p->ip_and_port);
-
-            if (join_port != -1 && join_ip != 0 && ip_addr == join_ip &&
-                port == join_port) {
-                // Generate packet for joining the game
-                packet join_packet;
-                join_packet.header.msg_type = 'j';
-                join_packet.header.msg_error = '\0';
-                // Set the game number
-                join_packet.header.game = game;
-                join_packet.header.msg_length =
-                    num_in_room * sizeof(struct sockaddr_in);
-
-                memcpy(join_packet.msg, list,
-                       num_in_room * sizeof(struct sockaddr_in));
-
-                // Get the location to send it to
-                struct sockaddr_in send_addr = get_sockaddr_in(ip_addr, port);
-
-                if (sendto(sock, &join_packet, sizeof(join_packet), 0,
-                           (struct sockaddr *)&send_addr,
-                           sizeof(send_addr)) == -1) {
-                    pthread_mutex_lock(&print_lock);
-                    fprintf(stderr, "%p\n", "Failed to send message");
-                    pthread_mutex_unlock(&print_lock);
-                }
-            } else {
-                struct sockaddr_in send_addr = get_sockaddr_in(ip_addr, port);
-
-                if (sendto(sock, &update_packet, sizeof(update_packet), 0,
-                           (struct sockaddr *)&send_addr,
-                           sizeof(send_addr)) == -1) {
-                    pthread_mutex_lock(&print_lock);
-                    fprintf(stderr, "%p\n", "Failed to send message");
-                    pthread_mutex_unlock(&print_lock);
-                }
-            }
-        }
+/* Directory Owner
+ *
+ * Returns the shard of a player, or -1 if
+ * the player is not in any game
+ */
+int directory_owner(uint64_t key) {
+    if (shard_count == 1) {
+        return -1;
     }
+
+    struct directory_stripe *stripe = directory_stripe_of(key);
+    pthread_mutex_lock(&stripe->lock);
+    struct peer *p = peer_table_find(&stripe->peers, key);
+    int owner = p == NULL ? -1 : p->shard;
+    pthread_mutex_unlock(&stripe->lock);
+    return owner;
 }
 
-/* Parse Arguments
+/* Open Game
  *
- * Reads in the port that was stated at startup
+ * Makes sure the game has room for a full member list
+ * The lists are kept when the game ends so the game
+ * number can be reused without allocating again
  */
-short parse_arguments(int argc, char **argv) {
-    // If the argument is not done correctly
-    // set the port to be 7400
-    if (argc < 2) {
-        return 7400;
-    } else {
-        // Initiate the error number
-        errno = 0;
-
-        char *endptr = NULL;
-        unsigned long port = strtoul(argv[1], &endptr, 10);
-
-        if (errno == 0) {
-            // If no other errors, check for invalid input and range
-            if ('\0' != endptr[0])
-                errno = EINVAL;
-            else if (port > USHRT_MAX)
-                errno = ERANGE;
-        }
-        if (errno != 0) {
-            // Report any errors and abort
-            fprintf(stderr, "Failed to parse port \"%p\": %p\n", argv[1],
-                    strerror(errno));
-            abort();
+int open_game(unsigned int game) {
+    struct game *g = &games[game];
+
+    if (g->members == NULL) {
+        g->members =
+            (struct peer **)malloc(max_players * sizeof(struct peer *));
+        g->roster = (struct sockaddr_in *)malloc(max_players *
+                                                 sizeof(struct sockaddr_in));
+        if (g->members == NULL || g->roster == NULL) {
+            free(g->members);
+            free(g->roster);
+            g->members = NULL;
+            g->roster = NULL;
+            return -1;
         }
-        return port;
     }
+
+    __atomic_store_n(&g->count, 0, __ATOMIC_RELAXED);
+    return 0;
 }
 
-/* Get Number Of Games
+/* Add Member
  *
- * returns the total number of games
+ * Puts the peer at the end of the games member list
+ * and its address at the end of the roster
  */
-int get_number_of_games() {
-    int total_games = 0;
-
-    // Make and alocate memory for an array of all found games
-    unsigned int game_found[MAX_GAMES];
-    memset(game_found, 0, MAX_GAMES * sizeof(game_found[0]));
-
-    // Make and alocate memory for an array of all games
-    unsigned int games[MAX_GAMES];
-    memset(games, 0, MAX_GAMES * sizeof(games[0]));
-
-    // For all perrs in the hashtable
-    for (struct peer *p = all_peers; p != NULL; p = (struct peer *)p->hh.next) {
-        // Peer is not is_found
-        int is_found = 0;
-        for (unsigned int j = 0; j < sizeof(games) / sizeof(games[0]); j++) {
-            // If both match, then we found a game
-            if (games[j] == p->game && game_found[j] == 1) {
-                is_found = 1;
-                break;
-            }
-        }
-        // If we didn'current_time find a game
-        if (is_found == 0) {
-            game_found[total_games] = 1;
-            games[total_games] = p->game;
-            total_games++;
-        }
+void add_member(struct peer *p, unsigned int game) {
+    struct game *g = &games[game];
+
+    // The first member brings the game to life
+    if (g->count == 0) {
+        __atomic_store_n(&shard->number_of_games, shard->number_of_games + 1,
+                         __ATOMIC_RELAXED);
     }
 
-    return total_games;
+    p->game = game;
+    p->member_index = g->count;
+    g->members[g->count] = p;
+    g->roster[g->count] = get_sockaddr_in(p->ip_addr, p->port);
+    __atomic_store_n(&g->count, g->count + 1, __ATOMIC_RELAXED);
+    g->version++;
+    note_lobby_change(game);
+}
+
+/* Remove Member
+ *
+ * Takes the peer out of its games member list
+ * The last member is moved into its place
+ */
+void remove_member(struct peer *p) {
+    struct game *g = &games[p->game];
+    int last = g->count - 1;
+
+    if (p->member_index != last) {
+        g->members[p->member_index] = g->members[last];
+        g->roster[p->member_index] = g->roster[last];
+        g->members[p->member_index]->member_index = p->member_index;
+    }
+    p->member_index = -1;
+    __atomic_store_n(&g->count, g->count - 1, __ATOMIC_RELAXED);
+    g->version++;
+    note_lobby_change(p->game);
+
+    // The last member to leave ends the game
+    // and frees up the game number
+    if (g->count == 0) {
+        __atomic_store_n(&shard->number_of_games, shard->number_of_games - 1,
+                         __ATOMIC_RELAXED);
+        game_ids_release(&shard->ids, p->game - shard->first_game);
+    }
 }
 
 /* Send Error
@@ -742,17 +2383,11 @@ void send_error(unsigned int ip_addr, short port, char msg_type,
     // Construct the packet to be sent
     send_packet.header.msg_type = msg_type;
     send_packet.header.msg_error = msg_error;
+    send_packet.header.game = 0;
     send_packet.header.msg_length = 0;
 
-    struct sockaddr_in send_addr = get_sockaddr_in(ip_addr, port);
-
-    // Try and send the packet to the target
-    if (sendto(sock, &send_packet, sizeof(send_packet.header), 0,
-               (struct sockaddr *)&send_addr, sizeof(send_addr)) == -1) {
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%p\n", "Failed to send packet to peer");
-        pthread_mutex_unlock(&print_lock);
-    }
+    // Sent with the other replies once the packets are handled
+    queue_reply(&send_packet, sizeof(send_packet.header), ip_addr, port);
 }
 
 /* Get Socket Address in
@@ -768,51 +2403,6 @@ struct sockaddr_in get_sockaddr_in(unsigned int ip_addr, short port) {
     return sock_addr;
 }
 
-/* Get IP Address
- *
- * Returns the IP Address the char array
- */
-unsigned int get_ip(char *ip_port) {
-    int i;
-    for (i = 0; i < 20; i++) {
-        // If the character is the delimeter
-        // break out of the loops
-        if (ip_port[i] == ':') {
-            break;
-        }
-    }
-    char char_ip[i + 1];
-    strncpy(char_ip, ip_port, i);
-    char_ip[i] = '\0';
-
-    return (unsigned int)strtoul(char_ip, NULL, 0);
-}
-
-/* Get Port
- *
- * Returns the port from the char array
- */
-short get_port(char *ip_port) {
-    int j = -1;
-    int k = -1;
-    for (int i = 0; i < 20; i++) {
-        if (j == -1 && ip_port[i] == ':') {
-            j = i + 1;
-        }
-        // Check to see if the character is the end
-        // character
-        if (ip_port[i] == '\0') {
-            k = i;
-            break;
-        }
-    }
-    char char_short[k - j + 1];
-    strncpy(char_short, ip_port + j, k - j);
-    char_short[k - j] = '\0';
-
-    return (short)strtoul(char_short, NULL, 0);
-}
-
 /* Get Player Name
  *
  *
@@ -820,144 +2410,389 @@ short get_port(char *ip_port) {
  * IP Address and port number
  */
 void get_player_name(unsigned long ip_addr, short port) {
-    char ip_and_port[20];
-
-    memset(ip_and_port, 0, sizeof(ip_and_port));
+    struct peer *p = peer_table_find(&shard->peers, peer_key(ip_addr, port));
 
-    // Set the print out format
-    char *print_format = (char *)"%d:%d";
-    sprintf(ip_and_port, print_format, ip_addr, port);
-
-    struct peer *p;
-    HASH_FIND_STR(all_peers, ip_and_port, p);
+    // If the peer is not known there is no name to send
+    if (p == NULL) {
+        send_error(ip_addr, port, 'n', 'e');
+        return;
+    }
 
     packet send_packet;
     send_packet.header.msg_type = 'n';
     send_packet.header.msg_error = '\0';
-    send_packet.header.msg_length = sizeof(p->name);
-
+    send_packet.header.game = p->game;
     strcpy(send_packet.msg, p->name);
+    send_packet.header.msg_length = strlen(p->name) + 1;
+
+    queue_reply(&send_packet,
+                sizeof(send_packet.header) + send_packet.header.msg_length,
+                ip_addr, port);
+}
+
+/* Send Stats
+ *
+ * Sends the metrics of every worker added together as
+ * text, see Stats in msg.h. Times are in ns
+ */
+void send_stats(unsigned int ip_addr, short port) {
+    struct metrics total;
+    size_t peers;
+    total_metrics(&total, &peers);
+
+    char text[4096];
+    size_t used = 0;
+    text_append(text, sizeof(text), &used,
+                "games %d\npeers %zu\nunknown %lu\n"
+                "send_failures %lu\nroster_bytes %lu\n"
+                "log_dropped %lu\n",
+                get_number_of_games(), peers, (unsigned long)total.unknown,
+                (unsigned long)total.send_failures,
+                (unsigned long)total.roster_bytes,
+                (unsigned long)log_dropped());
+
+    for (size_t i = 0; i < METRIC_TYPE_COUNT; i++) {
+        struct histogram *h = &total.handlers[i];
+        uint64_t mean = h->count == 0 ? 0 : h->sum / h->count;
+        text_append(text, sizeof(text), &used,
+                    "handler %c count %lu mean %lu p50 %lu p90 %lu "
+                    "p99 %lu max %lu\n",
+                    METRIC_TYPES[i], (unsigned long)h->count,
+                    (unsigned long)mean,
+                    (unsigned long)histogram_percentile(h, 50),
+                    (unsigned long)histogram_percentile(h, 90),
+                    (unsigned long)histogram_percentile(h, 99),
+                    (unsigned long)h->max);
+    }
+
+    message_header header;
+    header.msg_type = 's';
+    header.msg_error = '\0';
+    header.game = 0;
+
+    struct iovec stats;
+    stats.iov_base = text;
+    stats.iov_len = cut_reply(text, used + 1, &header.msg_error);
 
     struct sockaddr_in send_addr = get_sockaddr_in(ip_addr, port);
+    queue_message(&header, &stats, 1, &send_addr, reply_v2);
+}
 
-    if (sendto(sock, &send_packet, sizeof(send_packet), 0,
-               (struct sockaddr *)&send_addr, sizeof(send_addr)) == -1) {
-        // Print that the packet could not be sent
-        pthread_mutex_lock(&print_lock);
-        fprintf(stderr, "%p\n", " Failed to send the packet");
-        pthread_mutex_unlock(&print_lock);
+/* Cut Reply
+ *
+ * Returns how much of a text answer can be sent, see
+ * Short Replies in msg.h. A text that is cut ends after
+ * its last whole line and msg_error is set to 't'
+ */
+size_t cut_reply(const char *text, size_t length, char *msg_error) {
+    if (length <= SHORT_REPLY_MAX) {
+        return length;
+    }
+    *msg_error = 't';
+
+    size_t cut = SHORT_REPLY_MAX;
+    while (cut > 0 && text[cut - 1] != '\n') {
+        cut--;
     }
+    return cut == 0 ? SHORT_REPLY_MAX : cut;
 }
 
-/* Main function for the Server
+/* Total Metrics
  *
- * Creates two threads:
- *      The first one is for getting messages from peers
- *      The second one tests peer status
+ * Adds up the metrics and the peers of every worker
+ * Only reads what the workers write, so it never
+ * holds them up and can be called from any thread
+ */
+void total_metrics(struct metrics *total, size_t *peers) {
+    memset(total, 0, sizeof(*total));
+    *peers = 0;
+    for (int i = 0; i < shard_count; i++) {
+        metrics_merge(total, &shards[i].metrics);
+        *peers += __atomic_load_n(&shards[i].pool.live, __ATOMIC_RELAXED);
+    }
+}
+
+/* Render Metrics
  *
+ * Writes the page the exporter serves, in the
+ * Prometheus text format. Runs on the exporter thread
+ */
+size_t render_metrics(char *out, size_t room) {
+    struct metrics total;
+    size_t peers;
+    total_metrics(&total, &peers);
+
+    size_t used = 0;
+    text_append(out, room, &used,
+                "# HELP bingo_games Games being played\n"
+                "# TYPE bingo_games gauge\n"
+                "bingo_games %d\n"
+                "# HELP bingo_peers Players in a game\n"
+                "# TYPE bingo_peers gauge\n"
+                "bingo_peers %zu\n"
+                "# HELP bingo_log_dropped_total Log lines dropped\n"
+                "# TYPE bingo_log_dropped_total counter\n"
+                "bingo_log_dropped_total %lu\n",
+                get_number_of_games(), peers, (unsigned long)log_dropped());
+    metrics_prometheus(&total, out, room, &used);
+    return used;
+}
+
+/* Init Shard
  *
+ * Sets up an empty shard that owns capacity
+ * game numbers, starting after first_game
  */
-int main(int argc, char **argv) {
-    // Initiate hashtable of peers to be empty
-    all_peers = NULL;
-    // Read the port to use
-    short port = parse_arguments(argc, argv);
-    fprintf(stderr, "Starting server on ports: %d, %d\n", port, port + 1);
+void init_shard(struct shard *s, int index, unsigned int first_game,
+                unsigned int capacity) {
+    s->index = index;
+    s->first_game = first_game;
+    peer_table_init(&s->peers, 1024);
+    slab_pool_init(&s->pool, sizeof(struct peer));
+    game_ids_init(&s->ids, capacity);
+    memset(&s->metrics, 0, sizeof(s->metrics));
+
+    s->lobby_built = 0;
+    s->lobby_room = sizeof(((packet *)0)->msg);
+    s->lobby_text = (char *)malloc(s->lobby_room);
+    s->lobby_length = 0;
+    s->lobby_changes = (unsigned int *)malloc(capacity * sizeof(unsigned int));
+    s->lobby_changed = (uint64_t *)calloc(capacity / 64 + 1, sizeof(uint64_t));
+    s->lobby_change_count = 0;
+
+    if (mailbox_init(&s->mailbox) == -1) {
+        fprintf(stderr, "Failed to make a mailbox: %s\n", strerror(errno));
+        abort();
+    }
+
+    // The timer only runs once the shard has peers
+    timer_wheel_init(&s->wheel, liveness_now());
+    s->liveness_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (s->liveness_timer == -1) {
+        fprintf(stderr, "Failed to create timer: %s\n", strerror(errno));
+        abort();
+    }
+    s->ticking = 0;
+}
 
-    // Setup Primary UDP socket
-    sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) {
-        fprintf(stderr, "%p\n", "Failed to create socket");
+/* Open Socket
+ *
+ * Makes a UDP socket bound to the port on every address
+ * With more than one worker each of them binds the same
+ * port, in the order of their shards
+ */
+int open_socket(unsigned short port) {
+    // The workers must never block in a read, since they
+    // also have timers and a mailbox to look after
+    int new_sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (new_sock < 0) {
+        fprintf(stderr, "%s\n", "Failed to create socket");
         abort();
     }
 
-    // Setup Secondary UDP socket
-    status_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (status_sock < 0) {
-        fprintf(stderr, "%p\n", "Failed to create status_socket");
+    int reuse = 1;
+    if (shard_count > 1 && setsockopt(new_sock, SOL_SOCKET, SO_REUSEPORT,
+                                      &reuse, sizeof(reuse)) == -1) {
+        fprintf(stderr, "Failed to share port %d: %s\n", port,
+                strerror(errno));
         abort();
     }
 
-    // Set up my address
     struct sockaddr_in my_addr;
+    memset(&my_addr, 0, sizeof(my_addr));
     my_addr.sin_family = AF_INET;
     my_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     my_addr.sin_port = htons(port);
 
-    // Set up the status address
-    struct sockaddr_in status_addr;
-    status_addr.sin_family = AF_INET;
-    status_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    status_addr.sin_port = htons(port + 1);
+    if (bind(new_sock, (struct sockaddr *)&my_addr, sizeof(my_addr))) {
+        fprintf(stderr, "Failed to bind port %d: %s\n", port,
+                strerror(errno));
+        abort();
+    }
+    return new_sock;
+}
+
+/* Attach Steering
+ *
+ * Gives the group of sockets sharing a port a program that
+ * picks the worker for each datagram from header.game
+ *
+ * Game numbers are split into blocks of shard_games, so the
+ * worker is (game - 1) / shard_games. Datagrams without a
+ * game go to a random worker. A number past the last shard
+ * makes the kernel fall back to hashing the address
+ *
+ * A v1 game is in host order, so it is put together a byte
+ * at a time starting with the most significant one. A v2
+ * game is a varint starting at the fourth byte, read into
+ * the scratch memory 7 bits at a time
+ */
+int attach_steering(int socket) {
+    unsigned int at = offsetof(message_header, game);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    unsigned int b3 = at + 3, b2 = at + 2, b1 = at + 1, b0 = at;
+#else
+    unsigned int b3 = at, b2 = at + 1, b1 = at + 2, b0 = at + 3;
+#endif
+
+// Adds a byte of a v2 game to M[0] and skips
+// the later bytes if it is the last one
+#define STEER_VARINT_BYTE(offset, later)                  \
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offset),           \
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x7f),        \
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),                  \
+        BPF_STMT(BPF_LD | BPF_MEM, 0),                    \
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 7),           \
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),            \
+        BPF_STMT(BPF_ST, 0),                              \
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offset),       \
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x80, 0, 9 * (later))
+
+    struct sock_filter code[] = {
+        // A v2 header, otherwise skip to the v1 game
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PROTOCOL_V2, 0, 2 + 5 * 9 + 2),
+
+        BPF_STMT(BPF_LD | BPF_IMM, 0),
+        BPF_STMT(BPF_ST, 0),
+        STEER_VARINT_BYTE(3, 4),
+        STEER_VARINT_BYTE(4, 3),
+        STEER_VARINT_BYTE(5, 2),
+        STEER_VARINT_BYTE(6, 1),
+        STEER_VARINT_BYTE(7, 0),
+        // Skip the 13 steps of the v1 game
+        BPF_STMT(BPF_LD | BPF_MEM, 0),
+        BPF_JUMP(BPF_JMP | BPF_JA, 13, 0, 0),
+
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, b3),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, b2),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, b1),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, b0),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+
+        // No game, pick any worker
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 3, 0),
+
+        BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, 1),
+        BPF_STMT(BPF_ALU | BPF_DIV | BPF_K, shard_games),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 (unsigned int)(SKF_AD_OFF + SKF_AD_RANDOM)),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (unsigned int)shard_count),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+#undef STEER_VARINT_BYTE
+
+    struct sock_fprog program;
+    program.len = sizeof(code) / sizeof(code[0]);
+    program.filter = code;
+
+    return setsockopt(socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program,
+                      sizeof(program));
+}
+
+/* Main function for the Server
+ *
+ * Starts a worker thread for every shard after the first
+ * and runs the first one on the main thread. With one
+ * worker everything happens on the main thread
+ */
+int main(int argc, char **argv) {
+    // Read the port and limits to use
+    short port = parse_arguments(argc, argv);
+
+    // Workers only log through the writer so they never wait on stderr
+    if (log_start() == -1) {
+        fprintf(stderr, "Failed to start logging: %s\n", strerror(errno));
+        abort();
+    }
 
-    // Try and bind the primary socket
-    if (bind(sock, (struct sockaddr *)&my_addr, sizeof(my_addr))) {
-        fprintf(stderr, "%p\n", "Failed to bind socket");
+    // Every address in a game has to fit in one roster message
+    if (max_players > MAX_ROSTER) {
+        fprintf(stderr, "max_players %d is too large, using %d\n",
+                max_players, MAX_ROSTER);
+        max_players = MAX_ROSTER;
+    }
+    if (max_games == 0 || max_players == 0 || shard_count == 0) {
+        fprintf(stderr, "%s\n",
+                "max_games, max_players and workers must be above 0");
         abort();
     }
-    // Try and bind the secondary socket
-    if (bind(status_sock, (struct sockaddr *)&status_addr,
-             sizeof(status_addr))) {
-        fprintf(stderr, "%p\n", "Failed to bind status socket");
+    if (liveness_timeout < MIN_LIVENESS_TIMEOUT) {
+        fprintf(stderr, "liveness_timeout %u is too small, using %d\n",
+                liveness_timeout, MIN_LIVENESS_TIMEOUT);
+        liveness_timeout = MIN_LIVENESS_TIMEOUT;
+    }
+    if (memory_budget != 0 && memory_reserved() > memory_budget) {
+        fprintf(stderr, "%s\n", "memory_budget is too small for max_games");
         abort();
     }
 
-    // create j thread to handle ping responses
-    pthread_t inp_thread;
-    pthread_create(&inp_thread, NULL, inp, NULL);
-    pthread_detach(inp_thread);
+    // Split the game numbers into one block per shard
+    // Every shard needs at least one game
+    shard_games = (max_games + shard_count - 1) / shard_count;
+    shard_count = (max_games + shard_games - 1) / shard_games;
+    fprintf(stderr, "Hosting up to %u games of %d players on %d workers\n",
+            max_games, max_players, shard_count);
+
+    games = (struct game *)calloc(max_games + 1, sizeof(struct game));
+    peer_table_init(&lobby_watchers, 16);
+    slab_pool_init(&watcher_pool, sizeof(struct peer));
+    timer_wheel_init(&watcher_wheel, liveness_now());
+    pthread_mutex_init(&watchers_lock, NULL);
+    for (int i = 0; i < DIRECTORY_STRIPES; i++) {
+        pthread_mutex_init(&directory[i].lock, NULL);
+        peer_table_init(&directory[i].peers, 64);
+    }
+    fprintf(stderr, "Starting server on ports: %d, %d\n", port, port + 1);
 
-    // create thread to send pings and delete dead users
-    pthread_t out_thread;
-    pthread_create(&out_thread, NULL, out, NULL);
-    pthread_detach(out_thread);
+    // Bind the sockets in shard order, which is
+    // the order the steering program picks from
+    shards = (struct shard *)calloc(shard_count, sizeof(struct shard));
+    for (int i = 0; i < shard_count; i++) {
+        unsigned int first_game = i * shard_games;
+        unsigned int capacity = max_games - first_game;
+        if (capacity > shard_games) {
+            capacity = shard_games;
+        }
+        init_shard(&shards[i], i, first_game, capacity);
+        shards[i].sock = open_socket(port);
+        shards[i].status_sock = open_socket(port + 1);
+    }
 
-    // Set the address length to be 10
-    socklen_t addrlen = 10;
-    struct sockaddr_in sender_addr;
-    packet get_packet;
-    // While this is true
-    while (1) {
-        // Check to see if the packet was not successfuly received
-        if (recvfrom(sock, &get_packet, sizeof(get_packet), 0,
-                     (struct sockaddr *)&sender_addr, &addrlen) == -1) {
-            pthread_mutex_lock(&print_lock);
-            fprintf(stderr, "%p\n", "Ignoring Failed to Recieved Packet");
-            pthread_mutex_unlock(&print_lock);
-        } else {
-            // Get the IP Address of the sender
-            unsigned int ip_addr = sender_addr.sin_addr.s_addr;
-
-            // Get Port Number of the sender
-            short port = htons(sender_addr.sin_port);
-
-            // Check the message header to determine
-            // what needs to be done
-            switch (get_packet.header.msg_type) {
-                case 'c':
-                    create_game(ip_addr, port, get_packet.msg);
-                    break;
-                case 'j':
-                    join_game(ip_addr, port, get_packet.header.game,
-                              get_packet.msg);
-                    break;
-                case 'l':
-                    leave_game(ip_addr, port);
-                    break;
-                case 'r':
-                    list_games(ip_addr, port);
-                    break;
-
-                case 'n':
-                    get_player_name(ip_addr, port);
-                    break;
-                default:
-                    pthread_mutex_lock(&print_lock);
-                    fprintf(stderr, "%p\n", "Unkown Type of Packet Recieved");
-                    pthread_mutex_unlock(&print_lock);
-                    break;
-            }
+    if (metrics_port != 0 &&
+        exporter_start(&exporter, metrics_port, render_metrics) == -1) {
+        fprintf(stderr, "Failed to start the metrics exporter: %s\n",
+                strerror(errno));
+    }
+
+    if (shard_count > 1) {
+        // Without steering packets still get to the right
+        // shard, they are just handed over more often
+        if (attach_steering(shards[0].sock) == -1 ||
+            attach_steering(shards[0].status_sock) == -1) {
+            fprintf(stderr, "Failed to attach the steering program: %s\n",
+                    strerror(errno));
         }
     }
+
+    // Each worker falls back to epoll on its own
+    // if io_uring can not be used
+    void *(*run)(void *) = use_io_uring ? uring_worker : worker;
+    for (int i = 1; i < shard_count; i++) {
+        pthread_t worker_thread;
+        pthread_create(&worker_thread, NULL, run, &shards[i]);
+        pthread_detach(worker_thread);
+    }
+    run(&shards[0]);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,119 @@
+#include <stdlib.h>
+
+/* Slab Pool
+ *
+ * Hands out fixed size records that are carved
+ * out of larger slabs. Freed records go on a free
+ * list and are handed out again before a new slab
+ * is allocated. Slabs are kept until the pool is freed
+ */
+#define SLAB_POOL_RECORDS 256
+
+struct slab_pool {
+    size_t record_size;
+    void *free_list;
+    char **slabs;
+    size_t slab_count;
+
+    // Stored atomically, other threads read it for metrics
+    size_t live;
+    size_t free;
+};
+
+/* Slab Pool Init
+ *
+ * Sets up an empty pool. Records are at least
+ * large enough to hold the free list link
+ */
+void slab_pool_init(struct slab_pool *pool, size_t record_size) {
+    if (record_size < sizeof(void *)) {
+        record_size = sizeof(void *);
+    }
+    // Keep every record pointer aligned
+    record_size = (record_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    pool->record_size = record_size;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    pool->slab_count = 0;
+    pool->live = 0;
+    pool->free = 0;
+}
+
+/* Slab Pool Grow
+ *
+ * Allocates one more slab and puts
+ * all of its records on the free list
+ */
+int slab_pool_grow(struct slab_pool *pool) {
+    char *slab = (char *)malloc(pool->record_size * SLAB_POOL_RECORDS);
+    char **slabs = (char **)realloc(pool->slabs,
+                                    (pool->slab_count + 1) * sizeof(char *));
+    if (slab == NULL || slabs == NULL) {
+        free(slab);
+        if (slabs != NULL) {
+            pool->slabs = slabs;
+        }
+        return -1;
+    }
+    pool->slabs = slabs;
+    pool->slabs[pool->slab_count] = slab;
+    pool->slab_count++;
+
+    // Push the records backwards so they are handed out in order
+    for (int i = SLAB_POOL_RECORDS - 1; i >= 0; i--) {
+        void *record = slab + i * pool->record_size;
+        *(void **)record = pool->free_list;
+        pool->free_list = record;
+    }
+    pool->free += SLAB_POOL_RECORDS;
+    return 0;
+}
+
+/* Slab Pool Alloc
+ *
+ * Returns a record, or NULL if no memory is left
+ */
+void *slab_pool_alloc(struct slab_pool *pool) {
+    if (pool->free_list == NULL && slab_pool_grow(pool) == -1) {
+        return NULL;
+    }
+
+    void *record = pool->free_list;
+    pool->free_list = *(void **)record;
+    pool->free--;
+    __atomic_store_n(&pool->live, pool->live + 1, __ATOMIC_RELAXED);
+    return record;
+}
+
+/* Slab Pool Release
+ *
+ * Puts a record back on the free list
+ */
+void slab_pool_release(struct slab_pool *pool, void *record) {
+    if (record == NULL) {
+        return;
+    }
+
+    *(void **)record = pool->free_list;
+    pool->free_list = record;
+    __atomic_store_n(&pool->live, pool->live - 1, __ATOMIC_RELAXED);
+    pool->free++;
+}
+
+/* Slab Pool Free
+ *
+ * Deallocates every slab. Any record still
+ * handed out is no longer valid
+ */
+void slab_pool_free(struct slab_pool *pool) {
+    for (size_t i = 0; i < pool->slab_count; i++) {
+        free(pool->slabs[i]);
+    }
+    free(pool->slabs);
+    pool->slabs = NULL;
+    pool->slab_count = 0;
+    pool->free_list = NULL;
+    pool->live = 0;
+    pool->free = 0;
+}
@@ -0,0 +1,215 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/* Timer Wheel
+ *
+ * Keeps deadlines, measured in ticks, so that adding and
+ * removing one and finding the ones that are due does not
+ * depend on how many there are
+ *
+ * Level 0 has a slot for each of the next 64 ticks. Each
+ * level above covers 64 times as long with the same number
+ * of slots. When the level below wraps around, the next
+ * slot of a level is spread over the level below, so every
+ * timer is moved down at most once per level
+ *
+ * The timers are kept in the records they belong to, so
+ * the wheel never allocates
+ */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+// The furthest a deadline can be, in ticks
+#define TIMER_WHEEL_SPAN \
+    ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer *prev;
+    uint64_t expires;
+};
+
+struct timer_wheel {
+    // Every slot is the head of a circular list
+    struct wheel_timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+    // Timers whose tick has been reached
+    struct wheel_timer due;
+
+    uint64_t now;
+    size_t count;
+};
+
+/* Wheel List Init
+ *
+ * Makes an empty circular list
+ */
+void wheel_list_init(struct wheel_timer *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+/* Wheel List Append
+ *
+ * Puts a timer at the end of a list
+ */
+void wheel_list_append(struct wheel_timer *head, struct wheel_timer *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+/* Wheel Timer Init
+ *
+ * Sets up a timer that is not in a wheel
+ */
+void wheel_timer_init(struct wheel_timer *timer) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+}
+
+/* Wheel Timer Pending
+ *
+ * Returns 1 if the timer is in a wheel
+ */
+int wheel_timer_pending(struct wheel_timer *timer) {
+    return timer->next != NULL;
+}
+
+/* Timer Wheel Init
+ *
+ * Sets up an empty wheel starting at tick now
+ */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            wheel_list_init(&wheel->slots[level][slot]);
+        }
+    }
+    wheel_list_init(&wheel->due);
+    wheel->now = now;
+    wheel->count = 0;
+}
+
+/* Timer Wheel Place
+ *
+ * Puts a timer in the slot its deadline falls in
+ * The deadline can not be before the current tick
+ */
+void timer_wheel_place(struct timer_wheel *wheel, struct wheel_timer *timer) {
+    uint64_t delta = timer->expires - wheel->now;
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= (uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+
+    int slot = (timer->expires >> (TIMER_WHEEL_BITS * level)) &
+               (TIMER_WHEEL_SLOTS - 1);
+    wheel_list_append(&wheel->slots[level][slot], timer);
+}
+
+/* Timer Wheel Remove
+ *
+ * Takes a timer out of its wheel
+ * Does nothing if it is not in one
+ */
+void timer_wheel_remove(struct timer_wheel *wheel, struct wheel_timer *timer) {
+    if (!wheel_timer_pending(timer)) {
+        return;
+    }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+    wheel->count--;
+}
+
+/* Timer Wheel Add
+ *
+ * Sets a timer to expire at tick expires, moving it if it
+ * was already set. A deadline that has passed expires on
+ * the next tick and one too far away is brought closer
+ */
+void timer_wheel_add(struct timer_wheel *wheel, struct wheel_timer *timer,
+                     uint64_t expires) {
+    timer_wheel_remove(wheel, timer);
+
+    if (expires <= wheel->now) {
+        expires = wheel->now + 1;
+    } else if (expires - wheel->now >= TIMER_WHEEL_SPAN) {
+        expires = wheel->now + TIMER_WHEEL_SPAN - 1;
+    }
+    timer->expires = expires;
+
+    timer_wheel_place(wheel, timer);
+    wheel->count++;
+}
+
+/* Timer Wheel Tick
+ *
+ * Moves the wheel on by one tick. Higher slots that start
+ * at this tick are spread over the levels below, then the
+ * timers of this tick are put on the due list
+ */
+void timer_wheel_tick(struct timer_wheel *wheel) {
+    wheel->now++;
+
+    for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+        uint64_t mask = ((uint64_t)1 << (TIMER_WHEEL_BITS * level)) - 1;
+        if ((wheel->now & mask) != 0) {
+            continue;
+        }
+
+        int slot = (wheel->now >> (TIMER_WHEEL_BITS * level)) &
+                   (TIMER_WHEEL_SLOTS - 1);
+        struct wheel_timer *head = &wheel->slots[level][slot];
+        struct wheel_timer *timer = head->next;
+        wheel_list_init(head);
+        while (timer != head) {
+            struct wheel_timer *next = timer->next;
+            timer_wheel_place(wheel, timer);
+            timer = next;
+        }
+    }
+
+    // Everything in this slot expires on this tick
+    struct wheel_timer *head =
+        &wheel->slots[0][wheel->now & (TIMER_WHEEL_SLOTS - 1)];
+    if (head->next != head) {
+        head->next->prev = wheel->due.prev;
+        head->prev->next = &wheel->due;
+        wheel->due.prev->next = head->next;
+        wheel->due.prev = head->prev;
+        wheel_list_init(head);
+    }
+}
+
+/* Timer Wheel Expire
+ *
+ * Moves the wheel up to tick now and returns one timer
+ * that is due, taken out of the wheel, or NULL once there
+ * are none. Timers can be added and removed between calls
+ */
+struct wheel_timer *timer_wheel_expire(struct timer_wheel *wheel,
+                                       uint64_t now) {
+    while (wheel->due.next == &wheel->due) {
+        if (wheel->now >= now) {
+            return NULL;
+        }
+        // An empty wheel can skip straight to now
+        if (wheel->count == 0) {
+            wheel->now = now;
+            return NULL;
+        }
+        timer_wheel_tick(wheel);
+    }
+
+    struct wheel_timer *timer = wheel->due.next;
+    timer_wheel_remove(wheel, timer);
+    return timer;
+}
@@ -0,0 +1,277 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* UDP Batch
+ *
+ * Receives and sends many datagrams with one system call
+ *
+ * The packets, addresses and message headers are allocated
+ * once and reused for every batch. Packets are handed out
+ * in the order they arrived
+ *
+ * Include msg.h before this file
+ */
+#define UDP_BATCH_SIZE 32
+
+// The most pieces one sent datagram can be made of
+#define SEND_BATCH_PARTS 3
+
+struct recv_batch {
+    packet *packets;
+    struct sockaddr_in *addrs;
+    struct iovec *iovs;
+    struct mmsghdr *msgs;
+    unsigned int size;
+    unsigned int count;
+};
+
+/* Recv Batch Init
+ *
+ * Allocates room for size packets
+ */
+void recv_batch_init(struct recv_batch *batch, unsigned int size) {
+    batch->size = size;
+    batch->count = 0;
+    batch->packets = (packet *)calloc(size, sizeof(packet));
+    batch->addrs =
+        (struct sockaddr_in *)calloc(size, sizeof(struct sockaddr_in));
+    batch->iovs = (struct iovec *)calloc(size, sizeof(struct iovec));
+    batch->msgs = (struct mmsghdr *)calloc(size, sizeof(struct mmsghdr));
+
+    for (unsigned int i = 0; i < size; i++) {
+        batch->iovs[i].iov_base = &batch->packets[i];
+        batch->iovs[i].iov_len = sizeof(packet);
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+    }
+}
+
+/* Recv Batch Free
+ *
+ * Deallocates the packets of the batch
+ */
+void recv_batch_free(struct recv_batch *batch) {
+    free(batch->packets);
+    free(batch->addrs);
+    free(batch->iovs);
+    free(batch->msgs);
+    memset(batch, 0, sizeof(*batch));
+}
+
+/* Recv Batch Fill
+ *
+ * Waits for at least one datagram and then takes every
+ * datagram that is already waiting, up to the batch size
+ * Returns the number received, or -1 on an error. A non
+ * blocking socket with nothing waiting gives 0
+ *
+ * Packets too short to hold any header are dropped and
+ * the rest have a terminator after the last byte read
+ */
+int recv_batch_fill(struct recv_batch *batch, int socket) {
+    for (unsigned int i = 0; i < batch->size; i++) {
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    int received = recvmmsg(socket, batch->msgs, batch->size, MSG_WAITFORONE,
+                            NULL);
+    if (received == -1) {
+        batch->count = 0;
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+
+    // Move the usable packets to the front
+    unsigned int kept = 0;
+    for (int i = 0; i < received; i++) {
+        unsigned int length = batch->msgs[i].msg_len;
+        if (length < HEADER_MIN) {
+            continue;
+        }
+
+        if (kept != (unsigned int)i) {
+            memcpy(&batch->packets[kept], &batch->packets[i], length);
+            batch->addrs[kept] = batch->addrs[i];
+            batch->msgs[kept].msg_len = length;
+        }
+        if (length < sizeof(packet)) {
+            ((char *)&batch->packets[kept])[length] = '\0';
+        } else {
+            batch->packets[kept].msg[sizeof(batch->packets[kept].msg) - 1] =
+                '\0';
+        }
+        kept++;
+    }
+
+    batch->count = kept;
+    return kept;
+}
+
+/* Send Batch
+ *
+ * Collects datagrams for many destinations and sends
+ * them with as few system calls as possible
+ *
+ * send_batch_add only keeps pointers to the data, so the
+ * data has to stay in place until the batch is flushed
+ * send_batch_copy keeps a copy of one packet instead
+ *
+ * report is called for every destination that could
+ * not be sent to, with the errno of the failure
+ *
+ * flush can be set to send the batch some other way than
+ * sendmmsg, with backend holding what it needs. It returns
+ * the number of datagrams that failed
+ */
+struct send_batch {
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    struct sockaddr_in *addrs;
+    packet *copies;
+    unsigned int size;
+    unsigned int count;
+    int socket;
+    unsigned int failed;
+    void (*report)(struct sockaddr_in *send_addr, int error);
+    unsigned int (*flush)(struct send_batch *batch);
+    void *backend;
+};
+
+/* Send Batch Init
+ *
+ * Allocates room for size datagrams
+ */
+void send_batch_init(struct send_batch *batch, unsigned int size,
+                     void (*report)(struct sockaddr_in *, int)) {
+    batch->size = size;
+    batch->count = 0;
+    batch->socket = -1;
+    batch->failed = 0;
+    batch->report = report;
+    batch->flush = NULL;
+    batch->backend = NULL;
+    batch->msgs = (struct mmsghdr *)calloc(size, sizeof(struct mmsghdr));
+    batch->iovs =
+        (struct iovec *)calloc(size * SEND_BATCH_PARTS, sizeof(struct iovec));
+    batch->addrs =
+        (struct sockaddr_in *)calloc(size, sizeof(struct sockaddr_in));
+    batch->copies = (packet *)calloc(size, sizeof(packet));
+}
+
+/* Send Batch Free
+ *
+ * Deallocates the batch. Anything not flushed is lost
+ */
+void send_batch_free(struct send_batch *batch) {
+    free(batch->msgs);
+    free(batch->iovs);
+    free(batch->addrs);
+    free(batch->copies);
+    memset(batch, 0, sizeof(*batch));
+}
+
+/* Send Batch Flush
+ *
+ * Sends every datagram in the batch. When only part of the
+ * batch is sent the rest is tried again. A datagram that
+ * fails is reported and skipped
+ *
+ * Returns the number of datagrams that failed
+ */
+unsigned int send_batch_flush(struct send_batch *batch) {
+    unsigned int failed = 0;
+    unsigned int i = 0;
+
+    if (batch->flush != NULL && batch->count != 0) {
+        failed = batch->flush(batch);
+        i = batch->count;
+    }
+
+    while (i < batch->count) {
+        int sent =
+            sendmmsg(batch->socket, batch->msgs + i, batch->count - i, 0);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            // The first datagram left failed, skip it
+            if (batch->report != NULL) {
+                batch->report(&batch->addrs[i], errno);
+            }
+            failed++;
+            i++;
+            continue;
+        }
+        i += sent;
+    }
+
+    batch->count = 0;
+    batch->failed += failed;
+    return failed;
+}
+
+/* Send Batch Begin
+ *
+ * Sets the socket the next datagrams are sent from
+ * Anything waiting for another socket is sent first
+ */
+void send_batch_begin(struct send_batch *batch, int socket) {
+    if (batch->socket != socket && batch->count != 0) {
+        send_batch_flush(batch);
+    }
+    batch->socket = socket;
+}
+
+/* Send Batch Add
+ *
+ * Adds a datagram made of up to SEND_BATCH_PARTS pieces
+ * The batch is flushed when it is full
+ */
+void send_batch_add(struct send_batch *batch, struct sockaddr_in *send_addr,
+                    struct iovec *parts, int part_count) {
+    if (batch->count == batch->size) {
+        send_batch_flush(batch);
+    }
+
+    unsigned int i = batch->count;
+    struct iovec *iovs = &batch->iovs[i * SEND_BATCH_PARTS];
+    for (int j = 0; j < part_count && j < SEND_BATCH_PARTS; j++) {
+        iovs[j] = parts[j];
+    }
+
+    batch->addrs[i] = *send_addr;
+    memset(&batch->msgs[i], 0, sizeof(batch->msgs[i]));
+    batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+    batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    batch->msgs[i].msg_hdr.msg_iov = iovs;
+    batch->msgs[i].msg_hdr.msg_iovlen =
+        part_count < SEND_BATCH_PARTS ? part_count : SEND_BATCH_PARTS;
+    batch->count++;
+}
+
+/* Send Batch Copy
+ *
+ * Adds a copy of the first length bytes of a packet, so
+ * the packet can be reused before the batch is flushed
+ */
+void send_batch_copy(struct send_batch *batch, struct sockaddr_in *send_addr,
+                     packet *data, size_t length) {
+    if (batch->count == batch->size) {
+        send_batch_flush(batch);
+    }
+    if (length > sizeof(packet)) {
+        length = sizeof(packet);
+    }
+
+    packet *copy = &batch->copies[batch->count];
+    memcpy(copy, data, length);
+
+    struct iovec part;
+    part.iov_base = copy;
+    part.iov_len = length;
+    send_batch_add(batch, send_addr, &part, 1);
+}
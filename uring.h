@@ -0,0 +1,494 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Uring
+ *
+ * A small io_uring made straight on the system calls
+ *
+ * Only the thread that made a ring may use it. Entries are
+ * put in the submission queue with uring_get_sqe and handed
+ * to the kernel by uring_enter, which can also wait for
+ * completions. Completions are read with uring_peek_cqe and
+ * given back with uring_cqe_seen
+ *
+ * Include msg.h and udp_batch.h before this file
+ */
+struct uring {
+    int fd;
+    unsigned int entries;
+
+    // Submission queue
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_pending;
+
+    // Completion queue
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Mappings shared with the kernel
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+/* Uring Buffers
+ *
+ * Buffers the kernel picks from when a receive
+ * completes, so no buffer is tied up waiting
+ *
+ * count has to be a power of two
+ */
+struct uring_buffers {
+    struct io_uring_buf_ring *ring;
+    size_t ring_size;
+    char *data;
+    unsigned int count;
+    unsigned int size;
+    unsigned short group;
+    unsigned short tail;
+};
+
+// Room for the receive header, the sender and a packet
+// with a byte left over for a terminator
+#define URING_BUFFER_SIZE                                              \
+    ((sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + \
+      sizeof(packet) + 8) &                                             \
+     ~(size_t)7)
+
+/* Uring Init
+ *
+ * Makes a ring with room for entries submissions
+ * Returns -1 if io_uring can not be used
+ */
+int uring_init(struct uring *ring, unsigned int entries) {
+    memset(ring, 0, sizeof(*ring));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1 && errno == EINVAL) {
+        // Older kernels do not know the flags
+        memset(&params, 0, sizeof(params));
+        ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (ring->fd == -1) {
+        return -1;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Newer kernels share one mapping for both queues
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(
+        NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = (char *)ring->sq_ring;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+
+    char *cq = (char *)ring->cq_ring;
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+/* Uring Free
+ *
+ * Unmaps the queues and closes the ring
+ */
+void uring_free(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/* Uring Enter
+ *
+ * Submits the waiting entries and, if wait_for is above 0,
+ * waits until that many completions are ready
+ * Returns -1 on an error
+ */
+int uring_enter(struct uring *ring, unsigned int wait_for) {
+    int submitted =
+        syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending, wait_for,
+                wait_for != 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (submitted == -1) {
+        return -1;
+    }
+    ring->sq_pending -= submitted;
+    return 0;
+}
+
+/* Uring Get SQE
+ *
+ * Returns an empty submission entry. When the queue is
+ * full the waiting entries are submitted first
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    unsigned int tail = *ring->sq_tail;
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring->entries) {
+        if (uring_enter(ring, 0) == -1) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ring->entries) {
+            return NULL;
+        }
+    }
+
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+    return sqe;
+}
+
+/* Uring Peek CQE
+ *
+ * Returns the oldest completion, or NULL if there is none
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    unsigned int head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+/* Uring CQE Seen
+ *
+ * Gives the oldest completion back to the kernel
+ */
+void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Uring Buffers Give
+ *
+ * Hands a buffer back to the kernel to receive into
+ */
+void uring_buffers_give(struct uring_buffers *buffers, unsigned short id) {
+    // bufs is not at the start of the ring when built as C++,
+    // so the entries are found from the start of the ring
+    struct io_uring_buf *buf = (struct io_uring_buf *)buffers->ring +
+                               (buffers->tail & (buffers->count - 1));
+    buf->addr =
+        (uint64_t)(uintptr_t)(buffers->data + (size_t)id * buffers->size);
+    buf->len = buffers->size;
+    buf->bid = id;
+
+    buffers->tail++;
+    __atomic_store_n(&buffers->ring->tail, buffers->tail, __ATOMIC_RELEASE);
+}
+
+/* Uring Buffers Init
+ *
+ * Registers count buffers of size bytes with the ring
+ * as buffer group group
+ * Returns -1 if the kernel does not support buffer rings
+ */
+int uring_buffers_init(struct uring *ring, struct uring_buffers *buffers,
+                       unsigned short group, unsigned int count,
+                       unsigned int size) {
+    memset(buffers, 0, sizeof(*buffers));
+    buffers->count = count;
+    buffers->size = size;
+    buffers->group = group;
+
+    buffers->ring_size = count * sizeof(struct io_uring_buf);
+    void *shared = mmap(NULL, buffers->ring_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        return -1;
+    }
+    buffers->ring = (struct io_uring_buf_ring *)shared;
+
+    buffers->data = (char *)malloc((size_t)count * size);
+    if (buffers->data == NULL) {
+        munmap(shared, buffers->ring_size);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)shared;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) == -1) {
+        free(buffers->data);
+        munmap(shared, buffers->ring_size);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        uring_buffers_give(buffers, i);
+    }
+    return 0;
+}
+
+/* Uring Buffers Free
+ *
+ * Deallocates the buffers. The ring they were
+ * registered with has to be freed first
+ */
+void uring_buffers_free(struct uring_buffers *buffers) {
+    munmap(buffers->ring, buffers->ring_size);
+    free(buffers->data);
+    memset(buffers, 0, sizeof(*buffers));
+}
+
+/* Uring Recv Multishot
+ *
+ * Starts receiving every datagram that arrives on the socket
+ * into buffers of the group. Each datagram completes with
+ * tag as its user_data until a completion comes without
+ * IORING_CQE_F_MORE, then it has to be started again
+ *
+ * message only sets how much room there is for the sender
+ * and has to stay in place while receiving
+ */
+int uring_recv_multishot(struct uring *ring, int socket,
+                         struct msghdr *message, struct uring_buffers *buffers,
+                         uint64_t tag) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    message->msg_namelen = sizeof(struct sockaddr_in);
+    message->msg_controllen = 0;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = socket;
+    sqe->addr = (uint64_t)(uintptr_t)message;
+    sqe->len = 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffers->group;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = tag;
+    return 0;
+}
+
+/* Uring Poll Multishot
+ *
+ * Completes with tag every time the descriptor
+ * becomes readable
+ */
+int uring_poll_multishot(struct uring *ring, int descriptor, uint64_t tag) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = descriptor;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = tag;
+    return 0;
+}
+
+/* Uring Received Packet
+ *
+ * Finds the packet and the sender in a buffer filled by a
+ * multishot receive, length being the res of the completion
+ * and size set to the number of bytes of the datagram
+ * Returns NULL if the datagram is too short for any header
+ *
+ * The packet gets a terminator after the last byte read
+ */
+packet *uring_received_packet(char *buffer, int length,
+                              struct sockaddr_in **sender_addr,
+                              size_t *size) {
+    size_t start =
+        sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in);
+    if (length < 0 || (size_t)length < start + HEADER_MIN) {
+        return NULL;
+    }
+
+    *size = length - start;
+    packet *data = (packet *)(buffer + start);
+    if (*size < sizeof(packet)) {
+        ((char *)data)[*size] = '\0';
+    } else {
+        data->msg[sizeof(data->msg) - 1] = '\0';
+    }
+
+    *sender_addr =
+        (struct sockaddr_in *)(buffer + sizeof(struct io_uring_recvmsg_out));
+    return data;
+}
+
+/* Uring Take Back
+ *
+ * Removes the entries the kernel did not take from the
+ * submission queue, so a later uring_enter can not submit
+ * them after their data has been reused
+ * Returns the number taken back
+ */
+unsigned int uring_take_back(struct uring *ring) {
+    unsigned int pending = ring->sq_pending;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail - pending,
+                     __ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+    return pending;
+}
+
+/* Uring Reap Sends
+ *
+ * Waits for count sends of batch to complete and reports
+ * the ones that failed. A send the kernel took always
+ * completes, so if waiting fails the queue is polled
+ *
+ * Returns the number of datagrams that failed
+ */
+unsigned int uring_reap_sends(struct uring *ring, struct send_batch *batch,
+                              unsigned int count) {
+    unsigned int failed = 0;
+    unsigned int done = 0;
+    while (done < count) {
+        struct io_uring_cqe *cqe = uring_peek_cqe(ring);
+        if (cqe == NULL) {
+            if (uring_enter(ring, count - done) == -1 && errno != EINTR) {
+                poll(NULL, 0, 1);
+            }
+            continue;
+        }
+        if (cqe->res < 0) {
+            if (batch->report != NULL) {
+                batch->report(&batch->addrs[cqe->user_data], -cqe->res);
+            }
+            failed++;
+        }
+        uring_cqe_seen(ring);
+        done++;
+    }
+    return failed;
+}
+
+/* Uring Send Batch
+ *
+ * Flushes a send batch through the ring in backend with one
+ * sendmsg entry per datagram, all submitted together, and
+ * waits for them so the data can be reused
+ *
+ * Returns the number of datagrams that failed
+ */
+unsigned int uring_send_batch(struct send_batch *batch) {
+    struct uring *ring = (struct uring *)batch->backend;
+    unsigned int failed = 0;
+    unsigned int sent = 0;
+
+    while (sent < batch->count) {
+        // Submit as many as fit in the queue
+        unsigned int queued = 0;
+        while (sent + queued < batch->count && queued < ring->entries) {
+            struct io_uring_sqe *sqe = uring_get_sqe(ring);
+            if (sqe == NULL) {
+                break;
+            }
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = batch->socket;
+            sqe->addr =
+                (uint64_t)(uintptr_t)&batch->msgs[sent + queued].msg_hdr;
+            sqe->len = 1;
+            sqe->user_data = sent + queued;
+            queued++;
+        }
+
+        // Every entry of this ring is a send, so each completion
+        // belongs to one of the datagrams. Only the ones the
+        // kernel took are waited for, even if entering failed
+        uring_enter(ring, queued);
+        unsigned int submitted = queued - uring_take_back(ring);
+        failed += uring_reap_sends(ring, batch, submitted);
+        sent += submitted;
+
+        if (submitted == 0) {
+            // The ring is broken, send the rest one at a time
+            for (unsigned int i = sent; i < batch->count; i++) {
+                if (sendmsg(batch->socket, &batch->msgs[i].msg_hdr, 0) == -1) {
+                    if (batch->report != NULL) {
+                        batch->report(&batch->addrs[i], errno);
+                    }
+                    failed++;
+                }
+            }
+            return failed;
+        }
+    }
+
+    return failed;
+}